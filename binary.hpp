@@ -0,0 +1,80 @@
+#ifndef BINARY_HPP
+#define BINARY_HPP
+
+#include <cstdint>
+#include <string>
+
+// the little-endian encoding of the index files and of the server protocol
+namespace grep
+{
+  /**
+   * appends value as its low bytes, least significant first
+   */
+  inline void put(std::string & out, uint64_t value, int bytes)
+  {
+    for (int i = 0; i < bytes; ++i)
+      out += (char)(value >> (8 * i));
+  }
+
+  /**
+   * appends value seven bits at a time, the high bit set on all bytes
+   * but the last
+   */
+  inline void putVarint(std::string & out, uint64_t value)
+  {
+    for (; value >= 0x80; value >>= 7)
+      out += (char)(value | 0x80);
+    out += (char)value;
+  }
+
+  /**
+   * Reads what put and putVarint wrote, failing rather than reading past
+   * the end
+   */
+  struct Cursor
+  {
+    char const * p;
+    char const * end;
+    bool ok;
+
+    uint64_t get(int bytes)
+    {
+      uint64_t value = 0;
+      if (end - p < bytes)
+      {
+        ok = false;
+        return 0;
+      }
+      for (int i = 0; i < bytes; ++i)
+        value |= (uint64_t)(unsigned char)*p++ << (8 * i);
+      return value;
+    }
+
+    uint64_t getVarint()
+    {
+      uint64_t value = 0;
+      for (int shift = 0; shift < 64; shift += 7)
+      {
+        if (p == end) break;
+        unsigned char c = *p++;
+        value |= (uint64_t)(c & 0x7f) << shift;
+        if (c < 0x80) return value;
+      }
+      ok = false;
+      return 0;
+    }
+
+    std::string getString(size_t n)
+    {
+      if ((size_t)(end - p) < n)
+      {
+        ok = false;
+        return "";
+      }
+      p += n;
+      return std::string(p - n, p);
+    }
+  };
+}
+
+#endif /* BINARY_HPP */
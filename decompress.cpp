@@ -0,0 +1,238 @@
+#include "decompress.hpp"
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <zlib.h>
+#ifdef GREP11_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+namespace grep
+{
+  Compression detectCompression(unsigned char const * head, size_t n)
+  {
+    if (n >= 2 && head[0] == 0x1f && head[1] == 0x8b)
+      return Compression::gzip;
+    if (  n >= 4 && head[0] == 0x28 && head[1] == 0xb5
+       && head[2] == 0x2f && head[3] == 0xfd
+       )
+      return Compression::zstd;
+    return Compression::none;
+  }
+
+  DecompressingReader::DecompressingReader(int fd, Compression compression,
+                                           size_t blockBytes,
+                                           size_t queuedBlocks)
+    : fd(fd), compression(compression), blockBytes(blockBytes),
+      queue(queuedBlocks), done(false), cancelled(false)
+  {
+    this->producer = std::thread(&DecompressingReader::produce, this);
+  }
+
+  /**
+   * the times a side yields before it sleeps on an empty or full queue
+   */
+  static int const spins = 64;
+
+  DecompressingReader::~DecompressingReader()
+  {
+    this->cancelled.store(true);
+    this->signal();
+    this->producer.join();
+  }
+
+  void DecompressingReader::signal()
+  {
+    // taking the lock orders the change before the check of a side
+    // about to sleep, so no wakeup is lost
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->changed.notify_all();
+  }
+
+  bool DecompressingReader::next(std::string & block)
+  {
+    for (int spin = 0; ; ++spin)
+    {
+      if (this->queue.tryPop(block))
+      {
+        this->signal();
+        return true;
+      }
+      if (this->done.load(std::memory_order_acquire))
+        // the producer may have pushed its last block before finishing
+        return this->queue.tryPop(block);
+      if (spin < spins)
+      {
+        std::this_thread::yield();
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(this->mutex);
+      this->changed.wait(lock, [this]() {
+        return !this->queue.empty() || this->done.load();
+      });
+    }
+  }
+
+  bool DecompressingReader::push(std::string & block)
+  {
+    for (int spin = 0; !this->queue.tryPush(block); ++spin)
+    {
+      if (this->cancelled.load()) return false;
+      if (spin < spins)
+      {
+        std::this_thread::yield();
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(this->mutex);
+      this->changed.wait(lock, [this]() {
+        return !this->queue.full() || this->cancelled.load();
+      });
+    }
+    this->signal();
+    return true;
+  }
+
+  void DecompressingReader::produce()
+  {
+    if (this->compression == Compression::gzip)
+      this->inflateGzip();
+    else if (this->compression == Compression::zstd)
+      this->inflateZstd();
+    this->done.store(true, std::memory_order_release);
+    this->signal();
+  }
+
+  /**
+   * reads up to n bytes, retrying interrupted reads
+   * @return the number of bytes read, or -1 on errors
+   */
+  static ssize_t readSome(int fd, char * buffer, size_t n)
+  {
+    while (true)
+    {
+      ssize_t got = read(fd, buffer, n);
+      if (got >= 0 || errno != EINTR) return got;
+    }
+  }
+
+  void DecompressingReader::inflateGzip()
+  {
+    z_stream z;
+    std::memset(&z, 0, sizeof(z));
+    // 15 window bits, +32 to accept both gzip and zlib headers
+    if (inflateInit2(&z, 15 + 32) != Z_OK)
+    {
+      this->error = "cannot initialize zlib";
+      return;
+    }
+
+    std::vector<char> input(128 << 10);
+    std::string block(this->blockBytes, '\0');
+    z.next_out = (Bytef *)&block[0];
+    z.avail_out = block.size();
+    bool eof = false;
+    int res = Z_OK;
+    while (!this->cancelled.load())
+    {
+      if (z.avail_in == 0 && !eof)
+      {
+        ssize_t got = readSome(this->fd, input.data(), input.size());
+        if (got < 0)
+        {
+          this->error = std::strerror(errno);
+          break;
+        }
+        eof = got == 0;
+        z.next_in = (Bytef *)input.data();
+        z.avail_in = got;
+      }
+      if (z.avail_in == 0 && eof)
+      {
+        if (res != Z_STREAM_END)
+          this->error = "unexpected end of compressed data";
+        break;
+      }
+
+      res = inflate(&z, Z_NO_FLUSH);
+      if (res == Z_STREAM_END)
+        // gzip files may hold several members one after another
+        inflateReset(&z);
+      else if (res != Z_OK && res != Z_BUF_ERROR)
+      {
+        this->error = z.msg != nullptr ? z.msg : "corrupt compressed data";
+        break;
+      }
+
+      if (z.avail_out == 0)
+      {
+        if (!this->push(block)) break;
+        block.assign(this->blockBytes, '\0');
+        z.next_out = (Bytef *)&block[0];
+        z.avail_out = block.size();
+      }
+    }
+
+    block.resize(block.size() - z.avail_out);
+    if (!block.empty())
+      this->push(block);
+    inflateEnd(&z);
+  }
+
+  void DecompressingReader::inflateZstd()
+  {
+#ifdef GREP11_WITH_ZSTD
+    ZSTD_DStream * stream = ZSTD_createDStream();
+    if (stream == nullptr)
+    {
+      this->error = "cannot initialize zstd";
+      return;
+    }
+    ZSTD_initDStream(stream);
+
+    std::vector<char> input(ZSTD_DStreamInSize());
+    std::string block(this->blockBytes, '\0');
+    ZSTD_outBuffer out = { &block[0], block.size(), 0 };
+    size_t hint = 1;
+    while (!this->cancelled.load())
+    {
+      ssize_t got = readSome(this->fd, input.data(), input.size());
+      if (got < 0)
+      {
+        this->error = std::strerror(errno);
+        break;
+      }
+      if (got == 0)
+      {
+        // a non-zero hint means a frame is not finished
+        if (hint != 0)
+          this->error = "unexpected end of compressed data";
+        break;
+      }
+      ZSTD_inBuffer in = { input.data(), (size_t)got, 0 };
+      while (in.pos < in.size && !this->cancelled.load())
+      {
+        hint = ZSTD_decompressStream(stream, &out, &in);
+        if (ZSTD_isError(hint))
+        {
+          this->error = ZSTD_getErrorName(hint);
+          break;
+        }
+        if (out.pos == out.size)
+        {
+          if (!this->push(block)) break;
+          block.assign(this->blockBytes, '\0');
+          out = { &block[0], block.size(), 0 };
+        }
+      }
+      if (!this->error.empty()) break;
+    }
+
+    block.resize(out.pos);
+    if (!block.empty())
+      this->push(block);
+    ZSTD_freeDStream(stream);
+#else
+    this->error = "zstd support is not compiled in, rebuild with make ZSTD=1";
+#endif
+  }
+}
@@ -0,0 +1,144 @@
+#ifndef DECOMPRESS_HPP
+#define DECOMPRESS_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace grep
+{
+  /**
+   * A bounded single-producer single-consumer queue. Pushing and popping
+   * never lock: each side owns one index and publishes it to the other
+   * with release/acquire ordering.
+   */
+  template <typename T>
+  class BoundedQueue
+  {
+  public:
+    BoundedQueue(size_t capacity)
+      : slots(capacity + 1), head(0), tail(0) {}
+
+    /**
+     * moves value into the queue unless it is full
+     * @param value
+     * @return false iff the queue is full
+     */
+    bool tryPush(T & value)
+    {
+      size_t tail = this->tail.load(std::memory_order_relaxed);
+      size_t next = (tail + 1) % this->slots.size();
+      if (next == this->head.load(std::memory_order_acquire)) return false;
+      this->slots[tail] = std::move(value);
+      this->tail.store(next, std::memory_order_release);
+      return true;
+    }
+
+    /**
+     * moves the oldest value out of the queue unless it is empty
+     * @param value
+     * @return false iff the queue is empty
+     */
+    bool tryPop(T & value)
+    {
+      size_t head = this->head.load(std::memory_order_relaxed);
+      if (head == this->tail.load(std::memory_order_acquire)) return false;
+      value = std::move(this->slots[head]);
+      this->head.store((head + 1) % this->slots.size(),
+                       std::memory_order_release);
+      return true;
+    }
+
+    bool empty() const
+    {
+      return this->head.load(std::memory_order_acquire)
+        == this->tail.load(std::memory_order_acquire);
+    }
+
+    bool full() const
+    {
+      size_t next = (this->tail.load(std::memory_order_acquire) + 1)
+        % this->slots.size();
+      return next == this->head.load(std::memory_order_acquire);
+    }
+
+  private:
+    std::vector<T> slots;
+    std::atomic<size_t> head;
+    std::atomic<size_t> tail;
+  };
+
+  enum class Compression { none, gzip, zstd };
+
+  /**
+   * tells the compression of a file from its first bytes
+   * @param head
+   * @param n number of bytes in head
+   * @return
+   */
+  Compression detectCompression(unsigned char const * head, size_t n);
+
+  /**
+   * Decompresses a file on its own thread, handing blocks of plain text
+   * over a BoundedQueue, so that decompressing the next blocks overlaps
+   * with matching the current one. A side finding the queue empty or
+   * full spins a little, then sleeps until the other side pops, pushes,
+   * finishes or is cancelled, so a matcher waiting on a slow inflate
+   * does not take a core.
+   */
+  class DecompressingReader
+  {
+  public:
+    /**
+     * starts decompressing; fd is read from its current offset and is
+     * not closed
+     * @param fd
+     * @param compression
+     * @param blockBytes size of the blocks handed over
+     * @param queuedBlocks number of blocks decompressed ahead at most
+     */
+    DecompressingReader(int fd, Compression compression,
+                        size_t blockBytes = 256 << 10,
+                        size_t queuedBlocks = 8);
+    ~DecompressingReader();
+
+    /**
+     * takes the next block of plain text, waiting for it if need be
+     * @param block
+     * @return false at the end of the stream
+     */
+    bool next(std::string & block);
+
+    /**
+     * gives the error which ended the stream, empty if none did
+     */
+    std::string getError() const { return this->error; }
+
+  private:
+    void produce();
+    void inflateGzip();
+    void inflateZstd();
+    bool push(std::string & block);
+    /**
+     * wakes the other side if it sleeps
+     */
+    void signal();
+
+    int fd;
+    Compression compression;
+    size_t blockBytes;
+    BoundedQueue<std::string> queue;
+    std::atomic<bool> done;
+    std::atomic<bool> cancelled;
+    std::string error;
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::thread producer;
+  };
+}
+
+#endif /* DECOMPRESS_HPP */
@@ -0,0 +1,619 @@
+#include "dfa.hpp"
+#include <algorithm>
+#include <cstring>
+
+namespace nfa_dfa
+{
+  int32_t const DFA::unknown;
+  int8_t const DFA::unanalyzed;
+  int8_t const DFA::slow;
+
+  /**
+   * says whether an unanchored scan adds the start states of an automaton
+   * back after a byte of the given side: without assertions always, with
+   * them when they lead anywhere in some context following
+   */
+  static bool restartsAfter(nfa_api::CompiledNFA const & nfa, uint8_t before)
+  {
+    if (!nfa.hasAssertions()) return true;
+    for (uint8_t after = 0; after < 3; ++after)
+      if (nfa.restarts(nfa_api::CompiledNFA::contextOf(before, after)))
+        return true;
+    return false;
+  }
+
+  DFA::DFA(nfa_api::CompiledNFA const & nfa, bool anchored,
+           size_t maxStates, bool complemented)
+    : nfa(nfa), anchored(anchored), maxStates(std::max<size_t>(maxStates, 3)),
+      complemented(complemented), stride(nfa.classCount()),
+      contextual(nfa.hasAssertions())
+  {
+    for (int32_t b = 0; b < 256; ++b)
+      this->classes[b] = nfa.byteClass(b);
+    for (uint8_t before = 0; before < 3; ++before)
+      this->restarts[before] = restartsAfter(nfa, before);
+    this->clear();
+  }
+
+  void DFA::clear()
+  {
+    this->ids.clear();
+    this->sets.clear();
+    this->flags.clear();
+    this->ahead.clear();
+    this->table.clear();
+    this->exits.clear();
+    std::vector<int32_t> set;
+    this->dead = this->intern(set);
+    for (uint8_t side = 0; side < 3; ++side)
+    {
+      set = this->nfa.startClosure(this->known(side));
+      std::sort(set.begin(), set.end());
+      this->mark(set, side);
+      this->starts[side] = this->intern(set);
+    }
+  }
+
+  void DFA::mark(std::vector<int32_t> & set, uint8_t side) const
+  {
+    // the side goes last, as the only negative member
+    if (this->contextual && !set.empty())
+      set.push_back(-1 - side);
+  }
+
+  uint8_t DFA::known(uint8_t side)
+  {
+    return side == nfa_api::CompiledNFA::edgeSide
+      ? nfa_api::CompiledNFA::atLineStart : 0;
+  }
+
+  int32_t DFA::intern(std::vector<int32_t> & set)
+  {
+    auto it = this->ids.find(set);
+    if (it != this->ids.end()) return it->second;
+    int32_t s = this->sets.size();
+    // the sides of the next byte with which a final state is reached
+    uint8_t ahead = 0;
+    if (!this->contextual)
+    {
+      for (int32_t q : set)
+        if (this->nfa.isFinal(q)) ahead = 7;
+    }
+    else if (!set.empty())
+    {
+      uint8_t before = -1 - set.back();
+      for (uint8_t after = 0; after < 3; ++after)
+      {
+        uint8_t context = nfa_api::CompiledNFA::contextOf(before, after);
+        for (size_t i = 0; i + 1 < set.size() && !(ahead >> after & 1); ++i)
+          for (int32_t r : this->nfa.closure(set[i], context))
+            if (this->nfa.isFinal(r))
+            {
+              ahead |= 1 << after;
+              break;
+            }
+      }
+    }
+    // a state accepting depending on the next byte is never skipped over
+    this->flags.push_back(ahead == 7 ? accepting | skippable | lineSkippable
+                          : ahead != 0 ? conditional
+                          : skippable | lineSkippable);
+    this->ahead.push_back(ahead);
+    this->table.resize(this->table.size() + this->stride, unknown);
+    Exits exits = { unanalyzed, unanalyzed, { 0, 0, 0 } };
+    this->exits.push_back(exits);
+    this->ids[set] = s;
+    this->sets.push_back(std::move(set));
+    return s;
+  }
+
+  void DFA::successors(int32_t s, unsigned char c)
+  {
+    using nfa_api::CompiledNFA;
+    std::vector<int32_t> const & set = this->sets[s];
+    uint8_t after = CompiledNFA::sideOf(c);
+    uint8_t then = this->known(after);
+    // the assertions before c hold or not now that c is known
+    std::vector<int32_t> const * from = &set;
+    if (this->contextual && !set.empty())
+    {
+      uint8_t now = CompiledNFA::contextOf(-1 - set.back(), after);
+      std::vector<int32_t> & current = this->scratch.current;
+      current.clear();
+      this->scratch.nextGeneration(this->nfa.size());
+      for (size_t i = 0; i + 1 < set.size(); ++i)
+        for (int32_t r : this->nfa.closure(set[i], now))
+          if (this->scratch.visit(r))
+            current.push_back(r);
+      from = &current;
+    }
+
+    std::vector<int32_t> & next = this->scratch.next;
+    next.clear();
+    this->scratch.nextGeneration(this->nfa.size());
+    for (int32_t q : *from)
+      for (CompiledNFA::Transition t : this->nfa.transitions(q))
+        if (t.bytes[c])
+          for (int32_t r : this->nfa.closure(t.dst, then))
+            if (this->scratch.visit(r))
+              next.push_back(r);
+    if (!this->anchored && this->restarts[after])
+      for (int32_t q : this->nfa.startClosure(then))
+        if (this->scratch.visit(q))
+          next.push_back(q);
+    std::sort(next.begin(), next.end());
+    this->mark(next, after);
+  }
+
+  bool DFA::loops(int32_t s, unsigned char c)
+  {
+    int32_t t = this->table[(size_t)s * this->stride + this->classes[c]];
+    if (t != unknown) return t == s;
+    // no interning here: it could clear the cache under the caller
+    this->successors(s, c);
+    return this->scratch.next == this->sets[s];
+  }
+
+  void DFA::analyze(int32_t s)
+  {
+    Exits & exits = this->exits[s];
+    exits.count = 0;
+    // bytes of a class go the same way, so each class is looked at once
+    int8_t looping[256];
+    std::memset(looping, -1, sizeof(looping));
+    for (int32_t b = 0; b < 256; ++b)
+    {
+      int8_t & l = looping[this->classes[b]];
+      if (l < 0) l = this->loops(s, b);
+      if (l) continue;
+      if (exits.count == 3)
+      {
+        exits.count = exits.lineCount = slow;
+        this->flags[s] &= ~(skippable | lineSkippable);
+        return;
+      }
+      exits.bytes[exits.count++] = b;
+    }
+    exits.lineCount = exits.count;
+    if (!looping[this->classes['\n']]) return;
+    if (exits.count < 3)
+      exits.bytes[exits.lineCount++] = '\n';
+    else
+    {
+      exits.lineCount = slow;
+      this->flags[s] &= ~lineSkippable;
+    }
+  }
+
+  char const * DFA::skipTo(int32_t s, char const * p, char const * end,
+                           bool lines)
+  {
+    Exits & exits = this->exits[s];
+    if (exits.count == unanalyzed) this->analyze(s);
+    int8_t count = lines ? exits.lineCount : exits.count;
+    return count == slow
+      ? p : nfa_literal::findAny(p, end, exits.bytes, count);
+  }
+
+  int32_t DFA::step(int32_t s, unsigned char c)
+  {
+    this->successors(s, c);
+    std::vector<int32_t> set(this->scratch.next);
+    if (this->ids.find(set) == this->ids.end()
+        && this->sets.size() >= this->maxStates)
+    {
+      // the cache is full: start over, keeping only where we are going
+      this->clear();
+      return this->intern(set);
+    }
+    int32_t t = this->intern(set);
+    this->table[(size_t)s * this->stride + this->classes[c]] = t;
+    return t;
+  }
+
+  bool DFA::matches(char const * begin, char const * end)
+  {
+    bool found;
+    if (this->anchored)
+    {
+      int32_t s = this->starts[nfa_api::CompiledNFA::edgeSide];
+      char const * p = this->skip(s, begin, end);
+      while (p != end && s != this->dead)
+      {
+        s = this->next(s, *p++);
+        p = this->skip(s, p, end);
+      }
+      found = this->acceptsBefore(s, p, end);
+    }
+    else
+      found = this->firstMatchEnd(begin, end) != nullptr;
+    return found != this->complemented;
+  }
+
+  char const * DFA::firstMatchEnd(char const * begin, char const * end)
+  {
+    int32_t s = this->starts[nfa_api::CompiledNFA::edgeSide];
+    if (this->acceptsBefore(s, begin, end)) return begin;
+    char const * p = this->skip(s, begin, end);
+    while (p != end)
+    {
+      s = this->next(s, *p++);
+      uint8_t flags = this->flags[s];
+      if (flags == 0) continue;
+      if (this->acceptsBefore(s, p, end)) return p;
+      p = this->skip(s, p, end);
+    }
+    return nullptr;
+  }
+
+  char const * DFA::lastMatchEnd(char const * begin, char const * end,
+                                 int before)
+  {
+    int32_t s = this->starts[before < 0 ? nfa_api::CompiledNFA::edgeSide
+                             : nfa_api::CompiledNFA::sideOf(before)];
+    char const * p = this->skip(s, begin, end);
+    char const * last = this->acceptsBefore(s, p, end) ? p : nullptr;
+    while (p != end)
+    {
+      s = this->next(s, *p++);
+      // unanchored, the start states may come back after the dead state
+      if (s == this->dead && this->anchored) break;
+      p = this->skip(s, p, end);
+      if (this->acceptsBefore(s, p, end)) last = p;
+    }
+    return last;
+  }
+
+  char const * DFA::lastMatchBegin(char const * begin, char const * end)
+  {
+    int32_t s = this->starts[nfa_api::CompiledNFA::edgeSide];
+    char const * last = this->acceptsAfter(s, begin, end) ? end : nullptr;
+    for (char const * p = end; p != begin; --p)
+    {
+      s = this->next(s, p[-1]);
+      if (s == this->dead && this->anchored) break;
+      if (this->acceptsAfter(s, begin, p - 1)) last = p - 1;
+    }
+    return last;
+  }
+
+  uint64_t DFA::countLines(char const * begin, char const * end)
+  {
+    uint64_t lines = 0;
+    char const * p = begin;
+    while (p < end)
+    {
+      int32_t s = this->starts[nfa_api::CompiledNFA::edgeSide];
+      bool hit = this->acceptsBefore(s, p, end);
+      if (!hit) p = this->skip(s, p, end, true);
+      while (!hit && p != end && *p != '\n')
+      {
+        s = this->next(s, *p++);
+        uint8_t flags = this->flags[s];
+        if (flags == 0) continue;
+        hit = this->acceptsBefore(s, p, end);
+        if (!hit) p = this->skip(s, p, end, true);
+      }
+      lines += hit;
+      // the rest of the line cannot change the answer
+      p = (char const *)std::memchr(p, '\n', end - p);
+      if (p == nullptr) break;
+      ++p;
+    }
+    return lines;
+  }
+
+  LineCounter::LineCounter(nfa_api::AbstractNFA & nfa, bool invert)
+    : dfa(nfa.getCompiled(), false), prefilter(nfa.getPrefilter()),
+      invert(invert)
+  {
+  }
+
+  uint64_t LineCounter::count(char const * begin, char const * end)
+  {
+    uint64_t matching = this->countMatching(begin, end);
+    if (!this->invert || begin == end) return matching;
+    // every line but the matching ones, the last one may lack a newline
+    uint64_t lines = std::count(begin, end, '\n') + (end[-1] != '\n');
+    return lines - matching;
+  }
+
+  uint64_t LineCounter::countMatching(char const * begin, char const * end)
+  {
+    if (this->prefilter == nullptr) return this->dfa.countLines(begin, end);
+    // only the lines holding the literal can match
+    uint64_t lines = 0;
+    char const * p = begin;
+    while (p < end)
+    {
+      char const * hit = this->prefilter->find(p, end);
+      if (hit == end) break;
+      char const * lineBegin = (char const *)memrchr(p, '\n', hit - p);
+      lineBegin = lineBegin == nullptr ? p : lineBegin + 1;
+      char const * nl = (char const *)std::memchr(hit, '\n', end - hit);
+      char const * lineEnd = nl == nullptr ? end : nl;
+      lines += this->dfa.countLines(lineBegin, lineEnd);
+      p = nl == nullptr ? end : nl + 1;
+    }
+    return lines;
+  }
+
+  int32_t const ProductDFA::unknown;
+  int32_t const ProductDFA::doneA;
+  int32_t const ProductDFA::doneB;
+
+  ProductDFA::ProductDFA(nfa_api::CompiledNFA const & a,
+                         nfa_api::CompiledNFA const & b, bool anchored,
+                         size_t maxStates)
+    : a(a), b(b), anchored(anchored), maxStates(std::max<size_t>(maxStates, 3)),
+      contextual(a.hasAssertions() || b.hasAssertions())
+  {
+    // a class of the product is a pair of classes of a and b
+    std::vector<int16_t> pairs(a.classCount() * b.classCount(), -1);
+    this->stride = 0;
+    for (int32_t c = 0; c < 256; ++c)
+    {
+      int16_t & pair = pairs[a.byteClass(c) * b.classCount() + b.byteClass(c)];
+      if (pair < 0) pair = this->stride++;
+      this->classes[c] = pair;
+    }
+    for (uint8_t before = 0; before < 3; ++before)
+    {
+      this->restartsA[before] = restartsAfter(a, before);
+      this->restartsB[before] = restartsAfter(b, before);
+    }
+    this->clear();
+  }
+
+  void ProductDFA::clear()
+  {
+    using nfa_api::CompiledNFA;
+    this->ids.clear();
+    this->sets.clear();
+    this->matching.clear();
+    this->matchingAtEnd.clear();
+    this->table.clear();
+    std::vector<int32_t> set;
+    this->dead = this->intern(set);
+    std::vector<int32_t> & next = this->scratch.next;
+    next.clear();
+    this->scratch.nextGeneration(this->a.size() + this->b.size());
+    std::vector<int32_t> const & startA =
+      this->a.startClosure(CompiledNFA::atLineStart);
+    std::vector<int32_t> const & startB =
+      this->b.startClosure(CompiledNFA::atLineStart);
+    this->add(0, startA, next);
+    this->add(this->a.size(), startB, next);
+    this->settle(next);
+    this->mark(next, CompiledNFA::edgeSide);
+    set = next;
+    this->start = this->intern(set);
+  }
+
+  void ProductDFA::mark(std::vector<int32_t> & set, uint8_t side) const
+  {
+    // the side goes last, after the sorted states
+    if (this->contextual && !set.empty())
+      set.push_back(sideMark - side);
+  }
+
+  uint8_t ProductDFA::sideIn(std::vector<int32_t> const & set) const
+  {
+    return this->contextual && !set.empty() ? sideMark - set.back()
+      : nfa_api::CompiledNFA::edgeSide;
+  }
+
+  void ProductDFA::settle(std::vector<int32_t> & set)
+  {
+    int32_t n = this->a.size();
+    bool inA = false, inB = false, finalA = false, finalB = false;
+    bool markedA = false, markedB = false;
+    for (int32_t q : set)
+      if (q == doneA) markedA = true;
+      else if (q == doneB) markedB = true;
+      else if (q < n)
+      {
+        inA = true;
+        finalA = finalA || this->a.isFinal(q);
+      }
+      else
+      {
+        inB = true;
+        finalB = finalB || this->b.isFinal(q - n);
+      }
+
+    if (this->anchored)
+    {
+      // either side dead kills the product
+      if (!inA || !inB) set.clear();
+    }
+    else
+    {
+      // a side which has matched needs no more states
+      if (finalA && !markedA)
+      {
+        set.erase(std::remove_if(set.begin(), set.end(),
+                                 [n](int32_t q) { return q >= 0 && q < n; }),
+                  set.end());
+        set.push_back(doneA);
+      }
+      if (finalB && !markedB)
+      {
+        set.erase(std::remove_if(set.begin(), set.end(),
+                                 [n](int32_t q) { return q >= n; }),
+                  set.end());
+        set.push_back(doneB);
+      }
+    }
+    std::sort(set.begin(), set.end());
+  }
+
+  int32_t ProductDFA::intern(std::vector<int32_t> & set)
+  {
+    auto it = this->ids.find(set);
+    if (it != this->ids.end()) return it->second;
+    int32_t s = this->sets.size();
+    int32_t n = this->a.size();
+    // the states are closed in the context of the end of the input to
+    // tell whether both would match there
+    uint8_t context = nfa_api::CompiledNFA::contextOf(
+      this->sideIn(set), nfa_api::CompiledNFA::edgeSide);
+    bool markedA = false, markedB = false, finalA = false, finalB = false;
+    for (int32_t q : set)
+      if (q == doneA) markedA = true;
+      else if (q == doneB) markedB = true;
+      else if (q >= 0)
+      {
+        nfa_api::CompiledNFA const & nfa = q < n ? this->a : this->b;
+        int32_t offset = q < n ? 0 : n;
+        bool & final = q < n ? finalA : finalB;
+        if (!final)
+          for (int32_t r : nfa.closure(q - offset, context))
+            if (nfa.isFinal(r))
+            {
+              final = true;
+              break;
+            }
+      }
+    this->matching.push_back(!this->anchored && markedA && markedB);
+    this->matchingAtEnd.push_back((markedA || finalA) && (markedB || finalB));
+    this->table.resize(this->table.size() + this->stride, unknown);
+    this->ids[set] = s;
+    this->sets.push_back(std::move(set));
+    return s;
+  }
+
+  int32_t ProductDFA::step(int32_t s, unsigned char c)
+  {
+    using nfa_api::CompiledNFA;
+    std::vector<int32_t> const & from = this->sets[s];
+    int32_t n = this->a.size();
+    uint8_t after = CompiledNFA::sideOf(c);
+    uint8_t now = CompiledNFA::contextOf(this->sideIn(from), after);
+    uint8_t then = after == CompiledNFA::edgeSide
+      ? CompiledNFA::atLineStart : 0;
+    bool markedA = false, markedB = false;
+
+    // the states before c, closed in the assertions c decides
+    std::vector<int32_t> & current = this->scratch.current;
+    current.clear();
+    this->scratch.nextGeneration(n + this->b.size());
+    for (int32_t q : from)
+    {
+      markedA = markedA || q == doneA;
+      markedB = markedB || q == doneB;
+      if (q < 0) continue;
+      nfa_api::CompiledNFA const & nfa = q < n ? this->a : this->b;
+      int32_t offset = q < n ? 0 : n;
+      if (this->contextual)
+        this->add(offset, nfa.closure(q - offset, now), current);
+      else
+        current.push_back(q);
+    }
+    // so a side may have matched before c
+    if (this->contextual && !this->anchored)
+      for (int32_t q : current)
+      {
+        if (q < n) markedA = markedA || this->a.isFinal(q);
+        else markedB = markedB || this->b.isFinal(q - n);
+      }
+
+    std::vector<int32_t> & next = this->scratch.next;
+    next.clear();
+    this->scratch.nextGeneration(n + this->b.size());
+    if (markedA) next.push_back(doneA);
+    if (markedB) next.push_back(doneB);
+    for (int32_t q : current)
+    {
+      if (q < n ? markedA : markedB) continue;
+      nfa_api::CompiledNFA const & nfa = q < n ? this->a : this->b;
+      int32_t offset = q < n ? 0 : n;
+      for (CompiledNFA::Transition t : nfa.transitions(q - offset))
+        if (t.bytes[c])
+          this->add(offset, nfa.closure(t.dst, then), next);
+    }
+    if (!this->anchored)
+    {
+      std::vector<int32_t> const & startA = this->a.startClosure(then);
+      std::vector<int32_t> const & startB = this->b.startClosure(then);
+      if (!markedA && this->restartsA[after])
+        this->add(0, startA, next);
+      if (!markedB && this->restartsB[after])
+        this->add(n, startB, next);
+    }
+    this->settle(next);
+    this->mark(next, after);
+
+    std::vector<int32_t> set(next);
+    if (this->ids.find(set) == this->ids.end()
+        && this->sets.size() >= this->maxStates)
+    {
+      // the cache is full: start over, keeping only where we are going
+      this->clear();
+      return this->intern(set);
+    }
+    int32_t t = this->intern(set);
+    this->table[(size_t)s * this->stride + this->classes[c]] = t;
+    return t;
+  }
+
+  bool ProductDFA::matches(char const * begin, char const * end)
+  {
+    int32_t s = this->start;
+    for (char const * p = begin; p != end; ++p)
+    {
+      if (this->matching[s]) return true;
+      // unanchored, the start states may come back after the dead state
+      if (s == this->dead && this->anchored) break;
+      s = this->next(s, *p);
+    }
+    return this->matchingAtEnd[s];
+  }
+
+  Intersection::Intersection(nfa_api::AbstractNFA & a,
+                             nfa_api::AbstractNFA & b)
+    : prefilterA(a.getPrefilter()), prefilterB(b.getPrefilter()),
+      whole(a.getCompiled(), b.getCompiled(), true),
+      part(a.getCompiled(), b.getCompiled(), false)
+  {
+  }
+
+  bool Intersection::prefiltered(char const * begin, char const * end) const
+  {
+    return (this->prefilterA && this->prefilterA->find(begin, end) == end)
+      || (this->prefilterB && this->prefilterB->find(begin, end) == end);
+  }
+
+  bool Intersection::accept(std::string const & input)
+  {
+    char const * begin = input.data();
+    char const * end = begin + input.size();
+    return !this->prefiltered(begin, end) && this->whole.matches(begin, end);
+  }
+
+  bool Intersection::search(char const * begin, char const * end)
+  {
+    return !this->prefiltered(begin, end) && this->part.matches(begin, end);
+  }
+
+  SpanFinder::SpanFinder(nfa_api::AbstractNFA & nfa)
+    : forward(nfa.getCompiled(), false),
+      reverse(nfa.getReversed(), false),
+      longest(nfa.getCompiled(), true)
+  {
+  }
+
+  bool SpanFinder::find(char const * begin, char const * end, Span & span)
+  {
+    if (this->forward.firstMatchEnd(begin, end) == nullptr) return false;
+    // scanning back from the earliest end alone would miss longer
+    // matches starting further left, as "c" hides "abcd" in abcd|c,
+    // so the reverse scan starts from the end of the input
+    char const * first = this->reverse.lastMatchBegin(begin, end);
+    char const * last = this->longest.lastMatchEnd(
+      first, end, first == begin ? -1 : (unsigned char)first[-1]);
+    span.begin = first - begin;
+    span.end = last - begin;
+    return true;
+  }
+}
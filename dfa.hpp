@@ -0,0 +1,467 @@
+#ifndef DFA_HPP
+#define DFA_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+#include "nfa_api.hpp"
+
+namespace nfa_dfa
+{
+  /**
+   * A DFA built lazily from a CompiledNFA by the subset construction:
+   * a DFA state is a set of NFA states, and a transition is computed the
+   * first time it is taken and then looked up in a table.
+   * The table has one column per byte class of the NFA rather than one
+   * per byte, as bytes of a class always lead to the same state; most
+   * patterns only tell a handful of classes apart, which keeps the rows
+   * short and the hot ones in cache.
+   * The table is bounded; once it holds maxStates states it is thrown
+   * away and rebuilt from the state being left, so memory stays bounded
+   * and matching stays linear in the input.
+   * A state which loops to itself on all bytes but at most three, as
+   * the start state of an unanchored search or the .* of a pattern, is
+   * left with findAny, a memchr for several bytes, rather than one table
+   * step per byte; whether a state is such is worked out the first time
+   * the scan enters it.
+   * With assertions, a state also holds the side of the byte before it,
+   * and the NFA states in it are closed in what that side alone tells,
+   * the assertions which depend on the next byte being taken when the
+   * next byte is read; so a state accepts depending on the next byte,
+   * which the scans look at only for the states where it matters. The
+   * start states are only added back after the bytes where they lead
+   * anywhere: for a pattern anchored to line starts, after a newline, so
+   * the state with nothing under way loops on every other byte and the
+   * scans go from line to line with findAny.
+   * It caches what it computes, so each thread needs its own DFA; the
+   * CompiledNFA underneath is only read and can be shared.
+   */
+  class DFA
+  {
+  public:
+    /**
+     * @param nfa
+     * @param anchored whether matches must begin where the scan begins;
+     *        otherwise the start states are added back at every position
+     * @param maxStates number of states cached before starting over
+     * @param complemented whether matches answers the opposite; a DFA is
+     *        complemented by flipping which of its states accept, the
+     *        dead state, from which nothing is accepted any more,
+     *        becoming an accepting sink
+     */
+    DFA(nfa_api::CompiledNFA const & nfa, bool anchored,
+        size_t maxStates = 4096, bool complemented = false);
+
+    /**
+     * given an input [begin, end)
+     * says whether it is accepted, as a whole by an anchored DFA and as
+     * some substring by an unanchored one, or not when complemented.
+     * Either way the scan stops as soon as the answer is known: at the
+     * first match when unanchored, at the dead state when anchored.
+     * @param begin
+     * @param end
+     * @return
+     */
+    bool matches(char const * begin, char const * end);
+
+    /**
+     * reads [begin, end) forwards and stops at the first match
+     * @param begin
+     * @param end
+     * @return where the earliest match ends, null if none does
+     */
+    char const * firstMatchEnd(char const * begin, char const * end);
+
+    /**
+     * reads [begin, end) forwards until no match can follow
+     * @param begin
+     * @param end
+     * @param before the byte before begin, for the assertions, or -1 if
+     *        begin is the start of the input
+     * @return where the last match ends, null if none does
+     */
+    char const * lastMatchEnd(char const * begin, char const * end,
+                              int before = -1);
+
+    /**
+     * reads [begin, end) backwards from end, which is how the reverse
+     * automaton finds where matches start
+     * @param begin
+     * @param end
+     * @return the lowest p such that the scan matched [p, end),
+     *         null if there is none
+     */
+    char const * lastMatchBegin(char const * begin, char const * end);
+
+    /**
+     * counts the lines of [begin, end) with a match in one pass: the scan
+     * goes back to the start state at every newline and skips the rest
+     * of a line once it matched; a last line without a newline counts.
+     * Only meaningful for an unanchored DFA.
+     * @param begin
+     * @param end
+     * @return
+     */
+    uint64_t countLines(char const * begin, char const * end);
+
+    /**
+     * the number of states cached
+     */
+    size_t stateCount() const { return this->sets.size(); }
+
+    /**
+     * the bytes taken by the transition table
+     */
+    size_t tableBytes() const
+    {
+      return this->table.size() * sizeof(int32_t);
+    }
+
+  private:
+    static int32_t const unknown = -1;
+    static int8_t const unanalyzed = -1;
+    static int8_t const slow = 4;
+
+    /**
+     * what a scan looks at after every step, in one byte per state
+     */
+    enum Flag : uint8_t
+    {
+      accepting = 1,
+      // the state may be left with findAny, until analyzed
+      skippable = 2,
+      // likewise for scans stopping at newlines
+      lineSkippable = 4,
+      // whether it accepts depends on the next byte, see ahead
+      conditional = 8
+    };
+
+    /**
+     * the bytes leaving a state, when there are few enough to skip to
+     */
+    struct Exits
+    {
+      /**
+       * the number of bytes leaving the state, slow if more than 3,
+       * unanalyzed until it is looked at
+       */
+      int8_t count;
+      /**
+       * the same with the newline added, for scans stopping at line ends
+       */
+      int8_t lineCount;
+      char bytes[3];
+    };
+
+    int32_t next(int32_t s, unsigned char c)
+    {
+      int32_t t = this->table[(size_t)s * this->stride + this->classes[c]];
+      return t != unknown ? t : this->step(s, c);
+    }
+
+    /**
+     * skips from p over the bytes which do not leave the state s
+     * @param s
+     * @param p
+     * @param end
+     * @param lines whether to stop at newlines too
+     * @return the first byte leaving s, or p when s is not worth it
+     */
+    char const * skip(int32_t s, char const * p, char const * end,
+                      bool lines = false)
+    {
+      return this->flags[s] & (lines ? lineSkippable : skippable)
+        ? this->skipTo(s, p, end, lines) : p;
+    }
+
+    /**
+     * says whether the state s accepts at p, the scan reading forwards
+     */
+    bool acceptsBefore(int32_t s, char const * p, char const * end) const
+    {
+      uint8_t flags = this->flags[s];
+      if (!(flags & conditional)) return flags & accepting;
+      return this->ahead[s] >> (p == end ? nfa_api::CompiledNFA::edgeSide
+                                : nfa_api::CompiledNFA::sideOf(*p)) & 1;
+    }
+
+    /**
+     * likewise, the scan reading backwards
+     */
+    bool acceptsAfter(int32_t s, char const * begin, char const * p) const
+    {
+      uint8_t flags = this->flags[s];
+      if (!(flags & conditional)) return flags & accepting;
+      return this->ahead[s] >> (p == begin ? nfa_api::CompiledNFA::edgeSide
+                                : nfa_api::CompiledNFA::sideOf(p[-1])) & 1;
+    }
+
+    char const * skipTo(int32_t s, char const * p, char const * end,
+                        bool lines);
+    /**
+     * what is known of the context after a byte of the given side,
+     * before the next byte is read
+     */
+    static uint8_t known(uint8_t side);
+    /**
+     * appends the side of the byte before to a set, for automata with
+     * assertions; the empty set goes without, as it is the dead state
+     */
+    void mark(std::vector<int32_t> & set, uint8_t side) const;
+    void successors(int32_t s, unsigned char c);
+    bool loops(int32_t s, unsigned char c);
+    void analyze(int32_t s);
+    int32_t step(int32_t s, unsigned char c);
+    int32_t intern(std::vector<int32_t> & set);
+    void clear();
+
+    nfa_api::CompiledNFA const & nfa;
+    bool anchored;
+    size_t maxStates;
+    bool complemented;
+    uint8_t classes[256];
+    size_t stride;
+    nfa_api::MatchScratch scratch;
+    std::map<std::vector<int32_t>, int32_t> ids;
+    std::vector<std::vector<int32_t>> sets;
+    std::vector<uint8_t> flags;
+    /**
+     * for every state, the sides of the next byte with which it accepts,
+     * one bit per side
+     */
+    std::vector<uint8_t> ahead;
+    std::vector<int32_t> table;
+    std::vector<Exits> exits;
+    /**
+     * whether the automaton has assertions, so that states hold sides
+     */
+    bool contextual;
+    /**
+     * for every side of the byte before, whether to add the start states
+     * back after it, when unanchored
+     */
+    bool restarts[3];
+    /**
+     * the start state after every side
+     */
+    int32_t starts[3];
+    int32_t dead;
+  };
+
+  /**
+   * Counts the lines which contain a match without splitting the input
+   * into lines: an unanchored DFA runs over the whole buffer, and when
+   * the automaton has a required literal, only the lines holding it are
+   * run at all.
+   * Like DFA, it caches states and each thread needs its own.
+   */
+  class LineCounter
+  {
+  public:
+    /**
+     * @param nfa compiled on demand, see AbstractNFA::compile
+     * @param invert whether to count the lines without a match instead
+     */
+    LineCounter(nfa_api::AbstractNFA & nfa, bool invert = false);
+
+    /**
+     * @param begin
+     * @param end
+     * @return the number of lines of [begin, end) with a match, or
+     *         without one when inverted
+     */
+    uint64_t count(char const * begin, char const * end);
+
+  private:
+    uint64_t countMatching(char const * begin, char const * end);
+
+    DFA dfa;
+    nfa_literal::Finder const * prefilter;
+    bool invert;
+  };
+
+  /**
+   * The product of two automata, built lazily like DFA: a state is the
+   * pair of the subsets both NFAs are in, held as one set with the states
+   * of the second NFA numbered after those of the first, and the byte
+   * classes are those telling apart the classes of either. It decides
+   * whether an input is accepted by both in a single pass.
+   * Anchored, it accepts an input both accept as a whole, and dies as
+   * soon as either side does. Unanchored, it accepts an input in which
+   * both find a match, not necessarily the same: a side which has
+   * matched is marked done and its states are dropped, so the scan stops
+   * once both are done and states stay few.
+   * With assertions, a state holds the side of the byte before it, as
+   * in DFA.
+   * It caches what it computes, so each thread needs its own.
+   */
+  class ProductDFA
+  {
+  public:
+    /**
+     * @param a
+     * @param b
+     * @param anchored
+     * @param maxStates number of states cached before starting over
+     */
+    ProductDFA(nfa_api::CompiledNFA const & a,
+               nfa_api::CompiledNFA const & b, bool anchored,
+               size_t maxStates = 4096);
+
+    /**
+     * given an input [begin, end)
+     * says whether both automata accept it, as a whole when anchored and
+     * some substring of it each when not
+     * @param begin
+     * @param end
+     * @return
+     */
+    bool matches(char const * begin, char const * end);
+
+    /**
+     * the number of states cached
+     */
+    size_t stateCount() const { return this->sets.size(); }
+
+  private:
+    static int32_t const unknown = -1;
+    // in a set, the marks of a side which has matched, sorted first
+    static int32_t const doneA = -2;
+    static int32_t const doneB = -1;
+    // with assertions, the side of the byte before, last in a set
+    static int32_t const sideMark = -3;
+
+    int32_t next(int32_t s, unsigned char c)
+    {
+      int32_t t = this->table[(size_t)s * this->stride + this->classes[c]];
+      return t != unknown ? t : this->step(s, c);
+    }
+
+    /**
+     * adds the states of one side, shifted by offset, which are not yet
+     * visited
+     */
+    template <typename States>
+    void add(int32_t offset, States const & states, std::vector<int32_t> & to)
+    {
+      for (int32_t r : states)
+        if (this->scratch.visit(offset + r))
+          to.push_back(offset + r);
+    }
+    void mark(std::vector<int32_t> & set, uint8_t side) const;
+    uint8_t sideIn(std::vector<int32_t> const & set) const;
+    void settle(std::vector<int32_t> & set);
+    int32_t step(int32_t s, unsigned char c);
+    int32_t intern(std::vector<int32_t> & set);
+    void clear();
+
+    nfa_api::CompiledNFA const & a;
+    nfa_api::CompiledNFA const & b;
+    bool anchored;
+    size_t maxStates;
+    uint8_t classes[256];
+    size_t stride;
+    nfa_api::MatchScratch scratch;
+    std::map<std::vector<int32_t>, int32_t> ids;
+    std::vector<std::vector<int32_t>> sets;
+    bool contextual;
+    bool restartsA[3];
+    bool restartsB[3];
+    /**
+     * for every state, whether both have matched, and whether both
+     * would match if the input ended there
+     */
+    std::vector<bool> matching;
+    std::vector<bool> matchingAtEnd;
+    std::vector<int32_t> table;
+    int32_t start;
+    int32_t dead;
+  };
+
+  /**
+   * Matches two automata together, like the && of a rule saying a line
+   * must match A and also B: their literal prefilters are checked first,
+   * then a ProductDFA decides both at once.
+   * Like DFA, it caches states and each thread needs its own.
+   */
+  class Intersection
+  {
+  public:
+    /**
+     * @param a compiled on demand, see AbstractNFA::compile
+     * @param b likewise
+     */
+    Intersection(nfa_api::AbstractNFA & a, nfa_api::AbstractNFA & b);
+
+    /**
+     * says whether both accept the whole input
+     * @param input
+     * @return
+     */
+    bool accept(std::string const & input);
+
+    /**
+     * given an input [begin, end)
+     * says whether both accept some substring of it
+     * @param begin
+     * @param end
+     * @return
+     */
+    bool search(char const * begin, char const * end);
+
+  private:
+    bool prefiltered(char const * begin, char const * end) const;
+
+    nfa_literal::Finder const * prefilterA;
+    nfa_literal::Finder const * prefilterB;
+    ProductDFA whole;
+    ProductDFA part;
+  };
+
+  /**
+   * A match as the offsets [begin, end) into the searched input
+   */
+  struct Span
+  {
+    size_t begin;
+    size_t end;
+  };
+
+  /**
+   * Finds the leftmost-longest match of an automaton in linear time,
+   * with three scans by lazy DFAs:
+   * a forward scan stops at the earliest match end, and rejects the
+   * input when there is none;
+   * a scan of the reverse automaton from the end of the input finds the
+   * leftmost position a match starts at;
+   * an anchored forward scan from there finds the longest match.
+   * Like DFA, it caches states and each thread needs its own.
+   */
+  class SpanFinder
+  {
+  public:
+    /**
+     * @param nfa compiled on demand, see AbstractNFA::compile
+     */
+    SpanFinder(nfa_api::AbstractNFA & nfa);
+
+    /**
+     * given an input [begin, end)
+     * finds the leftmost and then longest substring accepted
+     * @param begin
+     * @param end
+     * @param span set to the match, relative to begin
+     * @return false iff nothing is accepted
+     */
+    bool find(char const * begin, char const * end, Span & span);
+
+  private:
+    DFA forward;
+    DFA reverse;
+    DFA longest;
+  };
+}
+
+#endif /* DFA_HPP */
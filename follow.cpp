@@ -0,0 +1,280 @@
+#include "follow.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace grep
+{
+  static uint32_t const fileEvents =
+    IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF;
+  static uint32_t const directoryEvents = IN_CREATE | IN_MOVED_TO;
+  /**
+   * how far back from its end the partial line of a file is looked for
+   * when following starts
+   */
+  static size_t const tailBytes = 64 << 10;
+  /**
+   * size of the reads of appended bytes
+   */
+  static size_t const readBytes = 256 << 10;
+  /**
+   * how long run waits before looking at every file anyway, in case an
+   * event was missed
+   */
+  static int const idleMillis = 1000;
+
+  Follower::Follower(nfa_api::AbstractNFA & nfa, SearchOptions options,
+                     std::ostream & out)
+    : selector(nfa, options), options(options), out(out),
+      inotify(inotify_init1(IN_NONBLOCK | IN_CLOEXEC))
+  {
+    if (this->inotify < 0)
+      this->error("inotify", std::strerror(errno));
+  }
+
+  Follower::~Follower()
+  {
+    for (std::unique_ptr<File> const & file : this->files)
+      if (file->fd >= 0)
+        ::close(file->fd);
+    if (this->inotify >= 0)
+      ::close(this->inotify);
+  }
+
+  bool Follower::add(std::string path)
+  {
+    if (this->inotify < 0) return false;
+    std::unique_ptr<File> file(new File());
+    file->path = path;
+    size_t slash = path.rfind('/');
+    std::string directory = slash == std::string::npos ? "."
+                          : slash == 0 ? "/"
+                          : path.substr(0, slash);
+    file->name = slash == std::string::npos ? path : path.substr(slash + 1);
+    file->writer.reset(new ContextWriter(path, this->options.before,
+                                         this->options.after, file->output,
+                                         file->matches));
+
+    // the directory tells when a file of that name appears again
+    file->directoryWatch = inotify_add_watch(this->inotify,
+                                             directory.c_str(),
+                                             directoryEvents);
+    if (file->directoryWatch < 0)
+    {
+      this->error(directory, std::strerror(errno));
+      return false;
+    }
+    this->open(*file, true);
+    this->files.push_back(std::move(file));
+    return true;
+  }
+
+  bool Follower::open(File & file, bool atEnd)
+  {
+    int fd = ::open(file.path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+      if (errno != ENOENT)
+        this->error(file.path, std::strerror(errno));
+      return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+      this->error(file.path, "not a regular file");
+      ::close(fd);
+      return false;
+    }
+    file.fd = fd;
+    file.device = st.st_dev;
+    file.inode = st.st_ino;
+    file.watch = inotify_add_watch(this->inotify, file.path.c_str(),
+                                   fileEvents);
+    file.offset = 0;
+    file.partial.clear();
+    if (atEnd)
+    {
+      // the line being written at the end is kept for when it is done
+      file.offset = st.st_size;
+      size_t back = std::min(file.offset, (uint64_t)tailBytes);
+      std::string tail(back, '\0');
+      ssize_t got = pread(fd, &tail[0], back, file.offset - back);
+      tail.resize(got > 0 ? got : 0);
+      size_t nl = tail.rfind('\n');
+      if (nl != std::string::npos)
+        file.partial = tail.substr(nl + 1);
+      else if (back == file.offset)
+        file.partial = tail;
+    }
+    return true;
+  }
+
+  void Follower::close(File & file)
+  {
+    // the last line of a file which is done is complete
+    if (!file.partial.empty())
+    {
+      std::string last;
+      last.swap(file.partial);
+      char const * end = last.data() + last.size();
+      file.writer->line(last.data(), end,
+                        this->selector.selects(last.data(), end));
+      file.writer->detach();
+      this->flush(file);
+    }
+    if (file.watch >= 0)
+      inotify_rm_watch(this->inotify, file.watch);
+    ::close(file.fd);
+    file.fd = -1;
+    file.watch = -1;
+  }
+
+  void Follower::look(File & file)
+  {
+    if (file.fd >= 0)
+      this->drain(file);
+
+    // the file is still the one at its path unless it was rotated away
+    struct stat st;
+    bool present = stat(file.path.c_str(), &st) == 0;
+    if (  file.fd >= 0 && present
+       && st.st_dev == file.device && st.st_ino == file.inode
+       )
+      return;
+    if (file.fd >= 0)
+      this->close(file);
+    if (present && this->open(file, false))
+      this->drain(file);
+  }
+
+  void Follower::drain(File & file)
+  {
+    struct stat st;
+    if (fstat(file.fd, &st) != 0)
+    {
+      this->error(file.path, std::strerror(errno));
+      return;
+    }
+    if ((uint64_t)st.st_size < file.offset)
+    {
+      // truncated in place; the rest of its last line is lost
+      file.offset = 0;
+      file.partial.clear();
+    }
+
+    this->buffer.resize(readBytes);
+    while (true)
+    {
+      ssize_t got = pread(file.fd, &this->buffer[0], this->buffer.size(),
+                          file.offset);
+      if (got < 0 && errno == EINTR) continue;
+      if (got < 0)
+        this->error(file.path, std::strerror(errno));
+      if (got <= 0) break;
+      file.offset += got;
+      this->scan(file, this->buffer.data(), this->buffer.data() + got);
+    }
+    this->flush(file);
+  }
+
+  void Follower::scan(File & file, char const * begin, char const * end)
+  {
+    // the partial line is completed by the first newline appended
+    if (!file.partial.empty())
+    {
+      char const * nl = (char const *)std::memchr(begin, '\n', end - begin);
+      if (nl == nullptr)
+      {
+        file.partial.append(begin, end);
+        return;
+      }
+      file.partial.append(begin, nl);
+      char const * line = file.partial.data();
+      char const * lineEnd = line + file.partial.size();
+      file.writer->line(line, lineEnd, this->selector.selects(line, lineEnd));
+      file.writer->detach();
+      file.partial.clear();
+      begin = nl + 1;
+    }
+
+    char const * last = (char const *)memrchr(begin, '\n', end - begin);
+    char const * complete = last == nullptr ? begin : last + 1;
+    char const * line = begin;
+    while (line < complete)
+    {
+      char const * nl = (char const *)std::memchr(line, '\n',
+                                                  complete - line);
+      file.writer->line(line, nl, this->selector.selects(line, nl));
+      line = nl + 1;
+    }
+    file.writer->detach();
+    file.partial.assign(complete, end);
+  }
+
+  void Follower::flush(File & file)
+  {
+    if (file.output.empty()) return;
+    file.output.writeTo(this->out);
+    this->out.flush();
+    file.output.clear();
+  }
+
+  bool Follower::poll(int timeoutMillis)
+  {
+    if (this->inotify < 0) return false;
+    struct pollfd ready = { this->inotify, POLLIN, 0 };
+    int n = ::poll(&ready, 1, timeoutMillis);
+    if (n < 0)
+      return errno == EINTR;
+
+    // each file is looked at once, however many events it had
+    std::vector<bool> touched(this->files.size(), n == 0);
+    alignas(struct inotify_event) char events[4096];
+    while (n > 0)
+    {
+      ssize_t got = read(this->inotify, events, sizeof(events));
+      if (got < 0 && errno == EINTR) continue;
+      if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+      if (got <= 0)
+      {
+        this->error("inotify", std::strerror(errno));
+        return false;
+      }
+      for (char * p = events; p < events + got;)
+      {
+        struct inotify_event const * event = (struct inotify_event *)p;
+        p += sizeof(struct inotify_event) + event->len;
+        for (size_t i = 0; i < this->files.size(); ++i)
+        {
+          File const & file = *this->files[i];
+          touched[i] = touched[i] || (event->mask & IN_Q_OVERFLOW)
+            || event->wd == file.watch
+            || (  event->wd == file.directoryWatch && event->len > 0
+               && file.name == event->name);
+        }
+      }
+    }
+    for (size_t i = 0; i < this->files.size(); ++i)
+      if (touched[i])
+        this->look(*this->files[i]);
+    return true;
+  }
+
+  void Follower::run()
+  {
+    while (this->poll(idleMillis))
+      ;
+  }
+
+  void Follower::error(std::string path, std::string message)
+  {
+    this->errors = true;
+    std::cerr << "grep: " + path + ": " + message + "\n";
+  }
+}
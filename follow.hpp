@@ -0,0 +1,102 @@
+#ifndef FOLLOW_HPP
+#define FOLLOW_HPP
+
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+#include "nfa_api.hpp"
+#include "search.hpp"
+
+namespace grep
+{
+  /**
+   * Follows files as they grow, like tail -F piped into grep: only the
+   * bytes appended since the last look are read and matched, and the
+   * lines selected are printed as "path:line" as soon as they are
+   * complete. Each file keeps its offset and the partial line at its end
+   * between looks, and a ContextWriter of its own, so context works
+   * across appends.
+   * Looks are driven by inotify: a file is looked at when it is modified,
+   * moved or deleted, and when a file of that name appears in its
+   * directory. A file renamed away is read to its end and the file then
+   * found at the path is followed from its start; a file truncated in
+   * place is followed from its new end, which is its start.
+   * It is single-threaded; the automata are only read.
+   */
+  class Follower
+  {
+  public:
+    /**
+     * @param nfa a compiled automaton, see AbstractNFA::compile
+     * @param options count is ignored
+     * @param out where the selected lines go
+     */
+    Follower(nfa_api::AbstractNFA & nfa, SearchOptions options,
+             std::ostream & out);
+    ~Follower();
+
+    /**
+     * starts following a file from its current end; a file which does
+     * not exist yet is followed once it is created
+     * @param path
+     * @return false if neither the file nor its directory can be watched
+     */
+    bool add(std::string path);
+
+    /**
+     * waits for changes to the files for up to timeoutMillis and reads
+     * what was appended; files are looked at anyway when nothing came
+     * @param timeoutMillis -1 to wait for as long as it takes
+     * @return false if inotify failed
+     */
+    bool poll(int timeoutMillis);
+
+    /**
+     * polls for ever, or until inotify fails
+     */
+    void run();
+
+    /**
+     * says whether some file could not be read
+     */
+    bool hadErrors() const { return this->errors; }
+
+  private:
+    struct File
+    {
+      std::string path;
+      std::string name;
+      int fd = -1;
+      int watch = -1;
+      int directoryWatch = -1;
+      dev_t device = 0;
+      ino_t inode = 0;
+      uint64_t offset = 0;
+      std::string partial;
+      OutputBuffer output;
+      uint64_t matches = 0;
+      std::unique_ptr<ContextWriter> writer;
+    };
+
+    bool open(File & file, bool atEnd);
+    void close(File & file);
+    void look(File & file);
+    void drain(File & file);
+    void scan(File & file, char const * begin, char const * end);
+    void flush(File & file);
+    void error(std::string path, std::string message);
+
+    LineSelector selector;
+    SearchOptions options;
+    std::ostream & out;
+    int inotify;
+    std::vector<std::unique_ptr<File>> files;
+    std::string buffer;
+    bool errors = false;
+  };
+}
+
+#endif /* FOLLOW_HPP */
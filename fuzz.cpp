@@ -0,0 +1,721 @@
+#include "dfa.hpp"
+#include "nfa.hpp"
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <regex>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/**
+ * Differential fuzzing of the matching engines.
+ * Random postfix patterns and inputs are run through every engine and
+ * the answers compared with the runtime NFA and with std::regex, given
+ * the same pattern translated to ECMAScript syntax.
+ *
+ * Standalone (make fuzz):   ./fuzz [iterations] [seed]
+ *   deterministic for a seed; a mismatch is shrunk to a minimal pattern
+ *   and input and printed, and the exit status is 1. At the end the
+ *   throughput of every engine is printed, and an engine more than
+ *   slowFactor times slower than the NFA is flagged.
+ * libFuzzer (make fuzz-libfuzzer): the first byte of the data is the
+ *   length of the pattern, the rest is the input; a mismatch aborts.
+ */
+namespace fuzz
+{
+  /**
+   * A pattern as a tree, so that it can be shrunk by sub-expression
+   */
+  struct Node
+  {
+    /**
+     * a token such as "a", "\\d" or ".", or an operator "&|*+?" or a
+     * counted repetition such as "{0,2}"
+     */
+    std::string token;
+    std::vector<Node> children;
+  };
+
+  static std::string postfixOf(Node const & node)
+  {
+    std::string res;
+    for (Node const & child : node.children)
+      res += postfixOf(child);
+    return res + node.token;
+  }
+
+  static std::string ecmaOfToken(std::string const & token)
+  {
+    if (token == ".") return "[\\s\\S]";
+    if (token == "\\d") return "[0-9]";
+    if (token == "\\D") return "[^0-9]";
+    // \w of nfa::NFA has no underscore
+    if (token == "\\w") return "[a-zA-Z0-9]";
+    if (token == "\\W") return "[^a-zA-Z0-9]";
+    if (token == "\\s") return "[ \\t\\r\\n\\f]";
+    if (token == "\\S") return "[^ \\t\\r\\n\\f]";
+    if (token == "\\t") return "\\t";
+    // ^ and $ of std::regex only hold at the ends of the input, which
+    // are those of the line when the input has no newline
+    if (token == "^" || token == "$" || token == "\\b") return token;
+    char c = token.size() == 2 ? token[1] : token[0];
+    if (std::string("\\^$.|?*+()[]{}/").find(c) != std::string::npos)
+      return std::string("\\") + c;
+    return std::string(1, c);
+  }
+
+  static std::string ecmaOf(Node const & node)
+  {
+    if (node.children.empty()) return ecmaOfToken(node.token);
+    std::string a = "(?:" + ecmaOf(node.children[0]) + ")";
+    if (node.token == "&") return a + "(?:" + ecmaOf(node.children[1]) + ")";
+    if (node.token == "|")
+      return "(?:" + ecmaOf(node.children[0]) + "|"
+        + ecmaOf(node.children[1]) + ")";
+    return a + node.token;
+  }
+
+  static bool isRepeat(Node const & node)
+  {
+    return node.token == "*" || node.token == "+" || node.token[0] == '{';
+  }
+
+  /**
+   * says whether a repetition holds another one, like (a*)+, on which
+   * the backtracking of std::regex can take exponential time or hang
+   */
+  static bool nestedRepeat(Node const & node, bool inRepeat = false)
+  {
+    if (inRepeat && isRepeat(node)) return true;
+    for (Node const & child : node.children)
+      if (nestedRepeat(child, inRepeat || isRepeat(node))) return true;
+    return false;
+  }
+
+  /**
+   * says whether a pattern has ^, $ or \b, which std::regex only agrees
+   * with on single lines without underscores, a word byte to it
+   */
+  static bool asserts(Node const & node)
+  {
+    if (node.token == "^" || node.token == "$" || node.token == "\\b")
+      return true;
+    for (Node const & child : node.children)
+      if (asserts(child)) return true;
+    return false;
+  }
+
+  static size_t sizeOf(Node const & node)
+  {
+    size_t n = 1;
+    for (Node const & child : node.children)
+      n += sizeOf(child);
+    return n;
+  }
+
+  /**
+   * Generates patterns and inputs from a small alphabet, so that random
+   * inputs often match
+   */
+  class Generator
+  {
+  public:
+    Generator(uint32_t seed) : random(seed) {}
+
+    Node pattern(int depth)
+    {
+      static char const * const tokens[] = {
+        "a", "b", "c", "0", "1", " ", ".", "\\d", "\\D", "\\w", "\\W",
+        "\\s", "\\S", "\\t", "\\*", "\\.", "\\\\", "^", "$", "\\b",
+        "\\^", "\\$"
+      };
+      Node node;
+      if (depth == 0 || this->pick(3) == 0)
+      {
+        // plain letters most of the time
+        node.token = this->pick(2) == 0 ? tokens[this->pick(3)]
+          : tokens[this->pick(sizeof(tokens) / sizeof(tokens[0]))];
+        return node;
+      }
+      // repetitions of more than 16 bytes run as bit vectors
+      static char const * const operators[] = {
+        "&", "&", "|", "*", "+", "?", "{0,2}", "{2}", "{1,}", "{0,20}",
+        "{17,}", "{0}", "{0,0}"
+      };
+      node.token = operators[this->pick(sizeof(operators)
+                                        / sizeof(operators[0]))];
+      if (isRepeat(node) && this->pick(3) == 0)
+      {
+        // a chain of 16 or more within a repetition, which has to
+        // be copied, dropped or looped on along with its counter
+        std::string n = std::to_string(16 + this->pick(9));
+        Node chain{this->pick(2) == 0 ? "{" + n + "}" : "{0," + n + "}",
+                   { Node{".", {}} }};
+        node.children.push_back(Node{"&", { this->pattern(depth - 1),
+                                            chain }});
+        return node;
+      }
+      node.children.push_back(this->pattern(depth - 1));
+      if (node.token == "&" || node.token == "|")
+        node.children.push_back(this->pattern(depth - 1));
+      return node;
+    }
+
+    std::string input(size_t maxLength)
+    {
+      static char const alphabet[] = "aabbc01 _\t.*\\A\n";
+      std::string res(this->pick(maxLength + 1), ' ');
+      for (char & c : res)
+        c = alphabet[this->pick(sizeof(alphabet) - 1)];
+      return res;
+    }
+
+    bool coin() { return this->pick(4) == 0; }
+
+  private:
+    size_t pick(size_t n)
+    {
+      return std::uniform_int_distribution<size_t>(0, n - 1)(this->random);
+    }
+
+    std::mt19937 random;
+  };
+
+  /**
+   * One way of answering whether a pattern matches an input
+   */
+  struct Engine
+  {
+    std::string name;
+    std::function<bool(nfa::NFA &, std::regex const &, std::string const &)>
+      run;
+    /**
+     * checks more than the answer, untimed; may be empty. It is given
+     * the pattern, null when it is not known, and whether it ignores case
+     */
+    std::function<bool(nfa::NFA &, std::string const &, Node const *, bool)>
+      verify;
+    /**
+     * whether it is a reference answer, never flagged as slow
+     */
+    bool reference;
+    /**
+     * whether it runs std::regex, skipped on patterns it cannot take
+     */
+    bool usesRegex;
+    double seconds;
+    uint64_t bytes;
+  };
+
+  static bool bruteSpan(nfa::NFA & nfa, std::string const & input,
+                        nfa_dfa::Span & span)
+  {
+    for (size_t b = 0; b <= input.size(); ++b)
+      for (size_t e = input.size() + 1; e-- > b;)
+        if (nfa.accept(input.substr(b, e - b)))
+        {
+          span.begin = b;
+          span.end = e;
+          return true;
+        }
+    return false;
+  }
+
+  static bool isWord(std::string const & input, size_t i)
+  {
+    return i < input.size() && std::isalnum((unsigned char)input[i]);
+  }
+
+  /**
+   * says whether a pattern of one token matches the byte c
+   */
+  static bool byteMatches(std::string const & token, char c,
+                          bool ignoreCase)
+  {
+    unsigned char u = c;
+    if (token == ".") return true;
+    if (token == "\\d" || token == "\\D")
+      return (std::isdigit(u) != 0) == (token == "\\d");
+    if (token == "\\w" || token == "\\W")
+      return (std::isalnum(u) != 0) == (token == "\\w");
+    if (token == "\\s" || token == "\\S")
+      return (std::strchr(" \t\r\n\f", c) != nullptr && c != '\0')
+        == (token == "\\s");
+    char t = token == "\\t" ? '\t' : token.size() == 2 ? token[1] : token[0];
+    return ignoreCase ? std::tolower(u) == std::tolower((unsigned char)t)
+      : c == t;
+  }
+
+  /**
+   * the positions of the input where a match of node may end, given
+   * those where it may start; a reference matcher, slow but plainly
+   * right, which unlike substrings given to the NFA sees the bytes
+   * around a match that assertions look at
+   */
+  static std::vector<bool> endsOf(Node const & node, bool ignoreCase,
+                                  std::string const & input,
+                                  std::vector<bool> const & starts)
+  {
+    size_t n = input.size();
+    std::vector<bool> ends(n + 1, false);
+    auto join = [&ends](std::vector<bool> const & more) {
+      for (size_t i = 0; i < ends.size(); ++i)
+        ends[i] = ends[i] || more[i];
+    };
+    // any number of matches of the child, from the given positions
+    auto star = [&](std::vector<bool> from) {
+      while (true)
+      {
+        std::vector<bool> more = endsOf(node.children[0], ignoreCase,
+                                        input, from);
+        for (size_t i = 0; i < more.size(); ++i)
+          more[i] = more[i] || from[i];
+        if (more == from) return from;
+        from = more;
+      }
+    };
+    if (node.children.empty())
+    {
+      for (size_t i = 0; i <= n; ++i)
+        if (!starts[i]) continue;
+        else if (node.token == "^")
+          ends[i] = ends[i] || i == 0 || input[i - 1] == '\n';
+        else if (node.token == "$")
+          ends[i] = ends[i] || i == n || input[i] == '\n';
+        else if (node.token == "\\b")
+          ends[i] = ends[i]
+            || isWord(input, i) != (i > 0 && isWord(input, i - 1));
+        else if (i < n && byteMatches(node.token, input[i], ignoreCase))
+          ends[i + 1] = true;
+      return ends;
+    }
+    std::vector<bool> first = endsOf(node.children[0], ignoreCase, input,
+                                     starts);
+    if (node.token == "&")
+      return endsOf(node.children[1], ignoreCase, input, first);
+    if (node.token == "|")
+    {
+      ends = first;
+      join(endsOf(node.children[1], ignoreCase, input, starts));
+      return ends;
+    }
+    if (node.token == "*") return star(starts);
+    if (node.token == "+") return star(first);
+    if (node.token == "?")
+    {
+      ends = starts;
+      join(first);
+      return ends;
+    }
+    // {m}, {m,} or {m,n}
+    size_t comma = node.token.find(',');
+    uint32_t min = std::stoul(node.token.substr(1));
+    bool unbounded = comma != std::string::npos
+      && node.token[comma + 1] == '}';
+    uint32_t max = comma == std::string::npos ? min
+      : unbounded ? min : std::stoul(node.token.substr(comma + 1));
+    std::vector<bool> from = starts;
+    for (uint32_t k = 0; k < min; ++k)
+      from = endsOf(node.children[0], ignoreCase, input, from);
+    if (unbounded) return star(from);
+    ends = from;
+    for (uint32_t k = min; k < max; ++k)
+    {
+      from = endsOf(node.children[0], ignoreCase, input, from);
+      join(from);
+    }
+    return ends;
+  }
+
+  /**
+   * the leftmost-longest match by the reference matcher
+   */
+  static bool bruteSpan(Node const & pattern, bool ignoreCase,
+                        std::string const & input, nfa_dfa::Span & span)
+  {
+    for (size_t b = 0; b <= input.size(); ++b)
+    {
+      std::vector<bool> starts(input.size() + 1, false);
+      starts[b] = true;
+      std::vector<bool> ends = endsOf(pattern, ignoreCase, input, starts);
+      for (size_t e = input.size() + 1; e-- > b;)
+        if (ends[e])
+        {
+          span.begin = b;
+          span.end = e;
+          return true;
+        }
+    }
+    return false;
+  }
+
+  /**
+   * says whether a text holding the given trigrams satisfies a query
+   */
+  static bool satisfies(nfa_trigram::Query const & query,
+                        std::set<uint32_t> const & trigrams)
+  {
+    typedef nfa_trigram::Query::Op Op;
+    if (query.getOp() == Op::all || query.getOp() == Op::none)
+      return query.getOp() == Op::all;
+    bool conjunction = query.getOp() == Op::conjunction;
+    for (uint32_t key : query.getTrigrams())
+      if ((trigrams.count(key) != 0) != conjunction) return !conjunction;
+    for (nfa_trigram::Query const & sub : query.getSubs())
+      if (satisfies(sub, trigrams) != conjunction) return !conjunction;
+    return conjunction;
+  }
+
+  /**
+   * says whether the input satisfies the trigram query of the pattern,
+   * which it must when it holds a match
+   */
+  static bool satisfies(nfa::NFA & nfa, std::string const & input)
+  {
+    std::set<uint32_t> trigrams;
+    for (size_t i = 0; i + 3 <= input.size(); ++i)
+      trigrams.insert(nfa_trigram::keyOf(input[i], input[i + 1],
+                                         input[i + 2]));
+    return satisfies(nfa.getTrigramQuery(), trigrams);
+  }
+
+  /**
+   * the engines, in pairs of an engine and the answer it must agree with:
+   * even entries answer "accepted", odd ones "some substring accepted"
+   */
+  static std::vector<Engine> engines()
+  {
+    std::vector<Engine> res;
+    res.push_back({ "nfa.accept",
+      [](nfa::NFA & nfa, std::regex const &, std::string const & input) {
+        return nfa.accept(input);
+      }, nullptr, true, false, 0, 0 });
+    res.push_back({ "nfa.search",
+      [](nfa::NFA & nfa, std::regex const &, std::string const & input) {
+        return nfa.search(input.data(), input.data() + input.size());
+      }, nullptr, true, false, 0, 0 });
+    res.push_back({ "std::regex_match",
+      [](nfa::NFA &, std::regex const & re, std::string const & input) {
+        return std::regex_match(input, re);
+      }, nullptr, true, true, 0, 0 });
+    res.push_back({ "std::regex_search",
+      [](nfa::NFA &, std::regex const & re, std::string const & input) {
+        return std::regex_search(input, re);
+      }, nullptr, true, true, 0, 0 });
+    res.push_back({ "budget.accept",
+      [](nfa::NFA & nfa, std::regex const &, std::string const & input) {
+        return nfa.accept(input, nfa_api::Budget())
+          == nfa_api::MatchResult::accepted;
+      }, nullptr, false, false, 0, 0 });
+    res.push_back({ "budget.search",
+      [](nfa::NFA & nfa, std::regex const &, std::string const & input) {
+        return nfa.search(input.data(), input.data() + input.size(),
+                          nfa_api::Budget())
+          == nfa_api::MatchResult::accepted;
+      }, nullptr, false, false, 0, 0 });
+    res.push_back({ "dfa.accept",
+      [](nfa::NFA & nfa, std::regex const &, std::string const & input) {
+        nfa_dfa::DFA dfa(nfa.getCompiled(), true);
+        char const * end = input.data() + input.size();
+        return dfa.lastMatchEnd(input.data(), end) == end;
+      }, nullptr, false, false, 0, 0 });
+    res.push_back({ "dfa.search",
+      [](nfa::NFA & nfa, std::regex const &, std::string const & input) {
+        nfa_dfa::DFA dfa(nfa.getCompiled(), false);
+        return dfa.firstMatchEnd(input.data(), input.data() + input.size())
+          != nullptr;
+      }, nullptr, false, false, 0, 0 });
+    res.push_back({ "complement.accept",
+      [](nfa::NFA & nfa, std::regex const &, std::string const & input) {
+        nfa_dfa::DFA dfa(nfa.getCompiled(), true, 4096, true);
+        return !dfa.matches(input.data(), input.data() + input.size());
+      }, nullptr, false, false, 0, 0 });
+    res.push_back({ "complement.search",
+      [](nfa::NFA & nfa, std::regex const &, std::string const & input) {
+        nfa_dfa::DFA dfa(nfa.getCompiled(), false, 4096, true);
+        return !dfa.matches(input.data(), input.data() + input.size());
+      }, nullptr, false, false, 0, 0 });
+    res.push_back({ "product.accept",
+      [](nfa::NFA & nfa, std::regex const &, std::string const & input) {
+        nfa_dfa::ProductDFA both(nfa.getCompiled(), nfa.getCompiled(), true);
+        return both.matches(input.data(), input.data() + input.size());
+      }, nullptr, false, false, 0, 0 });
+    res.push_back({ "product.search",
+      [](nfa::NFA & nfa, std::regex const &, std::string const & input) {
+        nfa_dfa::ProductDFA both(nfa.getCompiled(), nfa.getCompiled(),
+                                 false);
+        return both.matches(input.data(), input.data() + input.size());
+      }, nullptr, false, false, 0, 0 });
+    res.push_back({ "trigram.accept",
+      [](nfa::NFA & nfa, std::regex const &, std::string const & input) {
+        return nfa.accept(input);
+      },
+      [](nfa::NFA & nfa, std::string const & input, Node const *, bool) {
+        return !nfa.accept(input) || satisfies(nfa, input);
+      }, false, false, 0, 0 });
+    res.push_back({ "trigram.search",
+      [](nfa::NFA & nfa, std::regex const &, std::string const & input) {
+        return nfa.search(input.data(), input.data() + input.size());
+      },
+      [](nfa::NFA & nfa, std::string const & input, Node const *, bool) {
+        return !nfa.search(input.data(), input.data() + input.size())
+          || satisfies(nfa, input);
+      }, false, false, 0, 0 });
+    res.push_back({ "reverse.accept",
+      [](nfa::NFA & nfa, std::regex const &, std::string const & input) {
+        nfa_dfa::DFA dfa(nfa.getReversed(), true);
+        return dfa.lastMatchBegin(input.data(), input.data() + input.size())
+          == input.data();
+      }, nullptr, false, false, 0, 0 });
+    res.push_back({ "span.find",
+      [](nfa::NFA & nfa, std::regex const &, std::string const & input) {
+        nfa_dfa::SpanFinder finder(nfa);
+        nfa_dfa::Span span;
+        return finder.find(input.data(), input.data() + input.size(), span);
+      },
+      [](nfa::NFA & nfa, std::string const & input, Node const * pattern,
+         bool ignoreCase) {
+        // the span must be the leftmost-longest one; with assertions a
+        // substring alone does not tell, the reference matcher is needed
+        nfa_dfa::SpanFinder finder(nfa);
+        nfa_dfa::Span span = { 0, 0 }, expected = { 0, 0 };
+        bool found = finder.find(input.data(), input.data() + input.size(),
+                                 span);
+        bool asserting = nfa.getCompiled().hasAssertions();
+        if (!found || (asserting && pattern == nullptr)) return true;
+        bool brute = asserting
+          ? bruteSpan(*pattern, ignoreCase, input, expected)
+          : bruteSpan(nfa, input, expected);
+        return brute && span.begin == expected.begin
+          && span.end == expected.end;
+      }, false, false, 0, 0 });
+    return res;
+  }
+
+  /**
+   * A disagreement between two engines
+   */
+  struct Mismatch
+  {
+    Node pattern;
+    bool ignoreCase;
+    std::string input;
+    std::string engine;
+    bool got;
+    bool expected;
+  };
+
+  /**
+   * runs every engine on one case
+   * @return false on a mismatch, which is then filled in
+   */
+  static bool check(std::vector<Engine> & all, Node const & pattern,
+                    bool ignoreCase, std::string const & input,
+                    Mismatch & mismatch)
+  {
+    std::string postfix = postfixOf(pattern);
+    nfa::NFA nfa(postfix, ignoreCase ? nfa::NFA::ignoreCase : 0);
+    bool regexUsable = !nestedRepeat(pattern)
+      && (  !asserts(pattern)
+         || input.find_first_of("\n_") == std::string::npos);
+    std::regex re;
+    if (regexUsable)
+      re.assign(ecmaOf(pattern), ignoreCase
+                ? std::regex::ECMAScript | std::regex::icase
+                : std::regex::ECMAScript);
+    bool answers[2] = { false, false };
+    for (size_t i = 0; i < all.size(); ++i)
+    {
+      if (all[i].usesRegex && !regexUsable) continue;
+      auto started = std::chrono::steady_clock::now();
+      bool got = all[i].run(nfa, re, input);
+      all[i].seconds += std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - started).count();
+      all[i].bytes += input.size();
+      if (i < 2)
+        answers[i] = got;
+      else if (got != answers[i % 2]
+               || (  all[i].verify
+                  && !all[i].verify(nfa, input, &pattern, ignoreCase)))
+      {
+        mismatch = { pattern, ignoreCase, input, all[i].name, got,
+                     answers[i % 2] };
+        return false;
+      }
+    }
+    return true;
+  }
+
+  /**
+   * the patterns obtained by replacing one sub-expression with one of
+   * its children or with a single letter
+   */
+  static void smallerPatterns(Node const & node, std::vector<Node> & out)
+  {
+    for (Node const & child : node.children)
+      out.push_back(child);
+    if (!node.children.empty() || node.token != "a")
+      out.push_back(Node{ "a", {} });
+    for (size_t i = 0; i < node.children.size(); ++i)
+    {
+      std::vector<Node> smaller;
+      smallerPatterns(node.children[i], smaller);
+      for (Node const & replacement : smaller)
+      {
+        Node copy = node;
+        copy.children[i] = replacement;
+        out.push_back(copy);
+      }
+    }
+  }
+
+  /**
+   * shrinks a mismatch greedily until no smaller pattern or shorter
+   * input still shows it
+   */
+  static Mismatch shrink(std::vector<Engine> & all, Mismatch mismatch)
+  {
+    bool smaller = true;
+    while (smaller)
+    {
+      smaller = false;
+      std::vector<Node> patterns;
+      smallerPatterns(mismatch.pattern, patterns);
+      for (Node const & pattern : patterns)
+      {
+        Mismatch next;
+        if (  sizeOf(pattern) < sizeOf(mismatch.pattern)
+           && !check(all, pattern, mismatch.ignoreCase, mismatch.input, next)
+           )
+        {
+          mismatch = next;
+          smaller = true;
+          break;
+        }
+      }
+      for (size_t i = 0; !smaller && i < mismatch.input.size(); ++i)
+      {
+        Mismatch next;
+        std::string input = mismatch.input;
+        input.erase(i, 1);
+        if (!check(all, mismatch.pattern, mismatch.ignoreCase, input, next))
+        {
+          mismatch = next;
+          smaller = true;
+        }
+      }
+    }
+    return mismatch;
+  }
+
+  static std::string quote(std::string const & s)
+  {
+    std::string res = "\"";
+    for (char c : s)
+      if (c == '\n') res += "\\n";
+      else if (c == '\t') res += "\\t";
+      else if (c == '"' || c == '\\') res += std::string("\\") + c;
+      else res += c;
+    return res + "\"";
+  }
+
+  /**
+   * an engine is flagged when it is this many times slower than the NFA
+   */
+  static double const slowFactor = 20;
+
+  static int standalone(uint64_t iterations, uint32_t seed)
+  {
+    std::vector<Engine> all = engines();
+    Generator generator(seed);
+    for (uint64_t i = 0; i < iterations; ++i)
+    {
+      Node pattern = generator.pattern(4);
+      bool ignoreCase = generator.coin();
+      Mismatch mismatch;
+      bool ok = true;
+      for (int k = 0; ok && k < 8; ++k)
+        ok = check(all, pattern, ignoreCase, generator.input(12), mismatch);
+      if (!ok)
+      {
+        mismatch = shrink(all, mismatch);
+        std::cout << "MISMATCH after " << i + 1 << " patterns (seed "
+                  << seed << ")\n"
+                  << "  pattern: " << quote(postfixOf(mismatch.pattern))
+                  << (mismatch.ignoreCase ? " with -i" : "") << '\n'
+                  << "  as ECMAScript: " << quote(ecmaOf(mismatch.pattern))
+                  << '\n'
+                  << "  input: " << quote(mismatch.input) << '\n'
+                  << "  " << mismatch.engine << " says " << std::boolalpha
+                  << mismatch.got << ", expected " << mismatch.expected
+                  << '\n';
+        return 1;
+      }
+    }
+
+    std::cout << iterations << " patterns, no mismatch (seed " << seed
+              << ")\n";
+    for (size_t i = 0; i < all.size(); ++i)
+    {
+      Engine const & e = all[i];
+      double rate = e.seconds > 0 ? e.bytes / e.seconds / (1 << 20) : 0;
+      bool slow = !e.reference
+        && e.seconds > slowFactor * all[i % 2].seconds;
+      std::cout << "  " << e.name << ": " << rate << " MiB/s"
+                << (slow ? "  SLOW" : "") << '\n';
+    }
+    return 0;
+  }
+}
+
+#ifdef GREP11_LIBFUZZER
+extern "C" int LLVMFuzzerTestOneInput(uint8_t const * data, size_t size)
+{
+  if (size == 0) return 0;
+  size_t n = std::min<size_t>(data[0], size - 1);
+  std::string pattern((char const *)data + 1, n);
+  std::string input((char const *)data + 1 + n, size - 1 - n);
+  std::unique_ptr<nfa::NFA> nfa;
+  try
+  {
+    nfa.reset(new nfa::NFA(pattern));
+  }
+  catch (std::invalid_argument const &)
+  {
+    return 0;
+  }
+  // arbitrary patterns cannot go through std::regex, the engines are
+  // compared with the NFA only
+  std::vector<fuzz::Engine> all = fuzz::engines();
+  std::regex none;
+  bool answers[2] = {
+    all[0].run(*nfa, none, input), all[1].run(*nfa, none, input)
+  };
+  for (size_t i = 2; i < all.size(); ++i)
+    if (  !all[i].usesRegex
+       && (  all[i].run(*nfa, none, input) != answers[i % 2]
+          || (  all[i].verify
+             && !all[i].verify(*nfa, input, nullptr, false))
+          )
+       )
+      std::abort();
+  return 0;
+}
+#else
+int main(int argc, char * argv[])
+{
+  uint64_t iterations = argc > 1 ? std::strtoull(argv[1], nullptr, 10)
+                                 : 2000;
+  uint32_t seed = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 1;
+  return fuzz::standalone(iterations, seed);
+}
+#endif
@@ -0,0 +1,455 @@
+#include "index.hpp"
+#include "binary.hpp"
+#include "decompress.hpp"
+#include "literal.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace grep
+{
+  static char const magic[] = "GREP11IX";
+  static uint32_t const version = 1;
+
+  static int64_t mtimeOf(struct stat const & st)
+  {
+    return (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+  }
+
+  /**
+   * resolves a path with realpath
+   * @param path
+   * @param resolved the absolute path, without links or dot components
+   * @return false if it cannot be resolved, with errno set
+   */
+  static bool canonical(std::string const & path, std::string & resolved)
+  {
+    char * res = realpath(path.c_str(), nullptr);
+    if (res == nullptr) return false;
+    resolved = res;
+    free(res);
+    return true;
+  }
+
+  /**
+   * tells whether a path is a directory or file root or lies under it
+   */
+  static bool isWithin(std::string const & path, std::string const & root)
+  {
+    if (path.compare(0, root.size(), root) != 0) return false;
+    return path.size() == root.size() || root.back() == '/'
+      || path[root.size()] == '/';
+  }
+
+  /**
+   * names a path within root as it is reached from given, the path root
+   * was resolved from, the way walkFiles would name it
+   */
+  static std::string displayOf(std::string const & path,
+                               std::string const & given,
+                               std::string const & root)
+  {
+    if (path.size() == root.size()) return given;
+    size_t rest = root.back() == '/' ? root.size() : root.size() + 1;
+    std::string prefix = given;
+    if (prefix.back() != '/')
+      prefix += '/';
+    return prefix + path.substr(rest);
+  }
+
+  bool Index::build(std::vector<std::string> const & paths,
+                    size_t blockBytes)
+  {
+    this->files.clear();
+    this->blocks.clear();
+    this->trigrams.clear();
+    this->postings.clear();
+    this->errors.clear();
+
+    Lists lists;
+    for (std::string const & given : paths)
+    {
+      std::string path;
+      if (!canonical(given, path))
+      {
+        this->error(given, std::strerror(errno));
+        continue;
+      }
+      walkFiles(path, [this, blockBytes, &lists](std::string file, size_t) {
+        this->indexFile(file, blockBytes, lists);
+      }, [this](std::string file, std::string message) {
+        this->error(file, message);
+      });
+    }
+
+    // the lists in trigram order, each as deltas of its block numbers
+    std::vector<uint32_t> keys;
+    for (auto const & list : lists)
+      keys.push_back(list.first);
+    std::sort(keys.begin(), keys.end());
+    for (uint32_t key : keys)
+    {
+      std::vector<uint32_t> const & ids = lists[key];
+      this->trigrams.push_back(Entry{key, (uint32_t)ids.size(),
+                                     this->postings.size()});
+      uint32_t last = 0;
+      for (uint32_t id : ids)
+      {
+        putVarint(this->postings, id - last);
+        last = id;
+      }
+    }
+    return this->errors.empty();
+  }
+
+  void Index::indexFile(std::string const & path, size_t blockBytes,
+                        Lists & lists)
+  {
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+      this->error(path, std::strerror(errno));
+      if (fd >= 0) close(fd);
+      return;
+    }
+    unsigned char head[4];
+    ssize_t got = pread(fd, head, sizeof(head), 0);
+    Compression compression = detectCompression(head, got > 0 ? got : 0);
+    uint32_t id = this->files.size();
+    this->files.push_back(File{path, (uint64_t)st.st_size, mtimeOf(st),
+                               compression != Compression::none});
+
+    // the trigrams of the current block, the last bytes of the current
+    // line folded into window
+    std::vector<uint32_t> keys;
+    uint64_t blockStart = 0;
+    uint64_t offset = 0;
+    uint32_t window = 0;
+    int filled = 0;
+    auto endBlock = [&](uint64_t end) {
+      std::sort(keys.begin(), keys.end());
+      keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+      uint32_t block = this->blocks.size();
+      this->blocks.push_back(Block{id, blockStart, end - blockStart});
+      for (uint32_t key : keys)
+        lists[key].push_back(block);
+      keys.clear();
+      blockStart = end;
+    };
+    auto feed = [&](char const * p, char const * end) {
+      for (; p != end; ++p, ++offset)
+      {
+        if (*p == '\n')
+        {
+          filled = 0;
+          if (  compression == Compression::none
+             && offset + 1 - blockStart >= blockBytes
+             )
+            endBlock(offset + 1);
+          continue;
+        }
+        window = (window << 8 | (unsigned char)nfa_literal::foldCase(*p))
+               & 0xffffff;
+        if (++filled >= 3)
+          keys.push_back(window);
+      }
+      // a compressed file is one block, which may be large
+      if (keys.size() > (1u << 22))
+      {
+        std::sort(keys.begin(), keys.end());
+        keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+      }
+    };
+
+    std::string error;
+    if (compression != Compression::none)
+    {
+      DecompressingReader reader(fd, compression);
+      std::string block;
+      while (reader.next(block))
+        feed(block.data(), block.data() + block.size());
+      error = reader.getError();
+      offset = st.st_size;
+    }
+    else
+    {
+      std::string buffer(1 << 20, '\0');
+      ssize_t n;
+      while ((n = read(fd, &buffer[0], buffer.size())) != 0)
+      {
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0)
+        {
+          error = std::strerror(errno);
+          break;
+        }
+        feed(buffer.data(), buffer.data() + n);
+      }
+    }
+    close(fd);
+    if (offset > blockStart)
+      endBlock(offset);
+    if (!error.empty())
+    {
+      // what was read is kept, but the file will be searched whole
+      this->error(path, error);
+      this->files[id].size = UINT64_MAX;
+    }
+  }
+
+  bool Index::save(std::string const & path)
+  {
+    std::string out(magic, 8);
+    put(out, version, 4);
+    put(out, this->files.size(), 4);
+    put(out, this->blocks.size(), 4);
+    put(out, this->trigrams.size(), 4);
+    put(out, this->postings.size(), 8);
+    for (File const & file : this->files)
+    {
+      put(out, file.path.size(), 4);
+      out += file.path;
+      put(out, file.size, 8);
+      put(out, file.mtime, 8);
+      put(out, file.compressed, 1);
+    }
+    for (Block const & block : this->blocks)
+    {
+      put(out, block.file, 4);
+      put(out, block.offset, 8);
+      put(out, block.length, 8);
+    }
+    for (Entry const & entry : this->trigrams)
+    {
+      put(out, entry.key, 4);
+      put(out, entry.count, 4);
+      put(out, entry.offset, 8);
+    }
+    out += this->postings;
+
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    file.write(out.data(), out.size());
+    file.close();
+    if (!file)
+    {
+      this->error(path, std::strerror(errno));
+      return false;
+    }
+    return true;
+  }
+
+  bool Index::load(std::string const & path)
+  {
+    this->files.clear();
+    this->blocks.clear();
+    this->trigrams.clear();
+    this->postings.clear();
+    this->errors.clear();
+
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+    {
+      this->error(path, std::strerror(errno));
+      return false;
+    }
+    std::string data((std::istreambuf_iterator<char>(file)),
+                     std::istreambuf_iterator<char>());
+    Cursor in{data.data(), data.data() + data.size(), true};
+    bool ok = in.getString(8) == std::string(magic, 8)
+      && in.get(4) == version;
+    uint64_t fileCount = in.get(4);
+    uint64_t blockCount = in.get(4);
+    uint64_t trigramCount = in.get(4);
+    uint64_t postingBytes = in.get(8);
+    for (uint64_t i = 0; ok && in.ok && i < fileCount; ++i)
+    {
+      File f;
+      f.path = in.getString(in.get(4));
+      f.size = in.get(8);
+      f.mtime = in.get(8);
+      f.compressed = in.get(1) != 0;
+      this->files.push_back(f);
+    }
+    for (uint64_t i = 0; ok && in.ok && i < blockCount; ++i)
+    {
+      Block b;
+      b.file = in.get(4);
+      b.offset = in.get(8);
+      b.length = in.get(8);
+      ok = b.file < fileCount;
+      this->blocks.push_back(b);
+    }
+    for (uint64_t i = 0; ok && in.ok && i < trigramCount; ++i)
+    {
+      Entry e;
+      e.key = in.get(4);
+      e.count = in.get(4);
+      e.offset = in.get(8);
+      ok = e.offset < postingBytes
+        && (this->trigrams.empty() || this->trigrams.back().key < e.key);
+      this->trigrams.push_back(e);
+    }
+    this->postings = in.getString(postingBytes);
+    if (!ok || !in.ok || in.p != in.end)
+    {
+      this->error(path, "malformed index");
+      this->files.clear();
+      this->blocks.clear();
+      this->trigrams.clear();
+      this->postings.clear();
+      return false;
+    }
+    return true;
+  }
+
+  std::vector<uint32_t> Index::blocksOf(uint32_t key) const
+  {
+    std::vector<uint32_t> ids;
+    auto entry = std::lower_bound(
+      this->trigrams.begin(), this->trigrams.end(), key,
+      [](Entry const & e, uint32_t k) { return e.key < k; });
+    if (entry == this->trigrams.end() || entry->key != key)
+      return ids;
+    Cursor in{this->postings.data() + entry->offset,
+              this->postings.data() + this->postings.size(), true};
+    uint64_t id = 0;
+    for (uint32_t i = 0; i < entry->count; ++i)
+    {
+      id += in.getVarint();
+      if (!in.ok || id >= this->blocks.size()) break;
+      ids.push_back(id);
+    }
+    return ids;
+  }
+
+  std::vector<uint32_t> Index::evaluate(nfa_trigram::Query const & query)
+    const
+  {
+    typedef nfa_trigram::Query::Op Op;
+    std::vector<uint32_t> ids;
+    if (query.getOp() == Op::all)
+    {
+      for (uint32_t id = 0; id < this->blocks.size(); ++id)
+        ids.push_back(id);
+      return ids;
+    }
+    if (query.getOp() == Op::none)
+      return ids;
+
+    bool conjunction = query.getOp() == Op::conjunction;
+    bool first = true;
+    auto merge = [&ids, &first, conjunction](std::vector<uint32_t> more) {
+      std::vector<uint32_t> merged;
+      if (first)
+        merged.swap(more);
+      else if (conjunction)
+        std::set_intersection(ids.begin(), ids.end(), more.begin(),
+                              more.end(), std::back_inserter(merged));
+      else
+        std::set_union(ids.begin(), ids.end(), more.begin(), more.end(),
+                       std::back_inserter(merged));
+      ids.swap(merged);
+      first = false;
+    };
+    for (uint32_t key : query.getTrigrams())
+    {
+      merge(this->blocksOf(key));
+      if (conjunction && ids.empty()) return ids;
+    }
+    for (nfa_trigram::Query const & sub : query.getSubs())
+    {
+      merge(this->evaluate(sub));
+      if (conjunction && ids.empty()) return ids;
+    }
+    return ids;
+  }
+
+  std::vector<Target> Index::candidates(nfa_trigram::Query const & query,
+                                        std::vector<std::string> const &
+                                          within,
+                                        size_t maxRangeBytes)
+  {
+    // each resolved root with the path it was given as
+    std::vector<std::pair<std::string, std::string>> roots;
+    for (std::string const & given : within)
+    {
+      std::string root;
+      if (canonical(given, root))
+        roots.emplace_back(given, root);
+      else
+        this->error(given, std::strerror(errno));
+    }
+    // without paths, the files under the current directory are named
+    // from it, as a search of "." names them
+    std::string here;
+    if (within.empty() && canonical(".", here))
+      roots.emplace_back(".", here);
+
+    std::vector<Target> targets(this->files.size());
+    std::vector<bool> wanted(this->files.size(), within.empty());
+    for (size_t i = 0; i < this->files.size(); ++i)
+    {
+      std::string const & path = this->files[i].path;
+      targets[i].path = path;
+      targets[i].whole = false;
+      for (auto const & root : roots)
+        if (isWithin(path, root.second))
+        {
+          targets[i].path = displayOf(path, root.first, root.second);
+          wanted[i] = true;
+          break;
+        }
+    }
+
+    for (uint32_t id : this->evaluate(query))
+    {
+      Block const & block = this->blocks[id];
+      Target & target = targets[block.file];
+      if (this->files[block.file].compressed)
+        target.whole = true;
+      else if (  !target.ranges.empty()
+              && target.ranges.back().second == block.offset
+              && block.offset + block.length - target.ranges.back().first
+                 <= maxRangeBytes
+              )
+        target.ranges.back().second += block.length;
+      else
+        target.ranges.emplace_back(block.offset,
+                                   block.offset + block.length);
+    }
+
+    // what the index says of a file which changed since is worthless
+    for (size_t i = 0; i < this->files.size(); ++i)
+    {
+      struct stat st;
+      if (!wanted[i]) continue;
+      if (  stat(this->files[i].path.c_str(), &st) != 0
+         || (uint64_t)st.st_size != this->files[i].size
+         || mtimeOf(st) != this->files[i].mtime
+         )
+      {
+        targets[i].whole = true;
+        targets[i].ranges.clear();
+      }
+    }
+
+    size_t kept = 0;
+    for (size_t i = 0; i < targets.size(); ++i)
+      if (wanted[i] && kept++ != i)
+        targets[kept - 1] = std::move(targets[i]);
+    targets.resize(kept);
+    return targets;
+  }
+
+  void Index::error(std::string path, std::string message)
+  {
+    this->errors.push_back(path + ": " + message);
+  }
+}
@@ -0,0 +1,129 @@
+#ifndef INDEX_HPP
+#define INDEX_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "search.hpp"
+#include "trigram.hpp"
+
+namespace grep
+{
+  /**
+   * A trigram index of a set of files, in the manner of Code Search.
+   * Files are cut into blocks of whole lines and, for every trigram of
+   * their lines, the index lists the blocks holding it, as ascending
+   * block numbers stored as varint deltas. The trigram query of a pattern
+   * then narrows a search to the blocks which may hold a match; the
+   * matcher still decides every line of those, so results stay exact.
+   * Trigrams are ASCII case folded and never span a newline. A compressed
+   * file is a single block and is searched whole; so is a file whose size
+   * or modification time changed since it was indexed.
+   */
+  class Index
+  {
+  public:
+    /**
+     * indexes the files under paths, replacing what the index held; the
+     * paths are stored resolved by realpath, so the index may be used
+     * from any working directory
+     * @param paths files and directories
+     * @param blockBytes a block ends at the first line end past this size
+     * @return false if some file could not be read, see getErrors; the
+     *         others are indexed anyway
+     */
+    bool build(std::vector<std::string> const & paths,
+               size_t blockBytes = 64 << 10);
+
+    /**
+     * writes the index to a file
+     * @param path
+     * @return false if it could not be written, see getErrors
+     */
+    bool save(std::string const & path);
+
+    /**
+     * reads an index written by save
+     * @param path
+     * @return false if it could not be read or is malformed, see getErrors
+     */
+    bool load(std::string const & path);
+
+    /**
+     * what went wrong, one "path: message" per problem
+     */
+    std::vector<std::string> const & getErrors() const
+    {
+      return this->errors;
+    }
+
+    size_t fileCount() const { return this->files.size(); }
+    size_t blockCount() const { return this->blocks.size(); }
+    size_t trigramCount() const { return this->trigrams.size(); }
+
+    /**
+     * the parts of the indexed files which may hold a line satisfying a
+     * query, for Searcher::run
+     * @param query
+     * @param within files and directories the targets are limited to,
+     *        all indexed files when empty; one which cannot be resolved
+     *        is reported in getErrors
+     * @param maxRangeBytes adjacent blocks are merged up to this size
+     * @return one target per indexed file within, in the order indexed,
+     *         named from the path given it lies under, or from the
+     *         current directory as "./..." when no path is given and
+     *         absolute outside it
+     */
+    std::vector<Target> candidates(nfa_trigram::Query const & query,
+                                   std::vector<std::string> const & within
+                                     = std::vector<std::string>(),
+                                   size_t maxRangeBytes = 8 << 20);
+
+  private:
+    struct File
+    {
+      std::string path;
+      uint64_t size;
+      int64_t mtime;
+      bool compressed;
+    };
+
+    struct Block
+    {
+      uint32_t file;
+      uint64_t offset;
+      uint64_t length;
+    };
+
+    /**
+     * where the blocks of a trigram are in postings
+     */
+    struct Entry
+    {
+      uint32_t key;
+      uint32_t count;
+      uint64_t offset;
+    };
+
+    /**
+     * the blocks of each trigram, while building
+     */
+    typedef std::unordered_map<uint32_t, std::vector<uint32_t>> Lists;
+
+    void indexFile(std::string const & path, size_t blockBytes,
+                   Lists & lists);
+    std::vector<uint32_t> blocksOf(uint32_t key) const;
+    std::vector<uint32_t> evaluate(nfa_trigram::Query const & query) const;
+    void error(std::string path, std::string message);
+
+    std::vector<File> files;
+    std::vector<Block> blocks;
+    std::vector<Entry> trigrams;
+    std::string postings;
+    std::vector<std::string> errors;
+  };
+}
+
+#endif /* INDEX_HPP */
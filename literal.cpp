@@ -0,0 +1,109 @@
+#include "literal.hpp"
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace nfa_literal
+{
+#ifdef __SSE2__
+  static bool isAlpha(char c)
+  {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+  }
+#endif
+
+  Finder::Finder(std::string needle, bool ignoreCase)
+    : needle(needle), ignoreCase(ignoreCase)
+  {
+    if (ignoreCase)
+      for (char & c : this->needle)
+        c = foldCase(c);
+  }
+
+  bool Finder::equalAt(char const * p) const
+  {
+    if (!this->ignoreCase)
+      return std::memcmp(p, this->needle.data(), this->needle.size()) == 0;
+    for (size_t i = 0; i < this->needle.size(); ++i)
+      if (foldCase(p[i]) != this->needle[i]) return false;
+    return true;
+  }
+
+  char const * Finder::find(char const * begin, char const * end) const
+  {
+    size_t n = this->needle.size();
+    if (n == 0) return begin;
+    if ((size_t)(end - begin) < n) return end;
+    // the last position a match can start at
+    char const * last = end - n;
+    char const * p = begin;
+
+#ifdef __SSE2__
+    char first = this->needle[0];
+    char final = this->needle[n - 1];
+    // setting bit 0x20 folds a letter to lower case; only letters of the
+    // needle are compared that way, so other bytes still compare exactly
+    bool foldFirst = this->ignoreCase && isAlpha(first);
+    bool foldFinal = this->ignoreCase && isAlpha(final);
+    __m128i const firsts = _mm_set1_epi8(first);
+    __m128i const finals = _mm_set1_epi8(final);
+    __m128i const firstFold = _mm_set1_epi8(foldFirst ? 0x20 : 0);
+    __m128i const finalFold = _mm_set1_epi8(foldFinal ? 0x20 : 0);
+    for (; p + 16 <= last + 1; p += 16)
+    {
+      __m128i a = _mm_loadu_si128((__m128i const *)p);
+      __m128i b = _mm_loadu_si128((__m128i const *)(p + n - 1));
+      a = _mm_or_si128(a, firstFold);
+      b = _mm_or_si128(b, finalFold);
+      unsigned mask = _mm_movemask_epi8(
+        _mm_and_si128(_mm_cmpeq_epi8(a, firsts), _mm_cmpeq_epi8(b, finals)));
+      while (mask != 0)
+      {
+        char const * candidate = p + __builtin_ctz(mask);
+        if (this->equalAt(candidate)) return candidate;
+        mask &= mask - 1;
+      }
+    }
+#endif
+
+    for (; p <= last; ++p)
+      if (this->equalAt(p)) return p;
+    return end;
+  }
+
+  char const * findAny(char const * begin, char const * end,
+                       char const * bytes, int n)
+  {
+    if (n == 0) return end;
+    if (n == 1)
+    {
+      void const * hit = std::memchr(begin, bytes[0], end - begin);
+      return hit == nullptr ? end : (char const *)hit;
+    }
+    char a = bytes[0];
+    char b = bytes[1];
+    char c = bytes[n - 1];
+    char const * p = begin;
+
+#ifdef __SSE2__
+    __m128i const as = _mm_set1_epi8(a);
+    __m128i const bs = _mm_set1_epi8(b);
+    __m128i const cs = _mm_set1_epi8(c);
+    for (; p + 16 <= end; p += 16)
+    {
+      __m128i x = _mm_loadu_si128((__m128i const *)p);
+      unsigned mask = _mm_movemask_epi8(
+        _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(x, as),
+                                  _mm_cmpeq_epi8(x, bs)),
+                     _mm_cmpeq_epi8(x, cs)));
+      if (mask != 0) return p + __builtin_ctz(mask);
+    }
+#endif
+
+    for (; p != end; ++p)
+      if (*p == a || *p == b || *p == c) return p;
+    return end;
+  }
+}
@@ -0,0 +1,84 @@
+#ifndef LITERAL_HPP
+#define LITERAL_HPP
+
+#include <cstddef>
+#include <string>
+#include "memory.hpp"
+
+namespace nfa_literal
+{
+  /**
+   * Finds a fixed string in a text, optionally ignoring ASCII case.
+   * Candidates are located 16 bytes at a time by comparing the first and
+   * the last byte of the needle with SSE2 (letters are compared with their
+   * 0x20 bit set, which folds case) and then verified byte by byte.
+   */
+  class Finder
+  {
+  public:
+    Finder(std::string needle, bool ignoreCase);
+
+    std::string getNeedle() const { return this->needle; }
+    bool isIgnoreCase() const { return this->ignoreCase; }
+
+    /**
+     * gives the position of the first occurrence of the needle
+     * in [begin, end)
+     * @param begin
+     * @param end
+     * @return the position, or end if there is none
+     */
+    char const * find(char const * begin, char const * end) const;
+
+    /**
+     * says whether or not the text contains the needle
+     * @param text
+     * @return
+     */
+    bool in(std::string const & text) const
+    {
+      char const * end = text.data() + text.size();
+      return this->find(text.data(), end) != end;
+    }
+
+    /**
+     * the bytes the finder takes, on the heap where it lives
+     */
+    size_t memoryUsage() const
+    {
+      return nfa_memory::blockBytes(sizeof(Finder))
+        + nfa_memory::stringBytes(this->needle);
+    }
+
+  private:
+    bool equalAt(char const * p) const;
+
+    std::string needle;
+    bool ignoreCase;
+  };
+
+  /**
+   * gives the position of the first of a few bytes in [begin, end),
+   * like memchr but for up to three bytes at once, compared 16 at a time
+   * with SSE2
+   * @param begin
+   * @param end
+   * @param bytes
+   * @param n how many of bytes to look for, at most 3
+   * @return the position, or end if there is none
+   */
+  char const * findAny(char const * begin, char const * end,
+                       char const * bytes, int n);
+
+  /**
+   * folds an ASCII letter to lower case, leaves anything else alone
+   * @param c
+   * @return
+   */
+  inline char foldCase(char c)
+  {
+    return (c >= 'A' && c <= 'Z') ? (char)(c | 0x20) : c;
+  }
+}
+
+#endif /* LITERAL_HPP */
@@ -1,44 +1,1754 @@
+#include "dfa.hpp"
+#include "follow.hpp"
+#include "index.hpp"
 #include "nfa.hpp"
+#include "search.hpp"
+#include "server.hpp"
+#include "static_nfa.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <iterator>
+#include <memory>
+#include <set>
+#include <sstream>
+#include <stdexcept>
 #include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <zlib.h>
 
-static int printTest(std::string pattern, std::string input, bool expected);
+static int printTest(std::string pattern, std::string input, bool expected,
+                     uint32_t flags = 0);
+
+static int printCheck(std::string name, bool ok);
+
+static std::vector<std::string> sortedLines(std::string output);
 
 static int mainTests();
 
+static int statsTests();
+
+static int searchTests();
+
+static int indexTests();
+
+static int followTests();
+
+static int serverTests();
+
+static int spanTests();
+
+static int budgetTests();
+
+static int staticTests();
+
+static int repeatTests();
+
+static int anchorTests();
+
+static int labelTests();
+
+static int memoryTests();
+
+static void usage();
+
+static void dumpStats(std::string jsonPath, std::string promPath);
+
+static nfa::NFA * compile(std::string const & pattern, uint32_t flags);
+
 int main(int argc, char* argv[])
 {
-  if (std::string(argv[1]) == "unit-tests")
+  std::vector<std::string> args;
+  std::string statsJSON;
+  std::string statsProm;
+  std::string also;
+  std::string buildIndex;
+  std::string indexPath;
+  std::string servePath;
+  uint32_t flags = 0;
+  bool recursive = false;
+  bool follow = false;
+  bool budgeted = false;
+  nfa_api::Budget budget;
+  grep::SearchOptions searchOptions;
+  for (int i = 1; i < argc; ++i)
   {
-    std::cout << "\nFailed: " << mainTests() << '\n';
+    std::string arg(argv[i]);
+    if (arg == "-i")
+      flags |= nfa::NFA::ignoreCase;
+    else if (arg == "-u")
+      flags |= nfa::NFA::utf8;
+    else if (arg == "-r")
+      recursive = true;
+    else if (arg == "-f")
+      follow = true;
+    else if (arg == "-j" && i + 1 < argc)
+      searchOptions.threads = std::atoi(argv[++i]);
+    else if (arg == "-A" && i + 1 < argc)
+      searchOptions.after = std::atoi(argv[++i]);
+    else if (arg == "-B" && i + 1 < argc)
+      searchOptions.before = std::atoi(argv[++i]);
+    else if (arg == "-c")
+      searchOptions.count = true;
+    else if (arg == "-v")
+      searchOptions.invert = true;
+    else if (arg == "-C" && i + 1 < argc)
+      searchOptions.before = searchOptions.after = std::atoi(argv[++i]);
+    else if (arg.compare(0, 6, "--and=") == 0)
+      also = arg.substr(6);
+    else if (arg.compare(0, 14, "--build-index=") == 0)
+      buildIndex = arg.substr(14);
+    else if (arg.compare(0, 8, "--index=") == 0)
+      indexPath = arg.substr(8);
+    else if (arg.compare(0, 8, "--serve=") == 0)
+      servePath = arg.substr(8);
+    else if (arg.compare(0, 11, "--max-work=") == 0)
+    {
+      budget.maxWork = std::strtoull(arg.c_str() + 11, nullptr, 10);
+      budgeted = true;
+    }
+    else if (arg.compare(0, 13, "--timeout-ms=") == 0)
+    {
+      budget.timeoutNanos =
+        std::strtoull(arg.c_str() + 13, nullptr, 10) * 1000000;
+      budgeted = true;
+    }
+    else if (arg.compare(0, 13, "--stats-json=") == 0)
+      statsJSON = arg.substr(13);
+    else if (arg.compare(0, 13, "--stats-prom=") == 0)
+      statsProm = arg.substr(13);
+    else
+      args.push_back(arg);
   }
-  else if (argc < 3)
+  if (!statsJSON.empty() || !statsProm.empty())
+    nfa_stats::Registry::setEnabled(true);
+  // only the match of one string is budgeted, see nfa_api::Budget
+  if (budgeted && (  recursive || follow || !also.empty()
+                   || !buildIndex.empty() || !servePath.empty()))
   {
-    std::cout << "usage: grep arg1 arg2\n"
-              << "arg1: the pattern to match\n"
-              << "arg2: the input string\n\n"
-              << "run unit tests: grep \"unit-tests\"\n";
+    std::cerr << "grep: --max-work and --timeout-ms only apply to "
+              << "matching one string\n";
+    return 2;
+  }
+
+  int status = 0;
+  if (args.size() == 1 && args[0] == "unit-tests")
+  {
+    std::cout << "\nFailed: "
+              << mainTests() + statsTests() + spanTests() + budgetTests()
+                 + staticTests() + repeatTests() + anchorTests()
+                 + labelTests() + memoryTests() + searchTests() + indexTests()
+                 + followTests() + serverTests() << '\n';
+  }
+  else if (!buildIndex.empty())
+  {
+    grep::Index index;
+    std::vector<std::string> paths(args);
+    if (paths.empty())
+      paths.push_back(".");
+    bool ok = index.build(paths);
+    ok = index.save(buildIndex) && ok;
+    for (std::string const & error : index.getErrors())
+      std::cerr << "grep: " << error << '\n';
+    std::cout << "indexed " << index.fileCount() << " files, "
+              << index.blockCount() << " blocks, "
+              << index.trigramCount() << " trigrams\n";
+    status = ok ? 0 : 2;
+  }
+  else if (!servePath.empty() && args.size() == 1)
+  {
+    // runs until killed; the sets are listed with their numbers and the
+    // bytes they take first
+    grep::RuleSets rules;
+    if (!rules.load(args[0], flags))
+    {
+      std::cerr << "grep: " << rules.getError() << '\n';
+      return 2;
+    }
+    grep::Server server(rules, searchOptions.threads);
+    if (!server.listen(servePath))
+    {
+      std::cerr << "grep: " << server.getError() << '\n';
+      return 2;
+    }
+    for (size_t set = 0; set < rules.size(); ++set)
+      std::cout << set << '\t' << rules.name(set) << '\t'
+                << rules.memoryUsage(set) << '\n';
+    std::cout.flush();
+    server.run();
+    return 2;
+  }
+  else if ((recursive || follow) && !args.empty())
+  {
+    // grep's exit status: 0 if a line matched, 1 if none did, 2 on errors
+    std::unique_ptr<nfa::NFA> nfaPtr(compile(args[0], flags));
+    if (!nfaPtr) return 2;
+    nfa::NFA & nfa = *nfaPtr;
+    std::unique_ptr<nfa::NFA> andNFA;
+    if (!also.empty())
+    {
+      andNFA.reset(compile(also, flags));
+      if (!andNFA) return 2;
+      searchOptions.also = andNFA.get();
+    }
+    std::vector<std::string> paths(args.begin() + 1, args.end());
+    if (follow)
+    {
+      // runs until interrupted, or until inotify fails
+      grep::Follower follower(nfa, searchOptions, std::cout);
+      bool watching = !paths.empty();
+      for (std::string const & path : paths)
+        watching = follower.add(path) && watching;
+      if (watching)
+        follower.run();
+      dumpStats(statsJSON, statsProm);
+      return 2;
+    }
+    if (paths.empty())
+      paths.push_back(".");
+    grep::Searcher searcher(nfa, searchOptions, STDOUT_FILENO);
+    grep::Index index;
+    bool matched = false;
+    if (indexPath.empty())
+      matched = searcher.run(paths);
+    else if (index.load(indexPath))
+    {
+      // the lines an inverted search selects need not hold any trigram
+      nfa_trigram::Query query = nfa.getTrigramQuery();
+      if (andNFA)
+        query = nfa_trigram::Query::andOf(query, andNFA->getTrigramQuery());
+      if (searchOptions.invert)
+        query = nfa_trigram::Query::all();
+      // paths given limit the search to the indexed files under them
+      matched = searcher.run(index.candidates(
+        query, std::vector<std::string>(args.begin() + 1, args.end())));
+    }
+    for (std::string const & error : index.getErrors())
+      std::cerr << "grep: " << error << '\n';
+    status = searcher.hadErrors() || !index.getErrors().empty() ? 2
+           : matched ? 0 : 1;
+  }
+  else if (args.size() < 2)
+  {
+    usage();
+  }
+  else if (  searchOptions.count || searchOptions.before != 0
+           || searchOptions.after != 0)
+  {
+    // one string is no lines to count or to print around
+    std::cerr << "grep: -c, -A, -B and -C need -r or -f\n";
+    status = 2;
+  }
+  else if (!also.empty())
+  {
+    std::unique_ptr<nfa::NFA> nfa(compile(args[0], flags));
+    std::unique_ptr<nfa::NFA> andNFA(nfa ? compile(also, flags) : nullptr);
+    if (!andNFA) return 2;
+    nfa_dfa::Intersection both(*nfa, *andNFA);
+    std::cout << std::boolalpha
+              << (both.accept(args[1]) != searchOptions.invert) << '\n';
   }
   else
   {
-    auto nfaPtr = new nfa::NFA(argv[1]);
-    std::cout << std::boolalpha << nfaPtr->accept(argv[2]) << '\n';
+    auto nfaPtr = compile(args[0], flags);
+    if (nfaPtr == nullptr) return 2;
+    nfa_api::MatchResult result = nfaPtr->accept(args[1], budget);
+    if (result == nfa_api::MatchResult::gaveUp)
+    {
+      std::cout << "gave up\n";
+      status = 2;
+    }
+    else
+      std::cout << std::boolalpha
+                << (  (result == nfa_api::MatchResult::accepted)
+                   != searchOptions.invert) << '\n';
     delete nfaPtr;
   }
+  dumpStats(statsJSON, statsProm);
+  return status;
+}
+
+static void usage()
+{
+  std::cout << "usage: grep [options] arg1 arg2\n"
+            << "arg1: the pattern to match\n"
+            << "arg2: the input string\n\n"
+            << "       grep -r [options] pattern [path...]\n"
+            << "prints the lines of the files which contain a match,\n"
+            << "recursing into directories\n\n"
+            << "       grep --build-index=FILE [path...]\n"
+            << "writes a trigram index of the files to FILE\n\n"
+            << "       grep -f [options] pattern file...\n"
+            << "prints the matching lines appended to the files from now\n"
+            << "on, following them through rotation\n\n"
+            << "       grep --serve=SOCKET [options] rules\n"
+            << "answers batches of checks against the rule sets of the\n"
+            << "file rules on a Unix domain socket, see server.hpp\n\n"
+            << "options:\n"
+            << "  -i                 ignore the case of ASCII letters\n"
+            << "  -u                 match UTF-8 code points, not bytes\n"
+            << "  -r                 search files and directories\n"
+            << "  -f                 follow files as they grow\n"
+            << "  -j N               search or serve with N threads\n"
+            << "                     (default: one per core)\n"
+            << "  -A N, -B N         with -r or -f, print N lines of\n"
+            << "                     context after or before matching\n"
+            << "                     lines\n"
+            << "  -C N               print N lines of context around them\n"
+            << "  -c                 with -r or -f, print only the number\n"
+            << "                     of matching lines of each file\n"
+            << "  -v                 select the lines without a match,\n"
+            << "                     or negate the answer for one string\n"
+            << "  --and=PATTERN      require a match of PATTERN too,\n"
+            << "                     decided in the same pass\n"
+            << "  --index=FILE       with -r, search the files of an index,\n"
+            << "                     those under the paths given if any,\n"
+            << "                     and, in them, only the blocks of\n"
+            << "                     lines where a match may be\n"
+            << "  --max-work=N       give up matching one string after N\n"
+            << "                     units of work and print \"gave up\"\n"
+            << "  --timeout-ms=N     give up matching one string after\n"
+            << "                     N ms\n"
+            << "  --stats-json=FILE  write matching statistics as JSON\n"
+            << "  --stats-prom=FILE  write matching statistics in the\n"
+            << "                     Prometheus text format\n"
+            << "  (statistics need a build with make STATS=1)\n\n"
+            << "run unit tests: grep \"unit-tests\"\n";
 }
 
-static int printTest(std::string pattern, std::string input, bool expected)
+static void dumpStats(std::string jsonPath, std::string promPath)
 {
-  auto nfaPtr = new nfa::NFA(pattern);
+#ifndef GREP11_STATS
+  if (!jsonPath.empty() || !promPath.empty())
+    std::cerr << "grep: statistics are not compiled in, "
+              << "rebuild with make STATS=1\n";
+#endif
+  if (!jsonPath.empty())
+  {
+    std::ofstream out(jsonPath);
+    nfa_stats::Registry::dumpJSON(out);
+  }
+  if (!promPath.empty())
+  {
+    std::ofstream out(promPath);
+    nfa_stats::Registry::dumpPrometheus(out);
+  }
+}
+
+/**
+ * @return the automaton of pattern, or nullptr when it is malformed,
+ *         which is reported on std::cerr
+ */
+static nfa::NFA * compile(std::string const & pattern, uint32_t flags)
+{
+  try
+  {
+    return new nfa::NFA(pattern, flags);
+  }
+  catch (std::invalid_argument const & e)
+  {
+    std::cerr << "grep: " << e.what() << '\n';
+    return nullptr;
+  }
+}
+
+static int printTest(std::string pattern, std::string input, bool expected,
+                     uint32_t flags)
+{
+  auto nfaPtr = new nfa::NFA(pattern, flags);
   bool b = nfaPtr->accept(input);
   delete nfaPtr;
   std::cout << "PATTERN: " << pattern << '\n';
+  if (flags != 0)
+    std::cout << "FLAGS: " << flags << '\n';
   std::cout << "INPUT: " << input << '\n';
   std::cout << "STATUS: " << ((expected == b) ? "[O]" : "[X]") << '\n';
   std::cout << "VALUE: " << std::boolalpha << b << '\n';
   return expected != b;
 }
 
+static int printCheck(std::string name, bool ok)
+{
+  std::cout << "CHECK: " << name << '\n';
+  std::cout << "STATUS: " << (ok ? "[O]" : "[X]") << '\n';
+  return !ok;
+}
+
+/**
+ * makes a fresh directory for tests to write files into
+ */
+static std::string tempDir()
+{
+  char path[] = "/tmp/grep11-XXXXXX";
+  return mkdtemp(path) == nullptr ? "" : path;
+}
+
+static void writeFile(std::string path, std::string content)
+{
+  std::ofstream out(path, std::ios::binary);
+  out << content;
+}
+
+/**
+ * writes content gzipped, as one member per part
+ */
+static void writeGzip(std::string path, std::vector<std::string> parts)
+{
+  for (size_t i = 0; i < parts.size(); ++i)
+  {
+    gzFile gz = gzopen(path.c_str(), i == 0 ? "wb" : "ab");
+    gzwrite(gz, parts[i].data(), parts[i].size());
+    gzclose(gz);
+  }
+}
+
+static int searchTests()
+{
+  uint16_t counter = 0;
+  std::string dir = tempDir();
+  counter += printCheck("search: temporary directory", !dir.empty());
+  if (dir.empty()) return counter;
+
+  mkdir((dir + "/sub").c_str(), 0700);
+  writeFile(dir + "/a.log", "ok\nERROR one\nfine\nERROR two\n");
+  writeFile(dir + "/sub/b.log", "ERROR three");
+  writeFile(dir + "/sub/empty.log", "");
+  std::string big;
+  for (int i = 0; i < 2000; ++i)
+    big += (i % 7 == 0 ? "ERROR line " : "info line ")
+         + std::to_string(i) + "\n";
+  writeFile(dir + "/sub/big.log", big);
+
+  nfa::NFA nfa("ER&R&O&R&");
+  grep::SearchOptions options;
+  options.threads = 4;
+  options.smallFileBytes = 64;
+  options.batchBytes = 128;
+  options.chunkBytes = 1000;
+  std::ostringstream out;
+  grep::Searcher searcher(nfa, options, out);
+  bool matched = searcher.run({dir});
+  counter += printCheck("search: matched", matched && !searcher.hadErrors());
+
+  // every file's lines are contiguous and in order
+  std::istringstream in(out.str());
+  std::string line;
+  std::vector<std::string> files;
+  std::vector<std::string> bigLines;
+  size_t lines = 0;
+  while (std::getline(in, line))
+  {
+    ++lines;
+    std::string file = line.substr(0, line.find(':'));
+    if (files.empty() || files.back() != file)
+      files.push_back(file);
+    if (file == dir + "/sub/big.log")
+      bigLines.push_back(line.substr(file.size() + 1));
+  }
+  std::vector<std::string> expected;
+  for (int i = 0; i < 2000; i += 7)
+    expected.push_back("ERROR line " + std::to_string(i));
+  counter += printCheck("search: files do not interleave", files.size() == 3);
+  counter += printCheck("search: chunked file in order", bigLines == expected);
+  counter += printCheck("search: line count", lines == 3 + expected.size());
+
+  std::ostringstream none;
+  nfa::NFA absent("no&p&e&");
+  grep::Searcher nothing(absent, options, none);
+  counter += printCheck("search: no match",
+                        !nothing.run({dir + "/a.log"}) && none.str().empty());
+
+  grep::Searcher missing(nfa, options, none);
+  missing.run({dir + "/missing"});
+  counter += printCheck("search: missing file", missing.hadErrors());
+
+  // compressed files are recognized by their magic bytes
+  std::string text;
+  for (int i = 0; i < 30000; ++i)
+    text += (i % 1000 == 999 ? "ERROR at " : "fine at ") + std::to_string(i)
+          + "\n";
+  writeGzip(dir + "/archive.log.1",
+            {text.substr(0, 100000), text.substr(100000)});
+  {
+    int fd = open((dir + "/archive.log.1").c_str(), O_RDONLY);
+    grep::DecompressingReader reader(fd, grep::Compression::gzip, 7, 2);
+    std::string block;
+    std::string all;
+    while (reader.next(block))
+      all += block;
+    close(fd);
+    counter += printCheck("decompress: gzip members",
+                          all == text && reader.getError().empty());
+  }
+  {
+    // the producer sleeps on the full queue and is woken to be cancelled
+    int fd = open((dir + "/archive.log.1").c_str(), O_RDONLY);
+    std::string block;
+    bool first = false;
+    {
+      grep::DecompressingReader reader(fd, grep::Compression::gzip, 7, 2);
+      usleep(20000);
+      first = reader.next(block);
+    }
+    close(fd);
+    counter += printCheck("decompress: cancelled while waiting",
+                          first && block == text.substr(0, 7));
+  }
+  std::ostringstream gz;
+  grep::Searcher gzSearcher(nfa, options, gz);
+  gzSearcher.run({dir + "/archive.log.1"});
+  std::string gzExpected;
+  for (int i = 999; i < 30000; i += 1000)
+    gzExpected += dir + "/archive.log.1:ERROR at " + std::to_string(i) + "\n";
+  counter += printCheck("search: gzip file",
+                        gz.str() == gzExpected && !gzSearcher.hadErrors());
+
+  // context windows are merged and told apart by --
+  std::string numbered;
+  for (int i = 1; i <= 20; ++i)
+    numbered += (i == 5 || i == 7 || i == 15 ? "x " : "")
+              + std::to_string(i) + "\n";
+  writeFile(dir + "/numbered", numbered);
+  grep::SearchOptions contextOptions;
+  contextOptions.before = 2;
+  contextOptions.after = 1;
+  nfa::NFA x("x");
+  std::ostringstream context;
+  grep::Searcher contextSearcher(x, contextOptions, context);
+  contextSearcher.run({dir + "/numbered"});
+  std::string path = dir + "/numbered";
+  counter += printCheck("context: windows merged",
+                        context.str() == path + "-3\n" + path + "-4\n"
+                                       + path + ":x 5\n" + path + "-6\n"
+                                       + path + ":x 7\n" + path + "-8\n"
+                                       + "--\n"
+                                       + path + "-13\n" + path + "-14\n"
+                                       + path + ":x 15\n" + path + "-16\n");
+
+  // before-context survives the blocks of a stream
+  contextOptions.before = 1;
+  contextOptions.after = 0;
+  std::ostringstream streamed;
+  grep::Searcher streamSearcher(nfa, contextOptions, streamed);
+  streamSearcher.run({dir + "/archive.log.1"});
+  std::string streamExpected;
+  for (int i = 999; i < 30000; i += 1000)
+    streamExpected += (i == 999 ? "" : "--\n")
+                    + dir + "/archive.log.1-fine at " + std::to_string(i - 1)
+                    + "\n" + dir + "/archive.log.1:ERROR at "
+                    + std::to_string(i) + "\n";
+  counter += printCheck("context: across stream blocks",
+                        streamed.str() == streamExpected);
+
+  // counting takes whole buffers, chunks and streams alike
+  grep::SearchOptions countOptions = options;
+  countOptions.count = true;
+  countOptions.before = 3;
+  std::ostringstream counted;
+  grep::Searcher countSearcher(nfa, countOptions, counted);
+  bool countMatched = countSearcher.run({dir + "/sub/big.log",
+                                         dir + "/archive.log.1",
+                                         dir + "/numbered",
+                                         dir + "/sub/b.log"});
+  // files finish in any order
+  std::istringstream countLines(counted.str());
+  std::vector<std::string> countOutput;
+  while (std::getline(countLines, line))
+    countOutput.push_back(line);
+  std::sort(countOutput.begin(), countOutput.end());
+  std::vector<std::string> countExpected = {
+    dir + "/archive.log.1:30", dir + "/numbered:0",
+    dir + "/sub/b.log:1",
+    dir + "/sub/big.log:" + std::to_string(expected.size())
+  };
+  counter += printCheck("count: per file", countMatched
+                        && countOutput == countExpected);
+
+  // with and without a required literal, as the lines are searched
+  std::string mixed = "ab\n\nxaby\nba\nb\na\nabab";
+  for (std::string pattern : { "ab&", "a*b&", "a?", "\\d", "ab|+" })
+  {
+    nfa::NFA counting(pattern);
+    nfa_dfa::LineCounter lineCounter(counting);
+    uint64_t lines = 0;
+    std::istringstream split(mixed);
+    while (std::getline(split, line))
+      lines += counting.search(line.data(), line.data() + line.size());
+    counter += printCheck("count: lines of " + pattern,
+                          lineCounter.count(mixed.data(),
+                                            mixed.data() + mixed.size())
+                          == lines);
+  }
+
+  // inverted searches select the other lines, with or without a literal
+  grep::SearchOptions invertOptions;
+  invertOptions.invert = true;
+  std::ostringstream inverted;
+  grep::Searcher invertSearcher(nfa, invertOptions, inverted);
+  bool invertMatched = invertSearcher.run({dir + "/a.log"});
+  nfa::NFA noLiteral("EF|R&+");
+  std::ostringstream invertedClass;
+  grep::Searcher classSearcher(noLiteral, invertOptions, invertedClass);
+  classSearcher.run({dir + "/a.log"});
+  std::string invertExpected = dir + "/a.log:ok\n" + dir + "/a.log:fine\n";
+  counter += printCheck("invert: lines without a match",
+                        invertMatched && inverted.str() == invertExpected
+                        && invertedClass.str() == invertExpected);
+  invertOptions.count = true;
+  std::ostringstream invertCount;
+  grep::Searcher invertCounter(nfa, invertOptions, invertCount);
+  invertCounter.run({dir + "/sub/big.log"});
+  counter += printCheck("invert: count",
+                        invertCount.str()
+                        == dir + "/sub/big.log:"
+                           + std::to_string(2000 - expected.size()) + "\n");
+  std::ostringstream allMatch;
+  grep::Searcher allSearcher(nfa, invertOptions, allMatch);
+  counter += printCheck("invert: nothing selected",
+                        !allSearcher.run({dir + "/sub/b.log"})
+                        && allMatch.str() == dir + "/sub/b.log:0\n");
+
+  // --and selects lines matching a second pattern as well
+  grep::SearchOptions andOptions;
+  nfa::NFA two("tw&o&");
+  andOptions.also = &two;
+  std::ostringstream anded;
+  grep::Searcher andSearcher(nfa, andOptions, anded);
+  andSearcher.run({dir + "/a.log"});
+  andOptions.invert = true;
+  andOptions.count = true;
+  std::ostringstream andCount;
+  grep::Searcher andCounter(nfa, andOptions, andCount);
+  andCounter.run({dir + "/a.log"});
+  counter += printCheck("and: lines matching both",
+                        anded.str() == dir + "/a.log:ERROR two\n"
+                        && andCount.str() == dir + "/a.log:3\n");
+
+  // long lines are borrowed from the buffer they were read into, so they
+  // are written as it holds them, unless copied before it is reused;
+  // short ones are copied at once
+  std::string read = std::string(299, 'o') + "\n" + std::string(299, 't')
+                   + "\n" + "ab\n";
+  grep::OutputBuffer output;
+  output.append("a:");
+  output.borrow(read.data(), read.data() + 300);
+  output.borrow(read.data() + 300, read.data() + 600);
+  output.borrow(read.data() + 600, read.data() + 603);
+  grep::OutputBuffer more;
+  more.append("b:");
+  more.borrow(read.data(), read.data() + 300);
+  more.own();
+  std::fill(read.begin(), read.end(), 'x');
+  output.splice(more);
+  std::ostringstream spliced;
+  output.writeTo(spliced);
+  std::string xs = std::string(299, 'x') + "x";
+  counter += printCheck("output: borrowed and copied",
+                        spliced.str() == "a:" + xs + xs + "ab\nb:"
+                                         + std::string(299, 'o') + "\n"
+                        && output.size() == 907 && more.empty());
+
+  // the memory of an output written is handed on to the next one
+  std::vector<std::string> spare;
+  size_t capacity = output.held();
+  output.recycle(spare);
+  grep::OutputBuffer next;
+  next.adopt(std::move(spare.front()));
+  std::string & reread = next.hold(std::move(spare.back()));
+  counter += printCheck("output: memory recycled",
+                        output.empty() && spare.size() == 2
+                        && reread.empty() && reread.capacity() > 0
+                        && capacity > 0);
+
+  // a searcher writing to a file descriptor prints the same lines, and
+  // more pieces than one writev takes are written whole
+  std::string many;
+  for (int i = 0; i < 5000; ++i)
+    many += "ERROR " + std::to_string(i) + "\n";
+  writeFile(dir + "/sub/many.log", many);
+  std::string outPath = dir + "/out.txt";
+  int fd = open(outPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  grep::Searcher fdSearcher(nfa, options, fd);
+  bool fdMatched = fdSearcher.run({dir + "/a.log", dir + "/sub"});
+  close(fd);
+  std::ostringstream streamOut;
+  grep::Searcher streamSearcher2(nfa, options, streamOut);
+  streamSearcher2.run({dir + "/a.log", dir + "/sub"});
+  std::ifstream written(outPath);
+  std::string printed((std::istreambuf_iterator<char>(written)),
+                      std::istreambuf_iterator<char>());
+  counter += printCheck("output: written with writev",
+                        fdMatched && !printed.empty()
+                        && sortedLines(printed)
+                           == sortedLines(streamOut.str()));
+
+  // a failed write is an error, and the search writes no more after it
+  int full = open("/dev/full", O_WRONLY);
+  grep::Searcher fullSearcher(nfa, options, full);
+  bool fullMatched = fullSearcher.run({dir + "/a.log", dir + "/sub"});
+  close(full);
+  counter += printCheck("output: write error",
+                        full < 0 || (fullMatched && fullSearcher.hadErrors()));
+
+  writeFile(dir + "/broken.gz", "\x1f\x8b garbage");
+  std::ostringstream broken;
+  grep::Searcher brokenSearcher(nfa, options, broken);
+  brokenSearcher.run({dir + "/broken.gz"});
+  counter += printCheck("search: corrupt gzip file",
+                        brokenSearcher.hadErrors());
+
+  std::string command = "rm -rf " + dir;
+  counter += printCheck("search: cleanup", std::system(command.c_str()) == 0);
+  return counter;
+}
+
+/**
+ * the lines a searcher prints, sorted, as files may come in any order
+ */
+static std::vector<std::string> sortedLines(std::string output)
+{
+  std::istringstream in(output);
+  std::vector<std::string> lines;
+  std::string line;
+  while (std::getline(in, line))
+    lines.push_back(line);
+  std::sort(lines.begin(), lines.end());
+  return lines;
+}
+
+static int printQuery(std::string pattern, std::string expected,
+                      uint32_t flags = 0)
+{
+  std::string query = nfa::NFA(pattern, flags).getTrigramQuery().toString();
+  return printCheck("trigrams: " + pattern + " -> " + expected,
+                    query == expected);
+}
+
+static int indexTests()
+{
+  uint16_t counter = 0;
+  counter += printQuery("ab&c&d&", "abc bcd");
+  counter += printQuery("ab&c&xy&z&|", "abc | xyz");
+  counter += printQuery("AB&C&", "abc", nfa::NFA::ignoreCase);
+  counter += printQuery("ab&c&.*&xy&z&&", "abc xyz");
+  counter += printQuery("ab&c&xy|&", "abc (bcx | bcy)");
+  counter += printQuery("ab&c&{2,}", "abc");
+  counter += printQuery("ab&c&?", "+");
+  counter += printQuery("ab&", "+");
+  counter += printQuery(".*", "+");
+  counter += printQuery("\\d+", "+");
+
+  std::string dir = tempDir();
+  counter += printCheck("index: temporary directory", !dir.empty());
+  if (dir.empty()) return counter;
+
+  mkdir((dir + "/sub").c_str(), 0700);
+  std::string big;
+  for (int i = 0; i < 3000; ++i)
+    big += (i % 500 == 7 ? "Error code " : "info line ") + std::to_string(i)
+         + "\n";
+  writeFile(dir + "/big.log", big);
+  writeFile(dir + "/sub/a.log", "fine\nerror here\nok");
+  writeFile(dir + "/sub/empty.log", "");
+  writeGzip(dir + "/sub/old.log.1", {"archived\nERROR old\n"});
+
+  grep::Index index;
+  bool built = index.build({dir}, 1000);
+  std::string indexPath = dir + "/../" + dir.substr(5) + ".idx";
+  counter += printCheck("index: build and save",
+                        built && index.save(indexPath)
+                        && index.fileCount() == 4 && index.blockCount() > 30);
+  grep::Index loaded;
+  counter += printCheck("index: load", loaded.load(indexPath)
+                        && loaded.blockCount() == index.blockCount()
+                        && loaded.trigramCount() == index.trigramCount());
+
+  grep::SearchOptions options;
+  options.threads = 2;
+  options.smallFileBytes = 64;
+  options.chunkBytes = 5000;
+  bool same = true;
+  for (std::string pattern : {"er&r&o&r&", "co&d&e&\\s&\\d+&", "in&f&o&",
+                              "ol&d&", "ab&c&", "\\d+", "xy&z&7|"})
+  {
+    nfa::NFA nfa(pattern, nfa::NFA::ignoreCase);
+    std::ostringstream plain;
+    std::ostringstream indexed;
+    grep::Searcher(nfa, options, plain).run({dir});
+    grep::Searcher(nfa, options, indexed)
+      .run(loaded.candidates(nfa.getTrigramQuery()));
+    same = same && sortedLines(plain.str()) == sortedLines(indexed.str());
+  }
+  counter += printCheck("index: same lines as a full search", same);
+
+  nfa::NFA code("co&d&e&", nfa::NFA::ignoreCase);
+  uint64_t candidateBytes = 0;
+  for (grep::Target const & target
+       : loaded.candidates(code.getTrigramQuery()))
+    for (auto const & range : target.ranges)
+      candidateBytes += range.second - range.first;
+  counter += printCheck("index: candidates narrowed",
+                        candidateBytes > 0 && candidateBytes < big.size() / 4);
+
+  grep::SearchOptions counting(options);
+  counting.count = true;
+  std::ostringstream counts;
+  grep::Searcher(code, counting, counts)
+    .run(loaded.candidates(code.getTrigramQuery()));
+  counter += printCheck("index: counts of every file",
+                        sortedLines(counts.str()) == std::vector<std::string>{
+                          dir + "/big.log:6", dir + "/sub/a.log:0",
+                          dir + "/sub/empty.log:0", dir + "/sub/old.log.1:0"});
+
+  // paths are stored resolved, and searches may be limited to some
+  grep::Index relative;
+  relative.build({dir + "/sub/../sub/"}, 1000);
+  std::vector<std::string> resolved;
+  for (grep::Target const & target
+       : relative.candidates(nfa_trigram::Query::all()))
+    resolved.push_back(target.path);
+  std::sort(resolved.begin(), resolved.end());
+  counter += printCheck("index: resolved paths",
+                        resolved == std::vector<std::string>{
+                          dir + "/sub/a.log", dir + "/sub/empty.log",
+                          dir + "/sub/old.log.1" });
+  std::vector<grep::Target> within = loaded.candidates(
+    code.getTrigramQuery(), {dir + "/sub", dir + "/big.log"});
+  std::vector<grep::Target> file = loaded.candidates(
+    code.getTrigramQuery(), {dir + "/sub/../big.log"});
+  counter += printCheck("index: limited to paths",
+                        within.size() == 4 && file.size() == 1
+                        && !file[0].ranges.empty()
+                        && loaded.getErrors().empty());
+
+  // files are named as a search of the paths given names them, or from
+  // the current directory without paths
+  std::ostringstream plainNames;
+  std::ostringstream indexedNames;
+  grep::Searcher(code, counting, plainNames).run({dir + "/sub/../sub/"});
+  grep::Searcher(code, counting, indexedNames)
+    .run(loaded.candidates(code.getTrigramQuery(), {dir + "/sub/../sub/"}));
+  std::vector<std::string> here;
+  char * cwd = getcwd(nullptr, 0);
+  if (cwd != nullptr && chdir(dir.c_str()) == 0)
+  {
+    for (grep::Target const & target
+         : loaded.candidates(nfa_trigram::Query::all()))
+      here.push_back(target.path);
+    here.push_back(chdir(cwd) == 0 ? "" : "!");
+  }
+  free(cwd);
+  std::sort(here.begin(), here.end());
+  counter += printCheck("index: paths named as given",
+                        file[0].path == dir + "/sub/../big.log"
+                        && plainNames.str() == indexedNames.str()
+                        && here == std::vector<std::string>{
+                          "", "./big.log", "./sub/a.log", "./sub/empty.log",
+                          "./sub/old.log.1" });
+  mkdir((dir + "/su").c_str(), 0700);
+  std::vector<grep::Target> none = loaded.candidates(
+    code.getTrigramQuery(), {dir + "/su", dir + "/missing"});
+  counter += printCheck("index: path not indexed",
+                        none.empty() && loaded.getErrors().size() == 1);
+
+  // a file changed since indexing is searched whole
+  writeFile(dir + "/sub/a.log", "fine\nerror here\nok\nnew code\n");
+  std::ostringstream changed;
+  grep::Searcher(code, options, changed)
+    .run(loaded.candidates(code.getTrigramQuery()));
+  counter += printCheck("index: changed file",
+                        changed.str().find(dir + "/sub/a.log:new code\n")
+                        != std::string::npos);
+
+  writeFile(indexPath, "GREP11IX garbage");
+  counter += printCheck("index: malformed index", !loaded.load(indexPath)
+                        && loaded.getErrors().size() == 1
+                        && loaded.fileCount() == 0);
+
+  std::string command = "rm -rf " + dir + " " + indexPath;
+  counter += printCheck("index: cleanup", std::system(command.c_str()) == 0);
+  return counter;
+}
+
+static void appendFile(std::string path, std::string content)
+{
+  std::ofstream out(path, std::ios::binary | std::ios::app);
+  out << content;
+}
+
+static int followTests()
+{
+  uint16_t counter = 0;
+  std::string dir = tempDir();
+  counter += printCheck("follow: temporary directory", !dir.empty());
+  if (dir.empty()) return counter;
+
+  std::string path = dir + "/app.log";
+  writeFile(path, "ERROR before\nERROR half");
+  nfa::NFA nfa("ER&R&O&R&");
+  grep::SearchOptions options;
+  std::ostringstream out;
+  grep::Follower follower(nfa, options, out);
+  bool added = follower.add(path);
+  appendFile(path, " done\nok\nERROR new\n");
+  follower.poll(1000);
+  counter += printCheck("follow: appended lines only",
+                        added && out.str() == path + ":ERROR half done\n"
+                                              + path + ":ERROR new\n");
+
+  out.str("");
+  appendFile(path, "ERROR par");
+  follower.poll(1000);
+  bool waited = out.str().empty();
+  appendFile(path, "tial\nfine\n");
+  follower.poll(1000);
+  counter += printCheck("follow: partial line",
+                        waited && out.str() == path + ":ERROR partial\n");
+
+  // renamed away, then written to once more before a new file comes
+  out.str("");
+  std::rename(path.c_str(), (path + ".1").c_str());
+  appendFile(path + ".1", "ERROR late");
+  writeFile(path, "ERROR rotated\n");
+  follower.poll(1000);
+  counter += printCheck("follow: rotation by rename",
+                        out.str() == path + ":ERROR late\n"
+                                     + path + ":ERROR rotated\n");
+
+  out.str("");
+  writeFile(path, "ERROR cut\n");
+  follower.poll(1000);
+  counter += printCheck("follow: truncation",
+                        out.str() == path + ":ERROR cut\n");
+
+  out.str("");
+  std::string later = dir + "/later.log";
+  bool addedLater = follower.add(later);
+  writeFile(later, "ERROR created\n");
+  follower.poll(1000);
+  counter += printCheck("follow: file created later",
+                        addedLater && out.str() == later + ":ERROR created\n"
+                        && !follower.hadErrors());
+
+  std::string command = "rm -rf " + dir;
+  counter += printCheck("follow: cleanup", std::system(command.c_str()) == 0);
+  return counter;
+}
+
+/**
+ * connects to the Unix domain socket at path, -1 if it cannot
+ */
+static int connectTo(std::string path)
+{
+  struct sockaddr_un address;
+  std::memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  std::strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd >= 0 && connect(fd, (struct sockaddr *)&address,
+                         sizeof(address)) != 0)
+  {
+    close(fd);
+    fd = -1;
+  }
+  // a server which never answers fails the test rather than hanging it
+  struct timeval timeout = { 5, 0 };
+  if (fd >= 0)
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  return fd;
+}
+
+/**
+ * reads n bytes, false if the connection ends first
+ */
+static bool readAll(int fd, std::string & bytes, size_t n)
+{
+  bytes.resize(n);
+  for (size_t got = 0; got < n;)
+  {
+    ssize_t r = read(fd, &bytes[got], n - got);
+    if (r <= 0) return false;
+    got += r;
+  }
+  return true;
+}
+
+/**
+ * reads a reply frame and decodes it
+ */
+static bool readReply(int fd, uint32_t & id,
+                      std::vector<grep::Server::Verdict> & verdicts)
+{
+  std::string header, frame;
+  if (!readAll(fd, header, 4)) return false;
+  uint32_t length = 0;
+  for (int i = 0; i < 4; ++i)
+    length |= (uint32_t)(unsigned char)header[i] << (8 * i);
+  return readAll(fd, frame, length)
+    && grep::Server::decodeReply(frame.data(), frame.data() + length, id,
+                                 verdicts);
+}
+
+static int serverTests()
+{
+  typedef grep::Server::Mode Mode;
+  typedef grep::Server::Verdict Verdict;
+  uint16_t counter = 0;
+
+  grep::RuleSets rules;
+  std::istringstream text("# sets of log lines\n"
+                          "errors\tER&R&O&R&\n"
+                          "\n"
+                          "digits\t\\d+\n"
+                          "errors\tfa&i&l&\n");
+  counter += printCheck("server: rule sets",
+                        rules.load(text) && rules.size() == 2
+                        && rules.name(0) == "errors"
+                        && rules.name(1) == "digits");
+  grep::RuleSets bad;
+  std::istringstream noTab("errors ER&\n");
+  std::istringstream malformed("ok\tx\nerrors\ta|\n");
+  counter += printCheck("server: rules without a tab",
+                        !bad.load(noTab)
+                        && bad.getError().compare(0, 7, "line 1:") == 0);
+  counter += printCheck("server: malformed rule",
+                        !bad.load(malformed)
+                        && bad.getError().compare(0, 7, "line 2:") == 0);
+  // joined, ab and a| would make the valid aba||
+  std::istringstream halves("ok\tab\nok\ta|\n");
+  counter += printCheck("server: rules checked alone",
+                        !bad.load(halves)
+                        && bad.getError().compare(0, 7, "line 1:") == 0);
+
+  std::string dir = tempDir();
+  counter += printCheck("server: temporary directory", !dir.empty());
+  if (dir.empty()) return counter;
+  std::string socketPath = dir + "/grep.sock";
+
+  std::unique_ptr<grep::Server> server(new grep::Server(rules, 2));
+  bool listening = server->listen(socketPath);
+  counter += printCheck("server: listen", listening);
+  if (!listening) return counter;
+  std::thread running(&grep::Server::run, server.get());
+
+  // two requests sent at once, the first cut in two writes
+  int client = connectTo(socketPath);
+  std::string requests =
+    grep::Server::encodeRequest(7, {
+      { 0, Mode::search, "an ERROR here" },
+      { 0, Mode::search, "fine" },
+      { 0, Mode::accept, "fail" },
+      { 0, Mode::accept, "failed" },
+      { 1, Mode::search, "ab12" },
+      { 1, Mode::accept, "ab12" },
+      { 2, Mode::search, "x" },
+      { 0, (Mode)9, "ERROR" } })
+    + grep::Server::encodeRequest(8, {});
+  bool sent = write(client, requests.data(), 6) == 6;
+  usleep(10000);
+  sent = sent && write(client, requests.data() + 6, requests.size() - 6)
+                 == (ssize_t)(requests.size() - 6);
+  uint32_t id = 0;
+  std::vector<Verdict> verdicts;
+  bool first = readReply(client, id, verdicts);
+  counter += printCheck("server: batch",
+                        sent && first && id == 7
+                        && verdicts == std::vector<Verdict>{
+                             Verdict::hit, Verdict::miss, Verdict::hit,
+                             Verdict::miss, Verdict::hit, Verdict::miss,
+                             Verdict::invalid, Verdict::invalid });
+  bool second = readReply(client, id, verdicts);
+  counter += printCheck("server: pipelined empty batch",
+                        second && id == 8 && verdicts.empty());
+
+  // the other worker answers while the first connection stays open
+  int other = connectTo(socketPath);
+  std::string request = grep::Server::encodeRequest(9, {
+    { 1, Mode::accept, "2024" } });
+  sent = write(other, request.data(), request.size())
+         == (ssize_t)request.size();
+  counter += printCheck("server: second connection",
+                        sent && readReply(other, id, verdicts) && id == 9
+                        && verdicts == std::vector<Verdict>{ Verdict::hit });
+  close(other);
+
+  // idle connections hold no worker: more stay open than there are
+  // workers, and each is answered, the last opened first
+  std::vector<int> idle;
+  for (int i = 0; i < 5; ++i)
+    idle.push_back(connectTo(socketPath));
+  usleep(10000);
+  bool answered = true;
+  for (size_t i = idle.size(); i-- > 0;)
+  {
+    request = grep::Server::encodeRequest(20 + i, {
+      { 0, Mode::search, i % 2 ? "ERROR" : "fine" } });
+    answered = answered
+      && write(idle[i], request.data(), request.size())
+         == (ssize_t)request.size()
+      && readReply(idle[i], id, verdicts) && id == 20 + i
+      && verdicts == std::vector<Verdict>{
+           i % 2 ? Verdict::hit : Verdict::miss };
+  }
+  for (int fd : idle)
+    close(fd);
+  counter += printCheck("server: more connections than workers", answered);
+
+  std::string garbage("\3\0\0\0abc", 7);
+  int broken = connectTo(socketPath);
+  sent = write(broken, garbage.data(), garbage.size())
+         == (ssize_t)garbage.size();
+  char byte;
+  counter += printCheck("server: malformed frame closes",
+                        sent && read(broken, &byte, 1) == 0);
+  close(broken);
+
+  server->stop();
+  running.join();
+  counter += printCheck("server: stop closes connections",
+                        read(client, &byte, 1) == 0);
+  close(client);
+  server.reset();
+  counter += printCheck("server: socket removed",
+                        access(socketPath.c_str(), F_OK) != 0);
+
+  std::string command = "rm -rf " + dir;
+  counter += printCheck("server: cleanup", std::system(command.c_str()) == 0);
+  return counter;
+}
+
+/**
+ * finds the leftmost-longest span by trying every substring
+ */
+static bool bruteSpan(nfa::NFA & nfa, std::string input,
+                      nfa_dfa::Span & span)
+{
+  for (size_t b = 0; b <= input.size(); ++b)
+    for (size_t e = input.size() + 1; e-- > b;)
+      if (nfa.accept(input.substr(b, e - b)))
+      {
+        span.begin = b;
+        span.end = e;
+        return true;
+      }
+  return false;
+}
+
+static int printSpan(std::string pattern, std::string input,
+                     bool expected, size_t begin, size_t end)
+{
+  nfa::NFA nfa(pattern);
+  nfa_dfa::SpanFinder finder(nfa);
+  nfa_dfa::Span span = { 0, 0 };
+  bool found = finder.find(input.data(), input.data() + input.size(), span);
+  bool ok = found == expected
+    && (!found || (span.begin == begin && span.end == end));
+  std::cout << "PATTERN: " << pattern << '\n';
+  std::cout << "INPUT: " << input << '\n';
+  std::cout << "STATUS: " << (ok ? "[O]" : "[X]") << '\n';
+  if (found)
+    std::cout << "SPAN: [" << span.begin << ", " << span.end << ")\n";
+  else
+    std::cout << "SPAN: none\n";
+  return !ok;
+}
+
+static int spanTests()
+{
+  uint16_t counter = 0;
+  counter += printSpan("ab&c&d&c|", "abcd", true, 0, 4);
+  counter += printSpan("ab&c&d&c|", "xxcabcd", true, 2, 3);
+  counter += printSpan("a+", "bbaaab", true, 2, 5);
+  counter += printSpan("a*", "bbb", true, 0, 0);
+  counter += printSpan("ab&", "", false, 0, 0);
+  counter += printSpan("ab&", "xaxb", false, 0, 0);
+  counter += printSpan("\\d+", "id 1234, 56", true, 3, 7);
+  counter += printSpan("ab|*c&", "xxababbcd", true, 2, 8);
+
+  // every pattern against every input agrees with trying all substrings
+  std::vector<std::string> patterns = {
+    "ab&c&d&c|", "a*b&", "ab|*", "ab&+c?&", ".a&.&", "\\w+", "a?b?&a&"
+  };
+  std::vector<std::string> inputs = {
+    "", "a", "abcd", "bab", "aabacbab", "xcabcdx", "ba ab", "cccabaa"
+  };
+  bool agree = true;
+  for (std::string const & pattern : patterns)
+  {
+    nfa::NFA nfa(pattern);
+    nfa_dfa::SpanFinder finder(nfa);
+    for (std::string const & input : inputs)
+    {
+      nfa_dfa::Span span = { 0, 0 }, expected = { 0, 0 };
+      bool found = finder.find(input.data(), input.data() + input.size(),
+                               span);
+      bool wanted = bruteSpan(nfa, input, expected);
+      agree = agree && found == wanted
+        && (!found || (  span.begin == expected.begin
+                      && span.end == expected.end));
+    }
+  }
+  counter += printCheck("span: agrees with brute force", agree);
+
+  // a tiny cache is flushed over and over and still finds the span
+  nfa::NFA nfa("ab|*a&ab|&ab|&ab|&");
+  nfa_dfa::DFA dfa(nfa.getCompiled(), false, 3);
+  std::string input = "bbbbabbbaab";
+  char const * end = dfa.firstMatchEnd(input.data(),
+                                       input.data() + input.size());
+  counter += printCheck("span: bounded cache",
+                        end == input.data() + 8);
+
+  // a complemented DFA answers the opposite, stopping as early
+  nfa::NFA word("ab&+");
+  nfa_dfa::DFA whole(word.getCompiled(), true, 4096, true);
+  nfa_dfa::DFA part(word.getCompiled(), false, 4096, true);
+  bool complements = true;
+  for (std::string s : { "", "ab", "abab", "aba", "xab", "b", "xxxx" })
+  {
+    char const * b = s.data();
+    char const * e = b + s.size();
+    complements = complements
+      && whole.matches(b, e) != word.accept(s)
+      && part.matches(b, e) != word.search(b, e);
+  }
+  counter += printCheck("span: complement", complements);
+
+  // bytes no label tells apart share one column of the tables
+  nfa::NFA abc("ab&c|");
+  counter += printCheck("span: byte classes of literals",
+                        abc.getCompiled().classCount() == 4);
+  counter += printCheck("span: byte classes agree",
+                        abc.getCompiled().byteClass('x')
+                        == abc.getCompiled().byteClass('\xff'));
+  nfa::NFA digits("\\d+\\s&");
+  nfa_dfa::DFA wide(digits.getCompiled(), false);
+  std::string text = "12 345 6789 x";
+  wide.firstMatchEnd(text.data(), text.data() + text.size());
+  counter += printCheck("span: table rows by class",
+                        digits.getCompiled().classCount() == 3
+                        && wide.tableBytes()
+                           == wide.stateCount() * 3 * sizeof(int32_t));
+
+  // states left on one to three bytes are skipped over, not stepped
+  std::string log;
+  for (int i = 0; i < 300; ++i)
+    log += (i % 50 == 49 ? "an ERROR x\n" : "all is well, at 10:42\n");
+  log += "ERRO";
+  bool skips = true;
+  for (std::string pattern : { "ER&R&O&R&", "..*&E&R&", "ab|c|", ":\\d&",
+                               "x.*&\n&", "\n.&*E&" })
+  {
+    nfa::NFA skipping(pattern);
+    nfa_dfa::DFA first(skipping.getCompiled(), false);
+    nfa_dfa::DFA whole(skipping.getCompiled(), true);
+    nfa_dfa::DFA longest(skipping.getCompiled(), true);
+    char const * b = log.data();
+    char const * e = b + log.size();
+    size_t earliest = 0;
+    while (earliest <= log.size()
+           && !skipping.search(b, b + earliest))
+      ++earliest;
+    size_t last = log.size() + 1;
+    while (last-- > 0 && !skipping.accept(log.substr(0, last))) {}
+    char const * firstEnd = first.firstMatchEnd(b, e);
+    char const * lastEnd = longest.lastMatchEnd(b, e);
+    uint64_t lines = 0;
+    std::istringstream split(log);
+    std::string line;
+    while (std::getline(split, line))
+      lines += skipping.search(line.data(), line.data() + line.size());
+    skips = skips
+      && (firstEnd == nullptr ? earliest > log.size()
+                              : (size_t)(firstEnd - b) == earliest)
+      && (lastEnd == nullptr ? last > log.size()
+                             : (size_t)(lastEnd - b) == last)
+      && whole.matches(b, e) == skipping.accept(log)
+      && first.countLines(b, e) == lines;
+  }
+  counter += printCheck("span: skip loops agree", skips);
+
+  // the product decides both automata in one pass
+  nfa::NFA even("aa&*");
+  nfa::NFA some("a+");
+  nfa::NFA digit("\\d");
+  nfa_dfa::Intersection evenSome(even, some);
+  nfa_dfa::Intersection withDigit(some, digit);
+  bool product = true;
+  for (std::string s : { "", "a", "aa", "aaa", "aaaa", "ba", "a1", "1",
+                         "b2a", "xxx", "12a" })
+  {
+    char const * b = s.data();
+    char const * e = b + s.size();
+    product = product
+      && evenSome.accept(s) == (even.accept(s) && some.accept(s))
+      && evenSome.search(b, e) == (even.search(b, e) && some.search(b, e))
+      && withDigit.accept(s) == (some.accept(s) && digit.accept(s))
+      && withDigit.search(b, e) == (some.search(b, e)
+                                    && digit.search(b, e));
+  }
+  counter += printCheck("span: intersection", product);
+  nfa::NFA error("ER&R&O&R&");
+  nfa::NFA disk("di&s&k&");
+  nfa_dfa::ProductDFA errorDisk(error.getCompiled(), disk.getCompiled(),
+                                false, 3);
+  std::string both = "disk full, ERROR";
+  counter += printCheck("span: intersection, bounded cache",
+                        errorDisk.matches(both.data(),
+                                          both.data() + both.size())
+                        && !errorDisk.matches(log.data(),
+                                              log.data() + log.size()));
+  return counter;
+}
+
+static int budgetTests()
+{
+  uint16_t counter = 0;
+  nfa::NFA nfa("ab|*a&ab|&ab|&ab|&");
+  std::string input(100000, 'a');
+  input += "b";
+  nfa_api::Budget unlimited;
+  counter += printCheck("budget: unlimited accepts",
+                        nfa.accept(input, unlimited)
+                        == nfa_api::MatchResult::accepted);
+  counter += printCheck("budget: unlimited rejects",
+                        nfa.accept(input + "bbbb", unlimited)
+                        == nfa_api::MatchResult::rejected);
+
+  nfa_api::Budget small;
+  small.maxWork = 1000;
+  counter += printCheck("budget: work exceeded",
+                        nfa.accept(input, small)
+                        == nfa_api::MatchResult::gaveUp);
+  counter += printCheck("budget: work enough",
+                        nfa.accept("babbb", small)
+                        == nfa_api::MatchResult::accepted);
+
+  nfa_api::Budget quick;
+  quick.timeoutNanos = 1;
+  quick.checkEvery = 1;
+  counter += printCheck("budget: timeout",
+                        nfa.search(input.data(), input.data() + input.size(),
+                                   quick)
+                        == nfa_api::MatchResult::gaveUp);
+  counter += printCheck("budget: search stops before the budget",
+                        nfa.search(input.data(), input.data() + input.size(),
+                                   small)
+                        == nfa_api::MatchResult::accepted);
+  return counter;
+}
+
+struct StaticErrors { static constexpr char const * pattern = "ER&R&O&R&"; };
+struct StaticNumber
+{
+  static constexpr char const * pattern = "\\d+.\\d+&?&";
+};
+struct StaticNested { static constexpr char const * pattern = "ab|*a&ab|&"; };
+struct StaticEscapes
+{
+  static constexpr char const * pattern = "\\*\\\\&\\w\\W|*&\\s?&";
+};
+struct StaticOptional { static constexpr char const * pattern = "a?b*&"; };
+
+/**
+ * checks a compile-time matcher against the runtime NFA of its pattern
+ */
+template <typename Pattern>
+static bool agreesWithNFA(std::vector<std::string> const & inputs)
+{
+  typedef nfa_static::Matcher<Pattern> Static;
+  nfa::NFA nfa(Pattern::pattern);
+  for (std::string const & input : inputs)
+  {
+    char const * begin = input.data();
+    char const * end = begin + input.size();
+    if (  Static::accept(input) != nfa.accept(input)
+       || Static::search(begin, end) != nfa.search(begin, end)
+       )
+      return false;
+  }
+  return true;
+}
+
+static int staticTests()
+{
+  uint16_t counter = 0;
+  std::vector<std::string> inputs = {
+    "", "a", "b", "ab", "ba", "abba", "aab", "bbbabb", "ERROR", "an ERROR!",
+    "ERRO", "12", "1.5", "3.14159", "x 2.71", "*\\", "*\\a", "*\\ab- ",
+    "*\\\t", "\xff\xfe", "b\xe6\x97\xa5" "a"
+  };
+  counter += printCheck("static: literal",
+                        agreesWithNFA<StaticErrors>(inputs));
+  counter += printCheck("static: classes",
+                        agreesWithNFA<StaticNumber>(inputs));
+  counter += printCheck("static: nested star",
+                        agreesWithNFA<StaticNested>(inputs));
+  counter += printCheck("static: escapes",
+                        agreesWithNFA<StaticEscapes>(inputs));
+  counter += printCheck("static: nullable",
+                        agreesWithNFA<StaticOptional>(inputs));
+  counter += printCheck("static: accepts",
+                        nfa_static::Matcher<StaticEscapes>::accept("*\\a-\t")
+                        && nfa_static::Matcher<StaticNumber>::accept("3.14"));
+  return counter;
+}
+
+static int statsTests()
+{
+  uint16_t counter = 0;
+#ifdef GREP11_STATS
+  nfa_stats::Registry::reset();
+  nfa_stats::Registry::setEnabled(true);
+  {
+    nfa::NFA nfa("ab&*");
+    nfa.accept("abab");
+    nfa.accept("abb");
+  }
+  std::vector<nfa_stats::Snapshot> all = nfa_stats::Registry::snapshots();
+  counter += printCheck("stats: one pattern recorded", all.size() == 1);
+  if (all.size() == 1)
+  {
+    nfa_stats::Snapshot const & s = all[0];
+    counter += printCheck("stats: builds", s.builds == 1);
+    counter += printCheck("stats: states built", s.statesBuilt == 8);
+    counter += printCheck("stats: calls", s.calls == 2);
+    counter += printCheck("stats: matches", s.matches == 1);
+    counter += printCheck("stats: chars scanned", s.charsScanned == 7);
+    counter += printCheck("stats: active max", s.activeMax >= 2);
+    counter += printCheck("stats: epsilon iterations",
+                          s.epsilonIterations > 0);
+    uint64_t histogram = 0;
+    for (int i = 0; i < nfa_stats::latencyBuckets; ++i)
+      histogram += s.latency[i];
+    counter += printCheck("stats: latency histogram", histogram == 2);
+  }
+  nfa_stats::Registry::setEnabled(false);
+  nfa_stats::Registry::reset();
+#else
+  bool expanded = false;
+  NFA_STATS(expanded = true;)
+  counter += printCheck("stats: compiled out", !expanded);
+#endif
+  return counter;
+}
+
+/**
+ * spells out x{min,max} with the other operators
+ */
+static std::string expand(std::string x, uint32_t min, uint32_t max)
+{
+  std::string res;
+  for (uint32_t i = 0; i < min; ++i)
+    res += x + (i == 0 ? "" : "&");
+  std::string tail = max == UINT32_MAX ? x + "*" : x + "?";
+  for (uint32_t i = min; i < (max == UINT32_MAX ? min + 1 : max); ++i)
+    res += tail + (i == 0 ? "" : "&");
+  return res;
+}
+
+static int repeatTests()
+{
+  uint16_t counter = 0;
+  counter += printTest("a{3}", "aaa", true);
+  counter += printTest("a{3}", "aa", false);
+  counter += printTest("\\d{1,3}", "123", true);
+  counter += printTest("\\d{1,3}", "1234", false);
+  counter += printTest("ab&{2,}", "ababab", true);
+  counter += printTest("ab&{2,}", "ab", false);
+  counter += printTest("ab&{0,2}", "", true);
+  counter += printTest("a{0}", "", true);
+  counter += printTest("a.{20}{0}&", "a", true);
+  counter += printTest("a.{20}{0,0}&b&", "ab", true);
+  counter += printTest("a.{20}{0,0}&b&", "ax", false);
+  counter += printTest("x.{20}&{0}.{16}&", "0123456789abcdef", true);
+  counter += printTest("\\{{2}", "{{", true);
+
+  // short and long chains, counted or not, agree with the spelled out
+  // pattern, as do the repetitions of sub-expressions
+  struct Case
+  {
+    std::string x;
+    uint32_t min;
+    uint32_t max;
+  };
+  std::vector<Case> cases = {
+    { "a", 2, 4 }, { "\\d", 1, 20 }, { ".", 0, 40 }, { "a", 17, UINT32_MAX },
+    { "ab|", 0, UINT32_MAX }, { "ab&", 1, 3 }, { "a\\d{18}&", 2, 2 },
+    { "a\\d{20,}&", 1, 2 }, { "\\d", 70, 70 }
+  };
+  std::vector<std::string> inputs = { "", "a", "aa", "aaaa", "aaaaa", "ab" };
+  for (std::string s : { "1", "a1", "x" })
+  {
+    std::string digits;
+    for (size_t n : { 17, 18, 19, 20, 21, 40, 41, 69, 70, 71 })
+    {
+      digits = std::string(n, '7');
+      inputs.push_back(digits);
+      inputs.push_back(s + digits + s);
+      inputs.push_back("a" + digits + "a" + digits);
+      inputs.push_back(std::string(n, 'a'));
+    }
+  }
+  bool agree = true;
+  for (Case const & c : cases)
+  {
+    std::string bounds = "{" + std::to_string(c.min)
+      + (c.max == c.min ? "" : "," + (c.max == UINT32_MAX
+                                      ? "" : std::to_string(c.max)))
+      + "}";
+    nfa::NFA counted(c.x + bounds);
+    nfa::NFA spelled(expand(c.x, c.min, c.max));
+    nfa_dfa::DFA dfa(counted.getCompiled(), true);
+    for (std::string const & input : inputs)
+    {
+      char const * b = input.data();
+      char const * e = b + input.size();
+      bool ok = counted.accept(input) == spelled.accept(input)
+        && counted.search(b, e) == spelled.search(b, e)
+        && dfa.matches(b, e) == spelled.accept(input);
+      if (!ok)
+        std::cout << "MISMATCH: " << c.x + bounds << " on " << input << '\n';
+      agree = agree && ok;
+    }
+  }
+  counter += printCheck("repeat: agrees with the spelled out pattern", agree);
+
+  // a long chain costs a few words per byte, not one step per state
+  nfa::NFA wide(".{0,200}\\d&");
+  nfa::NFA spelled(expand(".", 0, 200) + "\\d&");
+  std::string text(5000, 'a');
+  char const * b = text.data();
+  char const * e = b + text.size();
+  nfa_api::Budget budget;
+  budget.maxWork = 50 * text.size();
+  counter += printCheck("repeat: bit vector work",
+                        wide.search(b, e, budget)
+                        == nfa_api::MatchResult::rejected
+                        && spelled.search(b, e, budget)
+                           == nfa_api::MatchResult::gaveUp);
+  return counter;
+}
+
+static int anchorTests()
+{
+  uint16_t counter = 0;
+  counter += printTest("^a&", "a", true);
+  counter += printTest("a^&", "a", false);
+  counter += printTest("a$&", "a", true);
+  counter += printTest("a$&b&", "ab", false);
+  counter += printTest("a$&\n&^&b&", "a\nb", true);
+  counter += printTest("^$&", "", true);
+  counter += printTest("\\ba&b&\\b&", "ab", true);
+  counter += printTest("a\\b&b&", "ab", false);
+  counter += printTest("a\\b&-&", "a-", true);
+  counter += printTest("\\^a&\\$&", "^a$", true);
+  counter += printSpan("^a&", "ba\nab", true, 3, 4);
+  counter += printSpan("b$&", "ab\nb", true, 1, 2);
+  counter += printSpan("\\ba&b&", "cab ab", true, 4, 6);
+  counter += printSpan("\\b", "  x", true, 2, 2);
+  counter += printSpan("$", "\t", true, 1, 1);
+  counter += printSpan("^a&", "ba", false, 0, 0);
+
+  // every engine agrees with the NFA, lines with the lines searched one
+  // by one
+  std::vector<std::string> patterns = {
+    "^a&", "a$&", "\\ba&", "a\\b&", "^a*&$&", "\\bab|+&\\b&", "^.*&x&",
+    "a^&b|", "\\w+$&", "^\\b&a?&"
+  };
+  std::vector<std::string> inputs = {
+    "", "a", "ba", "a b", "x\na", "ab\nbax", "b\n\nab a\n", "xa\nx", "ax!"
+  };
+  bool agree = true;
+  for (std::string const & pattern : patterns)
+  {
+    nfa::NFA nfa(pattern);
+    nfa_dfa::DFA whole(nfa.getCompiled(), true);
+    nfa_dfa::DFA part(nfa.getCompiled(), false);
+    nfa_dfa::DFA reverse(nfa.getReversed(), true);
+    grep::SearchOptions options;
+    grep::LineSelector selector(nfa, options);
+    for (std::string const & input : inputs)
+    {
+      char const * b = input.data();
+      char const * e = b + input.size();
+      uint64_t lines = 0;
+      std::istringstream split(input);
+      std::string line;
+      while (std::getline(split, line))
+      {
+        char const * lb = line.data();
+        char const * le = lb + line.size();
+        bool hit = nfa.search(lb, le);
+        lines += hit;
+        agree = agree && selector.selects(lb, le) == hit;
+      }
+      agree = agree
+        && whole.matches(b, e) == nfa.accept(input)
+        && part.matches(b, e) == nfa.search(b, e)
+        && (reverse.lastMatchBegin(b, e) == b) == nfa.accept(input)
+        && part.countLines(b, e) == lines;
+    }
+  }
+  counter += printCheck("anchor: engines agree", agree);
+
+  nfa::NFA start("^E&R&R&O&R&");
+  nfa::NFA end("ER&R&O&R&$&");
+  nfa_dfa::LineCounter counter1(start);
+  nfa_dfa::Intersection both(start, end);
+  std::string log = "ERROR\nan ERROR\nERROR x\n";
+  char const * b = log.data();
+  char const * e = b + log.size();
+  counter += printCheck("anchor: required literal", start.getPrefilter());
+  counter += printCheck("anchor: line count",
+                        counter1.count(b, e) == 2);
+  counter += printCheck("anchor: intersection",
+                        both.search(b, b + 5) && !both.search(b + 6, b + 14)
+                        && both.search(b + 6, e)
+                        && both.accept("ERROR") && !both.accept("ERRORERROR"));
+
+  // a match anchored to line starts is only looked for at line starts,
+  // so long lines without one cost no work
+  std::string lines(100000, 'b');
+  nfa_api::Budget small;
+  small.maxWork = 1000;
+  counter += printCheck("anchor: lines skipped",
+                        start.search(lines.data(),
+                                     lines.data() + lines.size(), small)
+                        == nfa_api::MatchResult::rejected);
+  lines += "\nERROR";
+  counter += printCheck("anchor: next line",
+                        start.search(lines.data(),
+                                     lines.data() + lines.size(), small)
+                        == nfa_api::MatchResult::accepted);
+  return counter;
+}
+
+static int labelTests()
+{
+  uint16_t counter = 0;
+  auto labelsOf = [](nfa::NFA & nfa) {
+    std::set<nfa_api::LabelPool::Id> ids;
+    for (nfa_api::Edge * e : nfa.getEdges())
+      ids.insert(e->getLabels());
+    return ids;
+  };
+  nfa_api::Labels digit;
+  digit.addFromTo('0', '9');
+  nfa_api::LabelPool::Id digits = nfa_api::LabelPool::intern(digit);
+
+  // a class is kept once, however many edges and patterns use it
+  nfa::NFA three("\\d\\d&\\d&");
+  nfa::NFA tail("a\\d&\\d*&");
+  std::set<nfa_api::LabelPool::Id> ids = labelsOf(three);
+  counter += printCheck("labels: shared by edges",
+                        ids == std::set<nfa_api::LabelPool::Id>{
+                          nfa_api::LabelPool::epsilon, digits });
+  counter += printCheck("labels: shared by patterns",
+                        labelsOf(tail).count(digits) == 1);
+
+  // sets are told apart by what they match, not by how they are written
+  nfa_api::CoLabels notDigit;
+  notDigit.addFromTo('0', '9');
+  nfa_api::Labels others;
+  others.addFromTo(0, '0' - 1);
+  others.addFromTo('9' + 1, 255);
+  nfa_api::Labels word;
+  word.add(nfa_api::AbstractLabels::wordBoundary);
+  counter += printCheck("labels: co-labels",
+                        nfa_api::LabelPool::intern(notDigit)
+                        == nfa_api::LabelPool::intern(others)
+                        && nfa_api::LabelPool::intern(others) != digits);
+  counter += printCheck("labels: assertions",
+                        nfa_api::LabelPool::get(
+                          nfa_api::LabelPool::intern(word)).isZeroWidth()
+                        && nfa_api::LabelPool::intern(word)
+                           != nfa_api::LabelPool::epsilon);
+
+  // compiling the same rules again adds no set, and the automata free
+  // what they built
+  std::vector<std::string> rules = {
+    "ER&R&O&R&\\d+&", "\\w+@&\\w+&", ".{0,40}x&", "^\\s*&#&"
+  };
+  size_t interned = 0;
+  for (int i = 0; i < 100; ++i)
+  {
+    for (std::string const & rule : rules)
+      nfa::NFA nfa(rule, i % 2 ? nfa::NFA::utf8 : 0);
+    if (i == 1)
+      interned = nfa_api::LabelPool::size();
+  }
+  counter += printCheck("labels: no new set",
+                        nfa_api::LabelPool::size() == interned);
+  counter += printCheck("labels: small edges",
+                        sizeof(nfa_api::Edge) <= 12);
+  return counter;
+}
+
+static int memoryTests()
+{
+  uint16_t counter = 0;
+
+  // values up to 65535 take 16 bits, a larger one widens the array
+  nfa_api::PackedArray narrow({ 3, 0, 65535, 7 });
+  nfa_api::PackedArray wide({ 3, 70000, 7 });
+  std::vector<int32_t> inRange;
+  for (int32_t v : narrow.range(1, 3))
+    inRange.push_back(v);
+  for (int32_t v : wide.range(0, 3))
+    inRange.push_back(v);
+  counter += printCheck("memory: packed arrays",
+                        narrow.isNarrow() && !wide.isNarrow()
+                        && narrow.size() == 4 && narrow[2] == 65535
+                        && wide[1] == 70000
+                        && inRange == std::vector<int32_t>{
+                             0, 65535, 3, 70000, 7 });
+  counter += printCheck("memory: narrow is smaller",
+                        narrow.memoryUsage() < wide.memoryUsage() * 4 / 3);
+
+  // the compiled automaton taken out still matches, and weighs less than
+  // the graph it was compiled from
+  nfa::NFA nfa("ER&R&O&R&\\d+&");
+  size_t graph = nfa.memoryUsage();
+  nfa::NFA spans("ER&R&O&R&\\d+&");
+  size_t forward = spans.memoryUsage();
+  spans.getReversed();
+  counter += printCheck("memory: reverse built on demand",
+                        forward == graph && spans.memoryUsage() > forward);
+  std::unique_ptr<nfa_api::CompiledNFA> compiled = nfa.releaseCompiled();
+  nfa_dfa::DFA dfa(*compiled, false);
+  std::string hit("an ERROR42 here"), miss("an ERROR here");
+  counter += printCheck("memory: compiled kept",
+                        dfa.matches(hit.data(), hit.data() + hit.size())
+                        && !dfa.matches(miss.data(),
+                                        miss.data() + miss.size()));
+  counter += printCheck("memory: compiled smaller",
+                        compiled->memoryUsage() > 0
+                        && compiled->memoryUsage() < graph);
+
+  // rule sets account for each set and a little more for themselves
+  grep::RuleSets rules;
+  std::istringstream text("errors\tER&R&O&R&\n"
+                          "digits\t\\d+\n"
+                          "errors\tfa&i&l&\n");
+  bool loaded = rules.load(text);
+  counter += printCheck("memory: rule sets",
+                        loaded && rules.memoryUsage(0) > rules.memoryUsage(1)
+                        && rules.memoryUsage()
+                           > rules.memoryUsage(0) + rules.memoryUsage(1));
+  return counter;
+}
+
 static int mainTests()
 {
   uint16_t counter = 0;
@@ -185,5 +1895,99 @@ static int mainTests()
   counter += printTest("a?", "a", true);
   counter += printTest("a?", "aa", false);
 
+  counter += printTest(".", "", false);
+  counter += printTest("a.&", "a", false);
+  counter += printTest("a\\D&", "a", false);
+  counter += printTest("a\\W&", "a", false);
+  counter += printTest("a\\S&", "a", false);
+  counter += printTest("\xe9", "\xe9", true);
+  counter += printTest("\xe9", "e", false);
+
+  counter += printTest("a*?*b&", "aaab", true);
+  counter += printTest("a*?*b&", "b", true);
+  counter += printTest("a?*b?*&", "aabba", false);
+  counter += printTest("ab|*c&*", "abcbac", true);
+  counter += printTest("ab|*c&*", "abcbaa", false);
+
+  counter += printTest("er&r&o&r&", "error", true, nfa::NFA::ignoreCase);
+  counter += printTest("er&r&o&r&", "Error", true, nfa::NFA::ignoreCase);
+  counter += printTest("er&r&o&r&", "ERROR", true, nfa::NFA::ignoreCase);
+  counter += printTest("er&r&o&r&", "ERRORS", false, nfa::NFA::ignoreCase);
+  counter += printTest("er&r&o&r&", "ERROR", false);
+  counter += printTest(".*E&r&R&.*&", "an eRr here", true,
+                       nfa::NFA::ignoreCase);
+  counter += printTest("\\w1&", "A1", true, nfa::NFA::ignoreCase);
+  counter += printTest("[", "{", false, nfa::NFA::ignoreCase);
+  counter += printTest("@", "`", false, nfa::NFA::ignoreCase);
+
+  counter += printTest("ab&ac&|", "ac", true);
+  counter += printTest("ab&ac&|", "ab", true);
+  counter += printTest("ab&ac&|", "bc", false);
+  counter += printTest("ab&+c&", "ababc", true);
+  counter += printTest("ab&+c&", "abac", false);
+  counter += printTest("xa*&yz&&", "xaayz", true);
+  counter += printTest("xa*&yz&&", "xaay", false);
+  counter += printTest(".*a&b&c&d&.*&", "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxabcd",
+                       true);
+  counter += printTest(".*a&b&c&d&.*&", "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxabcx",
+                       false);
+
+  uint32_t const utf8 = nfa::NFA::utf8;
+  counter += printTest(".", "\xc3\xa9", true, utf8);
+  counter += printTest(".", "\xc3\xa9", false);
+  counter += printTest("..&", "\xc3\xa9", false, utf8);
+  counter += printTest("..&", "\xc3\xa9", true);
+  counter += printTest(".", "\xe6\x97\xa5", true, utf8);
+  counter += printTest(".", "\xf0\x9f\x98\x80", true, utf8);
+  counter += printTest(".", "\xff", false, utf8);
+  counter += printTest(".", "\xc3", false, utf8);
+  counter += printTest(".", "\xe0\x80\x80", false, utf8);
+  counter += printTest(".", "\xed\xa0\x80", false, utf8);
+  counter += printTest(".*", "\xe6\x97\xa5\xe6\x9c\xac\xe8\xaa\x9e", true,
+                       utf8);
+  counter += printTest("\\W", "\xc3\xa9", true, utf8);
+  counter += printTest("\\W", "a", false, utf8);
+  counter += printTest("\\W", "?", true, utf8);
+  counter += printTest("\\D", "\xc3\xa9", true, utf8);
+  counter += printTest("\\D", "7", false, utf8);
+  counter += printTest("\\S", "\xc3\xa9", true, utf8);
+  counter += printTest("\\S", " ", false, utf8);
+  counter += printTest("\xc3\xa9*", "\xc3\xa9\xc3\xa9", true, utf8);
+  counter += printTest("\xc3\xa9*", "\xc3\xa9\xa9", false, utf8);
+  counter += printTest("\xc3\xa9\xe6\x97\xa5|", "\xe6\x97\xa5", true, utf8);
+  counter += printTest("a.&b&", "a\xe6\x97\xa5" "b", true, utf8);
+
+  {
+    nfa_literal::Finder finder("error", true);
+    std::string text(40, '-');
+    counter += printCheck("literal: absent", !finder.in(text));
+    counter += printCheck("literal: found after a block",
+                          finder.in(text + "ErRoR"));
+    counter += printCheck("literal: found at the start",
+                          finder.find(text.data(), text.data()) == text.data()
+                          && finder.in("ERROR" + text));
+    counter += printCheck("literal: folds letters only",
+                          !nfa_literal::Finder("a[", true).in(text + "A{"));
+    counter += printCheck("literal: case sensitive",
+                          !nfa_literal::Finder("error", false).in(text + "Error"));
+  }
+
+  // operators lacking operands are rejected, not read past the stack
+  for (std::string malformed : { "n&o&", "*", "a|", "ab&&", "", "a{",
+                                 "a{2,1}", "a{,2}", "a{x}", "{2}",
+                                 "a{99999}" })
+  {
+    bool rejected = false;
+    try
+    {
+      nfa::NFA nfa(malformed);
+    }
+    catch (std::invalid_argument const &)
+    {
+      rejected = true;
+    }
+    counter += printCheck("malformed: " + malformed, rejected);
+  }
+
   return counter;
 }
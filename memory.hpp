@@ -0,0 +1,58 @@
+#ifndef MEMORY_HPP
+#define MEMORY_HPP
+
+#include <cstddef>
+#include <set>
+#include <string>
+#include <vector>
+
+// estimates of the heap memory containers take, for memoryUsage reports
+namespace nfa_memory
+{
+  /**
+   * the bytes a heap block of n bytes takes, with the header and the
+   * rounding of the allocator, as glibc lays blocks out
+   */
+  inline size_t blockBytes(size_t n)
+  {
+    if (n == 0) return 0;
+    size_t res = (n + sizeof(size_t) + 15) & ~(size_t)15;
+    return res < 32 ? 32 : res;
+  }
+
+  /**
+   * the heap bytes of a vector, its elements' own blocks not included
+   */
+  template <typename T>
+  size_t vectorBytes(std::vector<T> const & v)
+  {
+    return blockBytes(v.capacity() * sizeof(T));
+  }
+
+  inline size_t vectorBytes(std::vector<bool> const & v)
+  {
+    return blockBytes((v.capacity() + 63) / 64 * 8);
+  }
+
+  /**
+   * the heap bytes of a set, a node of a red-black tree per element
+   */
+  template <typename T>
+  size_t setBytes(std::set<T> const & s)
+  {
+    // the colour and three links come before the element
+    return s.size() * blockBytes(4 * sizeof(void *) + sizeof(T));
+  }
+
+  /**
+   * the heap bytes of a string, none when it fits in the string itself
+   */
+  inline size_t stringBytes(std::string const & s)
+  {
+    char const * self = (char const *)&s;
+    bool inside = s.data() >= self && s.data() < self + sizeof(s);
+    return inside ? 0 : blockBytes(s.capacity() + 1);
+  }
+}
+
+#endif /* MEMORY_HPP */
@@ -1,20 +1,85 @@
 #include "nfa.hpp"
+#include "memory.hpp"
+#include <algorithm>
+#include <map>
 
 namespace nfa
 {
+  /**
+   * throws unless an operator finds the operands it needs on the stack
+   */
+  static void checkArity(size_t available, size_t needed, char op,
+                         uint16_t pos, std::string const & regex)
+  {
+    if (available < needed)
+      throw std::invalid_argument( std::string("missing operand of ")
+                                 + op
+                                 + std::string(" at position ")
+                                 + std::to_string(pos)
+                                 + std::string(" ")
+                                 + regex);
+  }
+
   NFA::NFA() {}
 
-  NFA::NFA(std::string regex)
+  NFA::NFA(std::string regex) : NFA(regex, 0) {}
+
+  NFA::NFA(std::string regex, uint32_t flags) : flags(flags)
+  {
+    NFA_STATS(nfa_stats::Stopwatch stopwatch;)
+    nfa_api::AbstractNFA * nfaPtr = this->mkNFAFromRegEx(regex);
+    this->setStartStates(nfaPtr->getStartStates());
+    this->setFinalStates(nfaPtr->getFinalStates());
+    this->setEdges(nfaPtr->releaseEdges());
+    delete nfaPtr;
+    this->compile();
+    if (!this->requiredLiteral.empty())
+      this->setPrefilter(this->requiredLiteral, flags & ignoreCase);
+    NFA_STATS(
+      std::set<int32_t> states(this->startStates);
+      states.insert(this->finalStates.begin(), this->finalStates.end());
+      for (nfa_api::Edge * e : this->edges)
+      {
+        states.insert(e->getSrc());
+        states.insert(e->getDst());
+      }
+      this->setStats(nfa_stats::Registry::get(regex));
+      if (nfa_stats::Registry::isEnabled())
+        this->stats->recordBuild(states.size(), this->edges.size(),
+                                 stopwatch.nanos());
+    )
+  }
+
+  void NFA::check(std::string regex, uint32_t flags)
+  {
+    NFA parsed;
+    parsed.flags = flags;
+    delete parsed.mkNFAFromRegEx(regex);
+  }
+
+  size_t NFA::memoryUsage() const
   {
-    nfa_api::AbstractNFA * abstractLabelsPtr = this->mkNFAFromRegEx(regex);
-    this->setStartStates(abstractLabelsPtr->getStartStates());
-    this->setFinalStates(abstractLabelsPtr->getFinalStates());
-    this->setEdges(abstractLabelsPtr->getEdges());
+    return AbstractNFA::memoryUsage() + sizeof(NFA) - sizeof(AbstractNFA)
+      + nfa_memory::stringBytes(this->requiredLiteral)
+      + this->trigramQuery.memoryUsage();
   }
 
   nfa_api::AbstractNFA * NFA::mkNFAFromRegEx(std::string regex)
   {
     std::stack<AbstractNFA *> nfaStack;
+    // what is left on the stack, as when the pattern is malformed, is
+    // deleted on the way out
+    struct Pending
+    {
+      std::stack<AbstractNFA *> & nfas;
+      ~Pending()
+      {
+        for (; !this->nfas.empty(); this->nfas.pop())
+          delete this->nfas.top();
+      }
+    } pending{nfaStack};
+    std::stack<Literal> literalStack;
+    std::stack<nfa_trigram::Analysis> trigramStack;
     char16_t c;
     uint16_t pos = 0;
     while (pos < regex.length())
@@ -31,24 +96,44 @@ namespace nfa
         else
         {
           c = regex.at(pos); ++pos;
+          if (c == 'b')
+          {
+            /* word boundary */
+            nfaStack.push(mkNFAOfAssertion(
+                            nfa_api::AbstractLabels::wordBoundary));
+            literalStack.push(literalOfEmpty());
+            trigramStack.push(nfa_trigram::Analysis::ofEmpty());
+            continue;
+          }
+          if (c == 't' || isMetaChar(c))
+            literalStack.push(literalOfChar(c == 't' ? '\t' : c));
+          else
+            literalStack.push(literalOfClass());
+          trigramStack.push(
+              c == 't' || isMetaChar(c)
+            ? nfa_trigram::Analysis::ofChar(c == 't' ? '\t' : c)
+            : c == 'd' ? nfa_trigram::Analysis::ofClass("0123456789")
+            : c == 's' ? nfa_trigram::Analysis::ofClass(" \t\r\n\f")
+            : nfa_trigram::Analysis::ofAny(false));
+
           if (c == 'd')
             /* digit */
             nfaStack.push(mkNFAOfDigit());
           else if (c == 'D')
             /* non-digit */
-            nfaStack.push(mkNFAOfNonDigit());
+            nfaStack.push(multiByteOf(mkNFAOfNonDigit()));
           else if (c == 'w')
             /* alphanumeric */
             nfaStack.push(mkNFAOfAlphaNum());
           else if (c == 'W')
             /* non-alphanumeric */
-            nfaStack.push(mkNFAOfNonAlphaNum());
+            nfaStack.push(multiByteOf(mkNFAOfNonAlphaNum()));
           else if (c == 's')
             /* whitespace */
             nfaStack.push(mkNFAOfWhite());
           else if (c == 'S')
             /* non-whitespace */
-            nfaStack.push(mkNFAOfNonWhite());
+            nfaStack.push(multiByteOf(mkNFAOfNonWhite()));
           else if (c == 't')
             /* tab */
             nfaStack.push(mkNFAOfChar('\t'));
@@ -67,51 +152,154 @@ namespace nfa
       else if (c == '.')
       {
         /* wildcard */
-        nfaStack.push(mkNFAOfAnyChar());
+        nfaStack.push(multiByteOf(mkNFAOfAnyChar()));
+        literalStack.push(literalOfClass());
+        trigramStack.push(nfa_trigram::Analysis::ofAny(false));
+      }
+      else if (c == '^' || c == '$')
+      {
+        /* start or end of a line */
+        nfaStack.push(mkNFAOfAssertion(
+                        c == '^' ? nfa_api::AbstractLabels::startOfLine
+                                 : nfa_api::AbstractLabels::endOfLine));
+        literalStack.push(literalOfEmpty());
+        trigramStack.push(nfa_trigram::Analysis::ofEmpty());
       }
       else if (c == '&')
       {
         /* concatenation */
+        checkArity(nfaStack.size(), 2, c, pos, regex);
         nfa_api::AbstractNFA * nfa2 = nfaStack.top();
         nfaStack.pop();
         nfa_api::AbstractNFA * nfa1 = nfaStack.top();
         nfaStack.pop();
         nfaStack.push(concatOf(nfa1, nfa2));
+        Literal lit2 = literalStack.top();
+        literalStack.pop();
+        Literal lit1 = literalStack.top();
+        literalStack.pop();
+        literalStack.push(concatOf(lit1, lit2));
+        nfa_trigram::Analysis a2 = trigramStack.top();
+        trigramStack.pop();
+        nfa_trigram::Analysis a1 = trigramStack.top();
+        trigramStack.pop();
+        trigramStack.push(nfa_trigram::Analysis::concatOf(a1, a2));
       }
       else if (c == '|')
       {
         /* union */
+        checkArity(nfaStack.size(), 2, c, pos, regex);
         nfa_api::AbstractNFA * nfa2 = nfaStack.top();
         nfaStack.pop();
         nfa_api::AbstractNFA * nfa1 = nfaStack.top();
         nfaStack.pop();
         nfaStack.push(unionOf(nfa1, nfa2));
+        Literal lit2 = literalStack.top();
+        literalStack.pop();
+        Literal lit1 = literalStack.top();
+        literalStack.pop();
+        literalStack.push(unionOf(lit1, lit2));
+        nfa_trigram::Analysis a2 = trigramStack.top();
+        trigramStack.pop();
+        nfa_trigram::Analysis a1 = trigramStack.top();
+        trigramStack.pop();
+        trigramStack.push(nfa_trigram::Analysis::unionOf(a1, a2));
       }
       else if (c == '*')
       {
         /* kleene star */
+        checkArity(nfaStack.size(), 1, c, pos, regex);
         nfa_api::AbstractNFA * nfa = nfaStack.top();
         nfaStack.pop();
         nfaStack.push(starOf(nfa));
+        literalStack.pop();
+        literalStack.push(literalOfClass());
+        trigramStack.pop();
+        trigramStack.push(nfa_trigram::Analysis::ofAny(true));
       }
       else if (c == '+')
       {
         /* at least once */
+        checkArity(nfaStack.size(), 1, c, pos, regex);
         nfa_api::AbstractNFA * nfa = nfaStack.top();
         nfaStack.pop();
         nfaStack.push(plusOf(nfa));
+        // a repeated literal still starts, ends and contains the same
+        literalStack.top().exact = false;
+        trigramStack.top() = nfa_trigram::Analysis::plusOf(trigramStack.top());
+      }
+      else if (c == '{')
+      {
+        /* counted repetition */
+        checkArity(nfaStack.size(), 1, c, pos, regex);
+        uint32_t min, max;
+        parseBounds(regex, pos, min, max);
+        nfa_api::AbstractNFA * nfa = nfaStack.top();
+        nfaStack.pop();
+        nfaStack.push(repeatOf(nfa, min, max));
+        if (min == 0)
+        {
+          literalStack.pop();
+          literalStack.push(literalOfClass());
+        }
+        else if (min != 1 || max != 1)
+          literalStack.top().exact = false;
+        trigramStack.top() =
+          nfa_trigram::Analysis::repeatOf(trigramStack.top(), min, max);
       }
       else if (c == '?')
       {
         /* at most once */
+        checkArity(nfaStack.size(), 1, c, pos, regex);
         nfa_api::AbstractNFA * nfa = nfaStack.top();
         nfaStack.pop();
         nfaStack.push(maxOnceOf(nfa));
+        literalStack.pop();
+        literalStack.push(literalOfClass());
+        trigramStack.top() =
+          nfa_trigram::Analysis::maxOnceOf(trigramStack.top());
+      }
+      else if ((this->flags & utf8) && (c & 0x80))
+      {
+        /* a multi-byte character is one token made of its bytes */
+        size_t length = (c & 0xe0) == 0xc0 ? 2
+                      : (c & 0xf0) == 0xe0 ? 3
+                      : (c & 0xf8) == 0xf0 ? 4
+                      : 0;
+        if (length == 0 || pos - 1 + length > regex.length())
+          throw std::invalid_argument( std::string("invalid UTF-8 at position ")
+                                     + std::to_string(pos)
+                                     + std::string(" ")
+                                     + regex);
+        nfa_api::AbstractNFA * nfa = mkNFAOfChar(c);
+        Literal lit = literalOfChar(c);
+        nfa_trigram::Analysis a = nfa_trigram::Analysis::ofChar(c);
+        for (size_t k = 1; k < length; ++k)
+        {
+          c = regex.at(pos); ++pos;
+          if ((c & 0xc0) != 0x80)
+          {
+            delete nfa;
+            throw std::invalid_argument( std::string("invalid UTF-8 at position ")
+                                       + std::to_string(pos)
+                                       + std::string(" ")
+                                       + regex);
+          }
+          nfa = concatOf(nfa, mkNFAOfChar(c));
+          lit = concatOf(lit, literalOfChar(c));
+          a = nfa_trigram::Analysis::concatOf(a,
+                                              nfa_trigram::Analysis::ofChar(c));
+        }
+        nfaStack.push(nfa);
+        literalStack.push(lit);
+        trigramStack.push(a);
       }
       else
       {
         /* accept such character */
         nfaStack.push(mkNFAOfChar(c));
+        literalStack.push(literalOfChar(c));
+        trigramStack.push(nfa_trigram::Analysis::ofChar(c));
       }
     }
 
@@ -122,7 +310,254 @@ namespace nfa
                              + std::string(" not match the number of tokens")
                              );
 
-    return nfaStack.top();
+    this->requiredLiteral = literalStack.top().required;
+    this->trigramQuery = trigramStack.top().query();
+    AbstractNFA * res = nfaStack.top();
+    nfaStack.pop();
+    return res;
+  }
+
+  void NFA::parseBounds(std::string const & regex, uint16_t & pos,
+                        uint32_t & min, uint32_t & max)
+  {
+    auto fail = [&regex, &pos]() {
+      throw std::invalid_argument( std::string("malformed repetition at position ")
+                                 + std::to_string(pos)
+                                 + std::string(" ")
+                                 + regex);
+    };
+    auto number = [&regex, &pos, &fail](uint32_t & value) {
+      if (pos == regex.length() || !std::isdigit((unsigned char)regex[pos]))
+        fail();
+      value = 0;
+      while (pos < regex.length() && std::isdigit((unsigned char)regex[pos]))
+      {
+        value = value * 10 + (regex[pos] - '0');
+        ++pos;
+        if (value > maxRepeat)
+          throw std::invalid_argument( std::string("repetition bound above ")
+                                     + std::to_string(maxRepeat)
+                                     + std::string(" at position ")
+                                     + std::to_string(pos)
+                                     + std::string(" ")
+                                     + regex);
+      }
+    };
+    number(min);
+    max = min;
+    if (pos < regex.length() && regex[pos] == ',')
+    {
+      ++pos;
+      if (pos < regex.length() && regex[pos] == '}')
+        max = unbounded;
+      else
+        number(max);
+    }
+    if (pos == regex.length() || regex[pos] != '}' || min > max)
+      fail();
+    ++pos;
+  }
+
+  nfa_api::AbstractNFA * NFA::copyOf(nfa_api::AbstractNFA * nfa)
+  {
+    std::map<int32_t, int32_t> states;
+    auto copy = [&states](int32_t q) {
+      auto it = states.find(q);
+      if (it != states.end()) return it->second;
+      int32_t res = nfa_api::StateNumberKeeper::getNewStateNumber();
+      states[q] = res;
+      return res;
+    };
+
+    auto resNFAPtr = new NFA();
+    std::set<int32_t> S;
+    for (int32_t q : nfa->getStartStates())
+      S.insert(copy(q));
+    resNFAPtr->setStartStates(S);
+    std::set<int32_t> F;
+    for (int32_t q : nfa->getFinalStates())
+      F.insert(copy(q));
+    resNFAPtr->setFinalStates(F);
+    std::set<nfa_api::Edge *> edges;
+    for (nfa_api::Edge * e : nfa->getEdges())
+      edges.insert(new nfa_api::Edge(copy(e->getSrc()), copy(e->getDst()),
+                                     e->getLabels()));
+    resNFAPtr->setEdges(edges);
+
+    // the chains within nfa have been copied along
+    size_t n = this->repeats.size();
+    for (size_t i = 0; i < n; ++i)
+    {
+      nfa_api::Repeat repeat = this->repeats[i];
+      if (states.find(repeat.states[0]) == states.end()) continue;
+      for (int32_t & q : repeat.states)
+        q = copy(q);
+      repeat.exit = copy(repeat.exit);
+      this->repeats.push_back(repeat);
+    }
+    return resNFAPtr;
+  }
+
+  nfa_api::AbstractNFA * NFA::chainOf(nfa_api::LabelPool::Id labels,
+                                      uint32_t min, uint32_t max)
+  {
+    auto resNFAPtr = new NFA();
+
+    // states[i] is reached after i bytes of the class
+    uint32_t length = max == unbounded ? min : max;
+    std::vector<int32_t> states(length + 1);
+    for (int32_t & q : states)
+      q = nfa_api::StateNumberKeeper::getNewStateNumber();
+    std::set<int32_t> S;
+    S.insert(states[0]);
+    resNFAPtr->setStartStates(S);
+
+    int32_t finalState = nfa_api::StateNumberKeeper::getNewStateNumber();
+    std::set<int32_t> F;
+    F.insert(finalState);
+    resNFAPtr->setFinalStates(F);
+
+    nfa_api::LabelPool::Id epsilon = nfa_api::LabelPool::epsilon;
+
+    std::set<nfa_api::Edge *> edges;
+    for (uint32_t i = 0; i < length; ++i)
+      edges.insert(new nfa_api::Edge(states[i], states[i + 1], labels));
+    if (max == unbounded)
+      edges.insert(new nfa_api::Edge(states[length], states[length], labels));
+    // every state from min on leaves to the one final state
+    for (uint32_t i = min; i <= length; ++i)
+      edges.insert(new nfa_api::Edge(states[i], finalState, epsilon));
+    resNFAPtr->setEdges(edges);
+
+    if (length >= counterLength)
+      this->repeats.push_back(
+        nfa_api::Repeat{states, min, max == unbounded, finalState});
+    return resNFAPtr;
+  }
+
+  nfa_api::AbstractNFA * NFA::multiByteOf(nfa_api::AbstractNFA * nfa)
+  {
+    if (!(this->flags & utf8)) return nfa;
+
+    // nfa has one edge; in UTF-8 mode it keeps only its ASCII bytes,
+    // all the other code points it matches are multi-byte sequences
+    nfa_api::Edge * edgePtr = *nfa->getEdges().begin();
+    nfa_api::LabelPool::Entry const & labels =
+      nfa_api::LabelPool::get(edgePtr->getLabels());
+    nfa_api::Labels ascii;
+    for (int32_t b = 0; b < 0x80; ++b)
+      if (labels.bytes[b])
+        ascii.add(b);
+    delete nfa;
+
+    auto resNFAPtr = new NFA();
+
+    int32_t startState = nfa_api::StateNumberKeeper::getNewStateNumber();
+    std::set<int32_t> S;
+    S.insert(startState);
+    resNFAPtr->setStartStates(S);
+
+    int32_t finalState = nfa_api::StateNumberKeeper::getNewStateNumber();
+    std::set<int32_t> F;
+    F.insert(finalState);
+    resNFAPtr->setFinalStates(F);
+
+    std::set<nfa_api::Edge *> edges;
+    auto range = [&edges](int32_t src, int32_t dst, int32_t from, int32_t to)
+    {
+      nfa_api::Labels labels;
+      labels.addFromTo(from, to);
+      edges.insert(new nfa_api::Edge(src, dst,
+                                     nfa_api::LabelPool::intern(labels)));
+    };
+    edges.insert(new nfa_api::Edge(startState, finalState,
+                                   nfa_api::LabelPool::intern(ascii)));
+
+    // tails[k] still expects k continuation bytes; they are shared by
+    // every lead byte so the whole class costs a handful of states
+    int32_t tails[4];
+    tails[0] = finalState;
+    for (int k = 1; k < 4; ++k)
+    {
+      tails[k] = nfa_api::StateNumberKeeper::getNewStateNumber();
+      range(tails[k], tails[k - 1], 0x80, 0xbf);
+    }
+
+    // well-formed sequences, see table 3-7 of the Unicode standard
+    range(startState, tails[1], 0xc2, 0xdf);
+    range(startState, tails[2], 0xe1, 0xec);
+    range(startState, tails[2], 0xee, 0xef);
+    range(startState, tails[3], 0xf1, 0xf3);
+    struct { int32_t lead; int32_t from; int32_t to; int tail; } const
+      restricted[] = { {0xe0, 0xa0, 0xbf, 1}, {0xed, 0x80, 0x9f, 1},
+                       {0xf0, 0x90, 0xbf, 2}, {0xf4, 0x80, 0x8f, 2} };
+    for (auto const & r : restricted)
+    {
+      int32_t second = nfa_api::StateNumberKeeper::getNewStateNumber();
+      range(startState, second, r.lead, r.lead);
+      range(second, tails[r.tail], r.from, r.to);
+    }
+    resNFAPtr->setEdges(edges);
+
+    return resNFAPtr;
+  }
+
+  NFA::Literal NFA::literalOfChar(char c)
+  {
+    std::string s(1, c);
+    return Literal{true, s, s, s};
+  }
+
+  NFA::Literal NFA::literalOfEmpty()
+  {
+    return Literal{true, "", "", ""};
+  }
+
+  NFA::Literal NFA::literalOfClass()
+  {
+    return Literal{false, "", "", ""};
+  }
+
+  NFA::Literal NFA::concatOf(Literal lit1, Literal lit2)
+  {
+    if (lit1.exact && lit2.exact)
+    {
+      std::string s = lit1.prefix + lit2.prefix;
+      return Literal{true, s, s, s};
+    }
+    Literal res;
+    res.exact = false;
+    res.prefix = lit1.exact ? lit1.prefix + lit2.prefix : lit1.prefix;
+    res.suffix = lit2.exact ? lit1.suffix + lit2.suffix : lit2.suffix;
+    // the longest of what each side requires and what spans the seam
+    res.required = lit1.suffix + lit2.prefix;
+    if (lit1.required.size() > res.required.size())
+      res.required = lit1.required;
+    if (lit2.required.size() > res.required.size())
+      res.required = lit2.required;
+    return res;
+  }
+
+  NFA::Literal NFA::unionOf(Literal lit1, Literal lit2)
+  {
+    if (lit1.exact && lit2.exact && lit1.prefix == lit2.prefix)
+      return lit1;
+    Literal res;
+    res.exact = false;
+    size_t i = 0;
+    while (  i < lit1.prefix.size() && i < lit2.prefix.size()
+          && lit1.prefix[i] == lit2.prefix[i]
+          ) ++i;
+    res.prefix = lit1.prefix.substr(0, i);
+    size_t j = 0;
+    while (  j < lit1.suffix.size() && j < lit2.suffix.size()
+          && lit1.suffix[lit1.suffix.size() - 1 - j]
+          == lit2.suffix[lit2.suffix.size() - 1 - j]
+          ) ++j;
+    res.suffix = lit1.suffix.substr(lit1.suffix.size() - j);
+    res.required =
+      res.prefix.size() >= res.suffix.size() ? res.prefix : res.suffix;
+    return res;
   }
 
   nfa_api::AbstractNFA * NFA::mkNFAOfDigit()
@@ -139,9 +574,10 @@ namespace nfa
     F.insert(finalState);
     nfaPtr->setFinalStates(F);
 
-    nfa_api::AbstractLabels * labelsPtr = new nfa_api::Labels();
-    labelsPtr->addFromTo('0', '9');
-    auto edgePtr = new nfa_api::Edge(startState, finalState, labelsPtr);
+    nfa_api::Labels labels;
+    labels.addFromTo('0', '9');
+    auto edgePtr = new nfa_api::Edge(startState, finalState,
+                                     nfa_api::LabelPool::intern(labels));
     std::set<nfa_api::Edge *> edges;
     edges.insert(edgePtr);
     nfaPtr->setEdges(edges);
@@ -163,9 +599,10 @@ namespace nfa
     F.insert(finalState);
     nfaPtr->setFinalStates(F);
 
-    nfa_api::AbstractLabels * coLabelsPtr = new nfa_api::CoLabels();
-    coLabelsPtr->addFromTo('0', '9');
-    auto edgePtr = new nfa_api::Edge(startState, finalState, coLabelsPtr);
+    nfa_api::CoLabels coLabels;
+    coLabels.addFromTo('0', '9');
+    auto edgePtr = new nfa_api::Edge(startState, finalState,
+                                     nfa_api::LabelPool::intern(coLabels));
     std::set<nfa_api::Edge *> edges;
     edges.insert(edgePtr);
     nfaPtr->setEdges(edges);
@@ -187,11 +624,12 @@ namespace nfa
     F.insert(finalState);
     nfaPtr->setFinalStates(F);
 
-    nfa_api::AbstractLabels * labelsPtr = new nfa_api::Labels();
-    labelsPtr->addFromTo('a', 'z');
-    labelsPtr->addFromTo('A', 'Z');
-    labelsPtr->addFromTo('0', '9');
-    auto edgePtr = new nfa_api::Edge(startState, finalState, labelsPtr);
+    nfa_api::Labels labels;
+    labels.addFromTo('a', 'z');
+    labels.addFromTo('A', 'Z');
+    labels.addFromTo('0', '9');
+    auto edgePtr = new nfa_api::Edge(startState, finalState,
+                                     nfa_api::LabelPool::intern(labels));
     std::set<nfa_api::Edge *> edges;
     edges.insert(edgePtr);
     nfaPtr->setEdges(edges);
@@ -213,11 +651,12 @@ namespace nfa
     F.insert(finalState);
     nfaPtr->setFinalStates(F);
 
-    nfa_api::AbstractLabels * coLabelsPtr = new nfa_api::CoLabels();
-    coLabelsPtr->addFromTo('a', 'z');
-    coLabelsPtr->addFromTo('A', 'Z');
-    coLabelsPtr->addFromTo('0', '9');
-    auto edgePtr = new nfa_api::Edge(startState, finalState, coLabelsPtr);
+    nfa_api::CoLabels coLabels;
+    coLabels.addFromTo('a', 'z');
+    coLabels.addFromTo('A', 'Z');
+    coLabels.addFromTo('0', '9');
+    auto edgePtr = new nfa_api::Edge(startState, finalState,
+                                     nfa_api::LabelPool::intern(coLabels));
     std::set<nfa_api::Edge *> edges;
     edges.insert(edgePtr);
     nfaPtr->setEdges(edges);
@@ -239,13 +678,14 @@ namespace nfa
     F.insert(finalState);
     nfaPtr->setFinalStates(F);
 
-    nfa_api::AbstractLabels * labelsPtr = new nfa_api::Labels();
-    labelsPtr->add(' ');
-    labelsPtr->add('\t');
-    labelsPtr->add('\r');
-    labelsPtr->add('\n');
-    labelsPtr->add('\f');
-    auto edgePtr = new nfa_api::Edge(startState, finalState, labelsPtr);
+    nfa_api::Labels labels;
+    labels.add(' ');
+    labels.add('\t');
+    labels.add('\r');
+    labels.add('\n');
+    labels.add('\f');
+    auto edgePtr = new nfa_api::Edge(startState, finalState,
+                                     nfa_api::LabelPool::intern(labels));
     std::set<nfa_api::Edge *> edges;
     edges.insert(edgePtr);
     nfaPtr->setEdges(edges);
@@ -267,13 +707,14 @@ namespace nfa
     F.insert(finalState);
     nfaPtr->setFinalStates(F);
 
-    nfa_api::AbstractLabels * coLabelsPtr = new nfa_api::CoLabels();
-    coLabelsPtr->add(' ');
-    coLabelsPtr->add('\t');
-    coLabelsPtr->add('\r');
-    coLabelsPtr->add('\n');
-    coLabelsPtr->add('\f');
-    auto edgePtr = new nfa_api::Edge(startState, finalState, coLabelsPtr);
+    nfa_api::CoLabels coLabels;
+    coLabels.add(' ');
+    coLabels.add('\t');
+    coLabels.add('\r');
+    coLabels.add('\n');
+    coLabels.add('\f');
+    auto edgePtr = new nfa_api::Edge(startState, finalState,
+                                     nfa_api::LabelPool::intern(coLabels));
     std::set<nfa_api::Edge *> edges;
     edges.insert(edgePtr);
     nfaPtr->setEdges(edges);
@@ -295,9 +736,10 @@ namespace nfa
     F.insert(finalState);
     nfaPtr->setFinalStates(F);
 
-    nfa_api::AbstractLabels * coLabelsPtr = new nfa_api::CoLabels();
-    coLabelsPtr->add(nfa_api::AbstractLabels::anyChar);
-    auto edgePtr = new nfa_api::Edge(startState, finalState, coLabelsPtr);
+    nfa_api::CoLabels coLabels;
+    coLabels.add(nfa_api::AbstractLabels::anyChar);
+    auto edgePtr = new nfa_api::Edge(startState, finalState,
+                                     nfa_api::LabelPool::intern(coLabels));
     std::set<nfa_api::Edge *> edges;
     edges.insert(edgePtr);
     nfaPtr->setEdges(edges);
@@ -319,9 +761,45 @@ namespace nfa
     F.insert(finalState);
     nfaPtr->setFinalStates(F);
 
-    nfa_api::AbstractLabels * labelsPtr = new nfa_api::Labels();
-    labelsPtr->add(c);
-    auto edgePtr = new nfa_api::Edge(startState, finalState, labelsPtr);
+    nfa_api::Labels labels;
+    // bytes above 0x7f are labelled 0x80-0xff, not as negative chars
+    labels.add((int32_t)(unsigned char)c);
+    if (this->flags & ignoreCase)
+    {
+      // fold the case into the label set, the automaton keeps its size
+      if (c >= 'a' && c <= 'z')
+        labels.add((int32_t)(c - 'a' + 'A'));
+      else if (c >= 'A' && c <= 'Z')
+        labels.add((int32_t)(c - 'A' + 'a'));
+    }
+    auto edgePtr = new nfa_api::Edge(startState, finalState,
+                                     nfa_api::LabelPool::intern(labels));
+    std::set<nfa_api::Edge *> edges;
+    edges.insert(edgePtr);
+    nfaPtr->setEdges(edges);
+
+    return nfaPtr;
+  }
+
+  nfa_api::AbstractNFA * NFA::mkNFAOfAssertion(int32_t assertion)
+  {
+    auto nfaPtr = new NFA();
+
+    int32_t startState = nfa_api::StateNumberKeeper::getNewStateNumber();
+    std::set<int32_t> S;
+    S.insert(startState);
+    nfaPtr->setStartStates(S);
+
+    int32_t finalState = nfa_api::StateNumberKeeper::getNewStateNumber();
+    std::set<int32_t> F;
+    F.insert(finalState);
+    nfaPtr->setFinalStates(F);
+
+    // an edge reading no byte, taken where the assertion holds
+    nfa_api::Labels labels;
+    labels.add(assertion);
+    auto edgePtr = new nfa_api::Edge(startState, finalState,
+                                     nfa_api::LabelPool::intern(labels));
     std::set<nfa_api::Edge *> edges;
     edges.insert(edgePtr);
     nfaPtr->setEdges(edges);
@@ -343,8 +821,7 @@ namespace nfa
     F.insert(finalState);
     resNFAPtr->setFinalStates(F);
 
-    nfa_api::AbstractLabels * labelsPtr = new nfa_api::Labels();
-    labelsPtr->add(nfa_api::AbstractLabels::epsilon);
+    nfa_api::LabelPool::Id epsilon = nfa_api::LabelPool::epsilon;
 
     std::set<nfa_api::Edge *> edges;
 
@@ -354,24 +831,26 @@ namespace nfa
     std::set<int32_t> finalStates2 = nfa2->getFinalStates();
 
     for (int32_t i : startStates1)
-      edges.insert(new nfa_api::Edge(startState, i, labelsPtr));
+      edges.insert(new nfa_api::Edge(startState, i, epsilon));
 
     for (int32_t i : finalStates1)
-      edges.insert(new nfa_api::Edge(i, finalState, labelsPtr));
+      edges.insert(new nfa_api::Edge(i, finalState, epsilon));
 
     for (int32_t i : startStates2)
-      edges.insert(new nfa_api::Edge(startState, i, labelsPtr));
+      edges.insert(new nfa_api::Edge(startState, i, epsilon));
 
     for (int32_t i : finalStates2)
-      edges.insert(new nfa_api::Edge(i, finalState, labelsPtr));
+      edges.insert(new nfa_api::Edge(i, finalState, epsilon));
 
     {
-      std::set<nfa_api::Edge *> edges1 = nfa1->getEdges();
+      std::set<nfa_api::Edge *> edges1 = nfa1->releaseEdges();
       edges.insert(edges1.begin(), edges1.end());
+      delete nfa1;
     }
     {
-      std::set<nfa_api::Edge *> edges2 = nfa2->getEdges();
+      std::set<nfa_api::Edge *> edges2 = nfa2->releaseEdges();
       edges.insert(edges2.begin(), edges2.end());
+      delete nfa2;
     }
     resNFAPtr->setEdges(edges);
 
@@ -392,8 +871,7 @@ namespace nfa
     F.insert(finalState);
     resNFAPtr->setFinalStates(F);
 
-    nfa_api::AbstractLabels * labelsPtr = new nfa_api::Labels();
-    labelsPtr->add(nfa_api::AbstractLabels::epsilon);
+    nfa_api::LabelPool::Id epsilon = nfa_api::LabelPool::epsilon;
 
     std::set<nfa_api::Edge *> edges;
 
@@ -403,22 +881,24 @@ namespace nfa
     std::set<int32_t> finalStates2 = nfa2->getFinalStates();
 
     for (int32_t i : startStates1)
-      edges.insert(new nfa_api::Edge(startState, i, labelsPtr));
+      edges.insert(new nfa_api::Edge(startState, i, epsilon));
 
     for (int32_t i : startStates2)
       for (int32_t j : finalStates1)
-        edges.insert(new nfa_api::Edge(j, i, labelsPtr));
+        edges.insert(new nfa_api::Edge(j, i, epsilon));
 
     for (int32_t i : finalStates2)
-      edges.insert(new nfa_api::Edge(i, finalState, labelsPtr));
+      edges.insert(new nfa_api::Edge(i, finalState, epsilon));
 
     {
-      std::set<nfa_api::Edge *> edges1 = nfa1->getEdges();
+      std::set<nfa_api::Edge *> edges1 = nfa1->releaseEdges();
       edges.insert(edges1.begin(), edges1.end());
+      delete nfa1;
     }
     {
-      std::set<nfa_api::Edge *> edges2 = nfa2->getEdges();
+      std::set<nfa_api::Edge *> edges2 = nfa2->releaseEdges();
       edges.insert(edges2.begin(), edges2.end());
+      delete nfa2;
     }
     resNFAPtr->setEdges(edges);
 
@@ -439,8 +919,7 @@ namespace nfa
     F.insert(finalState);
     resNFAPtr->setFinalStates(F);
 
-    nfa_api::AbstractLabels * labelsPtr = new nfa_api::Labels();
-    labelsPtr->add(nfa_api::AbstractLabels::epsilon);
+    nfa_api::LabelPool::Id epsilon = nfa_api::LabelPool::epsilon;
 
     std::set<nfa_api::Edge *> edges;
 
@@ -449,17 +928,18 @@ namespace nfa
 
     for (int32_t i : finalStates)
     {
-      edges.insert(new nfa_api::Edge(startState, i, labelsPtr));
-      edges.insert(new nfa_api::Edge(i, finalState, labelsPtr));
+      edges.insert(new nfa_api::Edge(startState, i, epsilon));
+      edges.insert(new nfa_api::Edge(i, finalState, epsilon));
     }
 
     for (int32_t i : startStates)
       for (int32_t j : finalStates)
-        edges.insert(new nfa_api::Edge(j, i, labelsPtr));
+        edges.insert(new nfa_api::Edge(j, i, epsilon));
 
     {
-      std::set<nfa_api::Edge *> edges1 = nfa->getEdges();
+      std::set<nfa_api::Edge *> edges1 = nfa->releaseEdges();
       edges.insert(edges1.begin(), edges1.end());
+      delete nfa;
     }
     resNFAPtr->setEdges(edges);
 
@@ -480,8 +960,7 @@ namespace nfa
     F.insert(finalState);
     resNFAPtr->setFinalStates(F);
 
-    nfa_api::AbstractLabels * labelsPtr = new nfa_api::Labels();
-    labelsPtr->add(nfa_api::AbstractLabels::epsilon);
+    nfa_api::LabelPool::Id epsilon = nfa_api::LabelPool::epsilon;
 
     std::set<nfa_api::Edge *> edges;
 
@@ -490,17 +969,18 @@ namespace nfa
 
     for (int32_t i : startStates)
     {
-      edges.insert(new nfa_api::Edge(startState, i, labelsPtr));
+      edges.insert(new nfa_api::Edge(startState, i, epsilon));
       for (int32_t j : finalStates)
-        edges.insert(new nfa_api::Edge(j, i, labelsPtr));
+        edges.insert(new nfa_api::Edge(j, i, epsilon));
     }
 
     for (int32_t i : finalStates)
-      edges.insert(new nfa_api::Edge(i, finalState, labelsPtr));
+      edges.insert(new nfa_api::Edge(i, finalState, epsilon));
 
     {
-      std::set<nfa_api::Edge *> edges1 = nfa->getEdges();
+      std::set<nfa_api::Edge *> edges1 = nfa->releaseEdges();
       edges.insert(edges1.begin(), edges1.end());
+      delete nfa;
     }
     resNFAPtr->setEdges(edges);
 
@@ -521,8 +1001,7 @@ namespace nfa
     F.insert(finalState);
     resNFAPtr->setFinalStates(F);
 
-    nfa_api::AbstractLabels * labelsPtr = new nfa_api::Labels();
-    labelsPtr->add(nfa_api::AbstractLabels::epsilon);
+    nfa_api::LabelPool::Id epsilon = nfa_api::LabelPool::epsilon;
 
     std::set<nfa_api::Edge *> edges;
 
@@ -530,20 +1009,115 @@ namespace nfa
     std::set<int32_t> finalStates = nfa->getFinalStates();
 
     for (int32_t i : startStates)
-      edges.insert(new nfa_api::Edge(startState, i, labelsPtr));
+      edges.insert(new nfa_api::Edge(startState, i, epsilon));
 
     for (int32_t i : finalStates)
     {
-      edges.insert(new nfa_api::Edge(i, finalState, labelsPtr));
-      edges.insert(new nfa_api::Edge(startState, i, labelsPtr));
+      edges.insert(new nfa_api::Edge(i, finalState, epsilon));
+      edges.insert(new nfa_api::Edge(startState, i, epsilon));
     }
 
     {
-      std::set<nfa_api::Edge *> edges1 = nfa->getEdges();
+      std::set<nfa_api::Edge *> edges1 = nfa->releaseEdges();
       edges.insert(edges1.begin(), edges1.end());
+      delete nfa;
     }
     resNFAPtr->setEdges(edges);
 
     return resNFAPtr;
   }
+
+  nfa_api::AbstractNFA * NFA::repeatOf(nfa_api::AbstractNFA * nfa,
+                                       uint32_t min, uint32_t max)
+  {
+    std::set<nfa_api::Edge *> edges = nfa->getEdges();
+    if (edges.size() == 1)
+    {
+      // one byte class repeated is a chain, whatever the bounds
+      nfa_api::Edge * edgePtr = *edges.begin();
+      nfa_api::LabelPool::Id labels = edgePtr->getLabels();
+      bool zeroWidth = nfa_api::LabelPool::get(labels).isZeroWidth();
+      if (  !zeroWidth
+          && nfa->getStartStates() == std::set<int32_t>{edgePtr->getSrc()}
+          && nfa->getFinalStates() == std::set<int32_t>{edgePtr->getDst()}
+          && edgePtr->getSrc() != edgePtr->getDst())
+      {
+        nfa_api::AbstractNFA * resNFAPtr = this->chainOf(labels, min, max);
+        delete nfa;
+        return resNFAPtr;
+      }
+      // an assertion holds as often as once, copies would only add states
+      if (  zeroWidth && max != 0
+          && nfa->getStartStates() == std::set<int32_t>{edgePtr->getSrc()}
+          && nfa->getFinalStates() == std::set<int32_t>{edgePtr->getDst()})
+        return min == 0 ? this->maxOnceOf(nfa) : nfa;
+    }
+
+    auto resNFAPtr = new NFA();
+
+    int32_t startState = nfa_api::StateNumberKeeper::getNewStateNumber();
+    std::set<int32_t> S;
+    S.insert(startState);
+    resNFAPtr->setStartStates(S);
+
+    int32_t finalState = nfa_api::StateNumberKeeper::getNewStateNumber();
+    std::set<int32_t> F;
+    F.insert(finalState);
+    resNFAPtr->setFinalStates(F);
+
+    nfa_api::LabelPool::Id epsilon = nfa_api::LabelPool::epsilon;
+
+    // no copy at all matches the empty word; the chains within nfa go
+    // with it
+    if (max == 0)
+    {
+      std::set<int32_t> states = nfa->getStartStates();
+      for (nfa_api::Edge * e : edges)
+      {
+        states.insert(e->getSrc());
+        states.insert(e->getDst());
+      }
+      size_t kept = 0;
+      for (size_t i = 0; i < this->repeats.size(); ++i)
+        if (states.find(this->repeats[i].states[0]) == states.end())
+          this->repeats[kept++] = this->repeats[i];
+      this->repeats.resize(kept);
+      delete nfa;
+      std::set<nfa_api::Edge *> res;
+      res.insert(new nfa_api::Edge(startState, finalState, epsilon));
+      resNFAPtr->setEdges(res);
+      return resNFAPtr;
+    }
+
+    // copies in a row, each optional one may leave straight to the
+    // final state, which they all share; an unbounded tail loops on the
+    // last copy
+    uint32_t copies = max == unbounded ? std::max<uint32_t>(min, 1) : max;
+    std::set<nfa_api::Edge *> res;
+    int32_t previous = startState;
+    for (uint32_t i = 0; i < copies; ++i)
+    {
+      // the last copy is nfa itself, earlier ones are copied from it
+      nfa_api::AbstractNFA * part = i + 1 == copies ? nfa : this->copyOf(nfa);
+      if (i >= min)
+        res.insert(new nfa_api::Edge(previous, finalState, epsilon));
+      int32_t join = nfa_api::StateNumberKeeper::getNewStateNumber();
+      for (int32_t q : part->getStartStates())
+      {
+        res.insert(new nfa_api::Edge(previous, q, epsilon));
+        if (max == unbounded && i + 1 == copies)
+          res.insert(new nfa_api::Edge(join, q, epsilon));
+      }
+      for (int32_t q : part->getFinalStates())
+        res.insert(new nfa_api::Edge(q, join, epsilon));
+      std::set<nfa_api::Edge *> partEdges = part->releaseEdges();
+      res.insert(partEdges.begin(), partEdges.end());
+      delete part;
+      previous = join;
+    }
+    res.insert(new nfa_api::Edge(previous, finalState, epsilon));
+    resNFAPtr->setEdges(res);
+
+    return resNFAPtr;
+  }
 }
@@ -6,6 +6,7 @@
 #include <stack>
 #include <stdexcept>
 #include "nfa_api.hpp"
+#include "trigram.hpp"
 
 namespace nfa
 {
@@ -16,8 +17,38 @@ namespace nfa
   class NFA : public nfa_api::AbstractNFA
   {
   public:
+    /**
+     * construction flag: letters match regardless of their ASCII case
+     */
+    static uint32_t const ignoreCase = 1 << 0;
+    /**
+     * construction flag: the pattern and the inputs are UTF-8; ., \D, \W
+     * and \S match whole code points and a multi-byte character of the
+     * pattern is a single token. Matching still goes byte by byte.
+     */
+    static uint32_t const utf8 = 1 << 1;
+
     NFA();
     NFA(std::string regex);
+    NFA(std::string regex, uint32_t flags);
+
+    /**
+     * parses a pattern without compiling it, throwing
+     * std::invalid_argument as the constructor does if it is malformed
+     * @param regex
+     * @param flags
+     */
+    static void check(std::string regex, uint32_t flags = 0);
+
+    /**
+     * the trigrams a line must hold to contain a match, for an Index
+     */
+    nfa_trigram::Query const & getTrigramQuery() const
+    {
+      return this->trigramQuery;
+    }
+
+    size_t memoryUsage() const override;
   protected:
     nfa_api::AbstractNFA * mkNFAFromRegEx(std::string regex) override;
     nfa_api::AbstractNFA * mkNFAOfDigit() override;
@@ -28,6 +59,7 @@ namespace nfa
     nfa_api::AbstractNFA * mkNFAOfNonWhite() override;
     nfa_api::AbstractNFA * mkNFAOfAnyChar() override;
     nfa_api::AbstractNFA * mkNFAOfChar(char c) override;
+    nfa_api::AbstractNFA * mkNFAOfAssertion(int32_t assertion) override;
     nfa_api::AbstractNFA *
       unionOf(nfa_api::AbstractNFA * nfa1, nfa_api::AbstractNFA * nfa2) override;
     nfa_api::AbstractNFA *
@@ -35,12 +67,88 @@ namespace nfa
     nfa_api::AbstractNFA * starOf(nfa_api::AbstractNFA * nfa) override;
     nfa_api::AbstractNFA * plusOf(nfa_api::AbstractNFA * nfa) override;
     nfa_api::AbstractNFA * maxOnceOf(nfa_api::AbstractNFA * nfa) override;
+    nfa_api::AbstractNFA * repeatOf(nfa_api::AbstractNFA * nfa, uint32_t min,
+                                    uint32_t max) override;
  private:
+    /**
+     * the largest bound of a counted repetition
+     */
+    static uint32_t const maxRepeat = 10000;
+    /**
+     * the chain of a repetition at least this long is simulated as a
+     * bit vector, see CompiledNFA
+     */
+    static uint32_t const counterLength = 16;
+
     bool isMetaChar(char c)
     {
       return c == '\\' || c == '.' || c == '&' ||
-        c == '|' || c == '*' || c == '+' || c == '?';
+        c == '|' || c == '*' || c == '+' || c == '?' || c == '{' ||
+        c == '^' || c == '$';
     }
+
+    /**
+     * reads the bounds of a counted repetition, {m,n}, {m} or {m,},
+     * from regex[pos], just after the opening brace
+     * @param regex
+     * @param pos moved past the closing brace
+     * @param min
+     * @param max
+     */
+    static void parseBounds(std::string const & regex, uint16_t & pos,
+                            uint32_t & min, uint32_t & max);
+
+    /**
+     * makes a copy of nfa with fresh states and edges of its own, for
+     * the repetitions of a sub-expression; the chains of repetitions
+     * within it are copied too
+     * @param nfa
+     * @return
+     */
+    nfa_api::AbstractNFA * copyOf(nfa_api::AbstractNFA * nfa);
+
+    /**
+     * makes the chain of states of a repetition of one byte class
+     * @param labels the class, shared by every edge
+     * @param min
+     * @param max
+     * @return
+     */
+    nfa_api::AbstractNFA * chainOf(nfa_api::LabelPool::Id labels,
+                                   uint32_t min, uint32_t max);
+
+    /**
+     * turns a one-edge NFA of a character class into one which, in UTF-8
+     * mode, matches the ASCII characters of the class and every
+     * multi-byte code point as byte sequences; in byte mode nfa is
+     * returned as is
+     * @param nfa
+     * @return
+     */
+    nfa_api::AbstractNFA * multiByteOf(nfa_api::AbstractNFA * nfa);
+
+    /**
+     * What is known of the strings a sub-expression matches: whether it
+     * matches exactly one string, a prefix and a suffix all of them share,
+     * and a substring all of them contain. Used to find a literal any
+     * accepted input must contain.
+     */
+    struct Literal
+    {
+      bool exact;
+      std::string prefix;
+      std::string suffix;
+      std::string required;
+    };
+    static Literal literalOfChar(char c);
+    static Literal literalOfEmpty();
+    static Literal literalOfClass();
+    static Literal concatOf(Literal lit1, Literal lit2);
+    static Literal unionOf(Literal lit1, Literal lit2);
+
+    uint32_t flags = 0;
+    std::string requiredLiteral;
+    nfa_trigram::Query trigramQuery = nfa_trigram::Query::all();
   };
 }
 
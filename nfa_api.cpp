@@ -1,4 +1,11 @@
 #include "nfa_api.hpp"
+#include "memory.hpp"
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <unordered_map>
 
 namespace nfa_api
 {
@@ -79,29 +86,93 @@ namespace nfa_api
       == this->isLabel();
   }
 
-  Edge::Edge() {}
+  LabelPool::Entry LabelPool::first[LabelPool::chunkSize] = {
+    { std::bitset<256>(), 1u << (-AbstractLabels::epsilon - 1) }
+  };
 
-  Edge::Edge(int32_t src, int32_t dst, AbstractLabels * abstractLabelsPtr)
+  LabelPool::Entry * LabelPool::chunks[LabelPool::capacity
+                                       / LabelPool::chunkSize] = {
+    LabelPool::first
+  };
+
+  /**
+   * a set as a string of its bitmap and its zero-width mask
+   */
+  static std::string keyOf(LabelPool::Entry const & entry)
   {
-    this->src = src;
-    this->dst = dst;
-    this->abstractLabelsPtr = abstractLabelsPtr;
+    std::string key(33, '\0');
+    for (int32_t b = 0; b < 256; ++b)
+      if (entry.bytes[b])
+        key[b >> 3] |= (char)(1 << (b & 7));
+    key[32] = (char)entry.zeroWidth;
+    return key;
   }
 
-  Edge::~Edge()
+  /**
+   * the ids of the sets interned, by key
+   */
+  struct Interned
+  {
+    Interned()
+    {
+      this->ids[keyOf(LabelPool::get(LabelPool::epsilon))] =
+        LabelPool::epsilon;
+    }
+
+    std::mutex mutex;
+    std::unordered_map<std::string, LabelPool::Id> ids;
+  };
+
+  static Interned & interned()
   {
-    delete abstractLabelsPtr;
-    this->abstractLabelsPtr = nullptr;
+    static Interned table;
+    return table;
   }
 
-  void Edge::setAbstractLabels(AbstractLabels * abstractLabelsPtr)
+  LabelPool::Id LabelPool::intern(AbstractLabels & labels)
   {
-    this->abstractLabelsPtr = abstractLabelsPtr;
+    Entry entry;
+    for (int32_t b = 0; b < 256; ++b)
+      entry.bytes[b] = labels.match((char16_t)b);
+    entry.zeroWidth = 0;
+    if (labels.isLabel())
+      for (int32_t label : { AbstractLabels::epsilon,
+                             AbstractLabels::startOfLine,
+                             AbstractLabels::endOfLine,
+                             AbstractLabels::wordBoundary })
+        if (labels.match(label))
+          entry.zeroWidth |= 1u << (-label - 1);
+    std::string key = keyOf(entry);
+
+    Interned & table = interned();
+    std::lock_guard<std::mutex> lock(table.mutex);
+    auto found = table.ids.find(key);
+    if (found != table.ids.end()) return found->second;
+    size_t id = table.ids.size();
+    if (id == capacity)
+      throw std::invalid_argument( std::string("more than ")
+                                 + std::to_string(capacity)
+                                 + std::string(" distinct label sets"));
+    Entry *& chunk = LabelPool::chunks[id >> chunkBits];
+    if (!chunk) chunk = new Entry[chunkSize];
+    chunk[id & (chunkSize - 1)] = entry;
+    table.ids[key] = id;
+    return id;
   }
 
-  AbstractLabels * Edge::getAbstractLabels()
+  size_t LabelPool::size()
   {
-    return this->abstractLabelsPtr;
+    Interned & table = interned();
+    std::lock_guard<std::mutex> lock(table.mutex);
+    return table.ids.size();
+  }
+
+  Edge::Edge(int32_t src, int32_t dst, LabelPool::Id labels)
+    : src(src), dst(dst), labels(labels) {}
+
+  LabelPool::Id Edge::getLabels()
+  {
+    return this->labels;
   }
 
   int32_t Edge::getSrc()
@@ -120,24 +191,35 @@ namespace nfa_api
 
   AbstractNFA::~AbstractNFA()
   {
-    this->startStates.clear();
-    this->finalStates.clear();
-    this->edges.clear();
+    for (Edge * e : this->edges)
+      delete e;
   }
 
   void AbstractNFA::setStartStates(std::set<int32_t> startStates)
   {
     this->startStates = startStates;
+    this->compiled.reset();
+    this->reversed.reset();
+    this->prefilter.reset();
   }
 
   void AbstractNFA::setFinalStates(std::set<int32_t> finalStates)
   {
     this->finalStates = finalStates;
+    this->compiled.reset();
+    this->reversed.reset();
+    this->prefilter.reset();
   }
 
   void AbstractNFA::setEdges(std::set<Edge *> edges)
   {
+    for (Edge * e : this->edges)
+      if (edges.find(e) == edges.end())
+        delete e;
     this->edges = edges;
+    this->compiled.reset();
+    this->reversed.reset();
+    this->prefilter.reset();
   }
 
   std::set<int32_t> AbstractNFA::getStartStates()
@@ -158,44 +240,565 @@ namespace nfa_api
     return new_;
   }
 
+  std::set<Edge *> AbstractNFA::releaseEdges()
+  {
+    std::set<Edge *> res;
+    res.swap(this->edges);
+    this->compiled.reset();
+    this->reversed.reset();
+    this->prefilter.reset();
+    return res;
+  }
+
+  void AbstractNFA::setStats(nfa_stats::PatternStats * stats)
+  {
+    this->stats = stats;
+  }
+
+  void AbstractNFA::compile()
+  {
+    this->compiled.reset(new CompiledNFA(this->startStates,
+                                         this->finalStates,
+                                         this->edges, false,
+                                         this->repeats));
+  }
+
+  CompiledNFA const & AbstractNFA::getCompiled()
+  {
+    if (!this->compiled) this->compile();
+    return *this->compiled;
+  }
+
+  CompiledNFA const & AbstractNFA::getReversed()
+  {
+    if (!this->reversed)
+      this->reversed.reset(new CompiledNFA(this->startStates,
+                                           this->finalStates,
+                                           this->edges, true));
+    return *this->reversed;
+  }
+
+  std::unique_ptr<CompiledNFA> AbstractNFA::releaseCompiled()
+  {
+    if (!this->compiled) this->compile();
+    return std::move(this->compiled);
+  }
+
+  std::unique_ptr<nfa_literal::Finder> AbstractNFA::releasePrefilter()
+  {
+    return std::move(this->prefilter);
+  }
+
+  size_t AbstractNFA::memoryUsage() const
+  {
+    size_t res = sizeof(AbstractNFA)
+               + nfa_memory::setBytes(this->startStates)
+               + nfa_memory::setBytes(this->finalStates)
+               + nfa_memory::setBytes(this->edges)
+               + this->edges.size() * nfa_memory::blockBytes(sizeof(Edge))
+               + nfa_memory::vectorBytes(this->repeats);
+    for (Repeat const & repeat : this->repeats)
+      res += nfa_memory::vectorBytes(repeat.states);
+    if (this->compiled)
+      res += nfa_memory::blockBytes(sizeof(CompiledNFA))
+           + this->compiled->memoryUsage() - sizeof(CompiledNFA);
+    if (this->reversed)
+      res += nfa_memory::blockBytes(sizeof(CompiledNFA))
+           + this->reversed->memoryUsage() - sizeof(CompiledNFA);
+    if (this->prefilter)
+      res += this->prefilter->memoryUsage();
+    return res;
+  }
+
+  void AbstractNFA::setPrefilter(std::string literal, bool ignoreCase)
+  {
+    this->prefilter.reset(new nfa_literal::Finder(literal, ignoreCase));
+  }
+
   bool AbstractNFA::accept(std::string input)
   {
-    // use intermediates to represent the states we have seen
+    thread_local MatchScratch scratch;
+    if (this->prefilter && !this->prefilter->in(input)) return false;
+    if (!this->compiled) this->compile();
+    return this->compiled->accept(input.data(), input.data() + input.size(),
+                                  scratch, this->stats);
+  }
+
+  bool AbstractNFA::search(char const * begin, char const * end)
+  {
+    thread_local MatchScratch scratch;
+    if (this->prefilter && this->prefilter->find(begin, end) == end)
+      return false;
+    if (!this->compiled) this->compile();
+    return this->compiled->search(begin, end, scratch, this->stats);
+  }
+
+  MatchResult AbstractNFA::accept(std::string input, Budget const & budget)
+  {
+    thread_local MatchScratch scratch;
+    if (this->prefilter && !this->prefilter->in(input))
+      return MatchResult::rejected;
+    if (!this->compiled) this->compile();
+    return this->compiled->accept(input.data(), input.data() + input.size(),
+                                  scratch, this->stats, budget);
+  }
+
+  MatchResult AbstractNFA::search(char const * begin, char const * end,
+                                  Budget const & budget)
+  {
+    thread_local MatchScratch scratch;
+    if (this->prefilter && this->prefilter->find(begin, end) == end)
+      return MatchResult::rejected;
+    if (!this->compiled) this->compile();
+    return this->compiled->search(begin, end, scratch, this->stats, budget);
+  }
+
+  MatchScratch::MatchScratch() : generation(0) {}
+
+  void MatchScratch::nextGeneration(size_t n)
+  {
+    if (this->stamps.size() < n)
+      this->stamps.resize(n, this->generation);
+    this->generation += 1;
+    if (this->generation == 0)
+    {
+      // the stamps wrapped around, forget every old mark
+      std::fill(this->stamps.begin(), this->stamps.end(), 0);
+      this->generation = 1;
+    }
+  }
+
+  PackedArray::PackedArray(std::vector<int32_t> const & values)
+  {
+    bool fits = std::all_of(values.begin(), values.end(), [](int32_t v) {
+      return v <= UINT16_MAX;
+    });
+    if (fits)
+      this->narrow.assign(values.begin(), values.end());
+    else
+      this->wide = values;
+  }
+
+  size_t PackedArray::memoryUsage() const
+  {
+    return nfa_memory::vectorBytes(this->narrow)
+      + nfa_memory::vectorBytes(this->wide);
+  }
+
+  CompiledNFA::CompiledNFA(std::set<int32_t> const & initialStates,
+                           std::set<int32_t> const & acceptingStates,
+                           std::set<Edge *> const & edges, bool reversed,
+                           std::vector<Repeat> const & repeats)
+  {
+    std::set<int32_t> const & startStates =
+      reversed ? acceptingStates : initialStates;
+    std::set<int32_t> const & finalStates =
+      reversed ? initialStates : acceptingStates;
+
+    // renumber the states densely
+    std::map<int32_t, int32_t> ids;
+    auto id = [&ids](int32_t q) {
+      auto it = ids.find(q);
+      if (it != ids.end()) return it->second;
+      int32_t res = ids.size();
+      ids[q] = res;
+      return res;
+    };
+    for (int32_t q : startStates) id(q);
+    for (int32_t q : finalStates) id(q);
+    for (Edge * e : edges)
+    {
+      id(e->getSrc());
+      id(e->getDst());
+    }
+    size_t n = ids.size();
+
+    this->finals.assign(n, false);
+    for (int32_t q : finalStates)
+      this->finals[id(q)] = true;
+
+    // an edge is an epsilon edge only if it is labelled with epsilon;
+    // co-labels never stand for epsilon even though they do not list it.
+    // An assertion edge is kept with the context bit it needs, line
+    // starts and ends trading places in the reverse automaton
+    std::vector<std::vector<int32_t>> epsilons(n);
+    std::vector<std::vector<std::pair<int32_t, uint8_t>>> assertions(n);
+    // the transitions leaving each state, as label set and target, the
+    // sets numbered in the order they are met
+    std::vector<std::vector<std::pair<int32_t, int32_t>>> outgoing(n);
+    std::map<LabelPool::Id, int32_t> labelIds;
+    for (Edge * e : edges)
+    {
+      LabelPool::Entry const & labels = LabelPool::get(e->getLabels());
+      int32_t src = id(reversed ? e->getDst() : e->getSrc());
+      int32_t dst = id(reversed ? e->getSrc() : e->getDst());
+      if (labels.holds(AbstractLabels::epsilon))
+        epsilons[src].push_back(dst);
+      uint8_t bits = 0;
+      if (labels.holds(AbstractLabels::startOfLine))
+        bits |= reversed ? atLineEnd : atLineStart;
+      if (labels.holds(AbstractLabels::endOfLine))
+        bits |= reversed ? atLineStart : atLineEnd;
+      if (labels.holds(AbstractLabels::wordBoundary))
+        bits |= atWordBoundary;
+      for (uint8_t bit = 1; bit <= atWordBoundary; bit <<= 1)
+        if (bits & bit)
+          assertions[src].push_back(std::make_pair(dst, bit));
+      this->contextMask |= bits;
+      if (labels.bytes.none()) continue;
+      auto found = labelIds.find(e->getLabels());
+      if (found == labelIds.end())
+      {
+        found = labelIds.insert(std::make_pair(e->getLabels(),
+                                               this->labelSets.size())).first;
+        this->labelSets.push_back(labels.bytes);
+      }
+      outgoing[src].push_back(std::make_pair(found->second, dst));
+    }
+
+    // closures by depth-first search from every state, in every context
+    // when there are assertions
+    uint8_t contexts = this->contextMask != 0 ? 8 : 1;
+    std::vector<int32_t> seen(n, -1);
+    std::vector<int32_t> todo;
+    std::vector<int32_t> closureOffsets;
+    std::vector<int32_t> closures;
+    for (uint8_t context = 0; context < contexts; ++context)
+    {
+      for (size_t q = 0; q < n; ++q)
+      {
+        closureOffsets.push_back(closures.size());
+        todo.push_back(q);
+        seen[q] = q;
+        while (!todo.empty())
+        {
+          int32_t p = todo.back();
+          todo.pop_back();
+          closures.push_back(p);
+          for (int32_t r : epsilons[p])
+            if (seen[r] != (int32_t)q)
+            {
+              seen[r] = q;
+              todo.push_back(r);
+            }
+          for (std::pair<int32_t, uint8_t> const & a : assertions[p])
+            if ((context & a.second) && seen[a.first] != (int32_t)q)
+            {
+              seen[a.first] = q;
+              todo.push_back(a.first);
+            }
+        }
+      }
+      closureOffsets.push_back(closures.size());
+      std::fill(seen.begin(), seen.end(), -1);
+    }
+    this->closureOffsets = PackedArray(closureOffsets);
+    this->closures = PackedArray(closures);
+
+    std::vector<int32_t> transitionOffsets;
+    std::vector<int32_t> transitionTargets;
+    std::vector<int32_t> transitionLabels;
+    for (size_t q = 0; q < n; ++q)
+    {
+      transitionOffsets.push_back(transitionTargets.size());
+      for (std::pair<int32_t, int32_t> const & t : outgoing[q])
+      {
+        transitionLabels.push_back(t.first);
+        transitionTargets.push_back(t.second);
+      }
+    }
+    transitionOffsets.push_back(transitionTargets.size());
+    this->transitionOffsets = PackedArray(transitionOffsets);
+    this->transitionTargets = PackedArray(transitionTargets);
+    this->transitionLabels = PackedArray(transitionLabels);
+
+    // byte classes by refinement: every distinct set of bytes splits
+    // each class into the bytes inside it and those outside
+    std::set<std::string> splitters;
+    for (std::bitset<256> const & bytes : this->labelSets)
+      splitters.insert(bytes.to_string());
+    // contexts tell newlines and word bytes apart from the others
+    if (this->contextMask != 0)
+      for (uint8_t side : { edgeSide, wordSide })
+      {
+        std::bitset<256> bytes;
+        for (int32_t b = 0; b < 256; ++b)
+          bytes[b] = sideOf(b) == side;
+        splitters.insert(bytes.to_string());
+      }
+    std::fill(this->classes, this->classes + 256, 0);
+    this->classTotal = 1;
+    for (std::string const & bytes : splitters)
+    {
+      // bitset strings list bit 255 first
+      std::map<std::pair<uint8_t, bool>, uint8_t> refined;
+      for (int32_t b = 0; b < 256; ++b)
+      {
+        std::pair<uint8_t, bool> key(this->classes[b], bytes[255 - b] == '1');
+        auto it = refined.find(key);
+        if (it == refined.end())
+          it = refined.insert(std::make_pair(key, refined.size())).first;
+        this->classes[b] = it->second;
+      }
+      this->classTotal = refined.size();
+    }
+
+    // chains of counted repetitions; the state a chain starts from
+    // stays an ordinary state, its first transition enters the counter
+    if (!reversed && !repeats.empty())
+    {
+      this->counterOf.assign(n, -1);
+      this->positionOf.assign(n, 0);
+    }
+    for (Repeat const & repeat : reversed ? std::vector<Repeat>() : repeats)
+    {
+      // a chain whose states were dropped, as under {0}, is not counted
+      if (ids.find(repeat.states[0]) == ids.end()) continue;
+      Counter counter;
+      int32_t first = id(repeat.states[0]);
+      counter.bytes = (*this->transitions(first).begin()).bytes;
+      counter.length = repeat.states.size() - 1;
+      counter.min = repeat.min;
+      counter.unbounded = repeat.unbounded;
+      counter.exit = id(repeat.exit);
+      counter.word = this->counterWords;
+      counter.words = (counter.length + 63) / 64;
+      this->counterWords += counter.words;
+      for (uint32_t i = 1; i <= counter.length; ++i)
+      {
+        this->counterOf[id(repeat.states[i])] = this->counters.size();
+        this->positionOf[id(repeat.states[i])] = i;
+      }
+      this->counters.push_back(counter);
+    }
+
+    // the start closures, and the contexts in which they lead anywhere
+    this->lineAnchored = true;
+    for (uint8_t context = 0; context < contexts; ++context)
+    {
+      std::vector<bool> inStart(n, false);
+      std::vector<int32_t> start;
+      bool live = false;
+      for (int32_t q : startStates)
+        for (int32_t p : this->closure(id(q), context))
+          if (!inStart[p])
+          {
+            inStart[p] = true;
+            start.push_back(p);
+            live = live || this->finals[p]
+              || this->transitions(p).size() != 0;
+          }
+      this->starts.push_back(start);
+      this->live.push_back(live);
+      if (live && !(context & atLineStart))
+        this->lineAnchored = false;
+    }
+  }
+
+  size_t CompiledNFA::memoryUsage() const
+  {
+    size_t res = sizeof(CompiledNFA)
+               + nfa_memory::vectorBytes(this->finals)
+               + nfa_memory::vectorBytes(this->starts)
+               + nfa_memory::vectorBytes(this->live)
+               + this->closureOffsets.memoryUsage()
+               + this->closures.memoryUsage()
+               + this->transitionOffsets.memoryUsage()
+               + this->transitionTargets.memoryUsage()
+               + this->transitionLabels.memoryUsage()
+               + nfa_memory::vectorBytes(this->labelSets)
+               + nfa_memory::vectorBytes(this->counters)
+               + nfa_memory::vectorBytes(this->counterOf)
+               + nfa_memory::vectorBytes(this->positionOf);
+    for (std::vector<int32_t> const & start : this->starts)
+      res += nfa_memory::vectorBytes(start);
+    return res;
+  }
+
+  MatchResult CompiledNFA::run(char const * begin, char const * end,
+                               MatchScratch & scratch,
+                               nfa_stats::PatternStats * stats,
+                               bool anchored, Budget const * budget) const
+  {
+    NFA_STATS(bool record = stats && nfa_stats::Registry::isEnabled();
+              nfa_stats::Stopwatch stopwatch(record);
+              uint64_t steps = 0, activeSum = 0, activeMax = 0;
+              uint64_t epsilonIterations = 0;)
+    (void)stats;
+
+    // current holds the states we have seen, closed under epsilon;
     // we begin from start states
-    std::set<int32_t> intermediates(this->startStates);
-    uint16_t i = 0;
-
-    while (true) {
-      bool changed;
-      // handle epsilon transitions
-      do {
-        changed = false;
-        for (Edge * e : edges)
-          if (  e->getAbstractLabels()->match(AbstractLabels::epsilon)
-             && ( intermediates.find(e->getSrc()) != intermediates.end() )
-             )
-            changed = changed || intermediates.insert(e->getDst()).second;
-      } while (changed);
-
-      if (i >= input.length()) break;
-      char16_t c = input.at(i);
-      i += 1;
-
-      // reachables is the set of states that one can reach eventually
-      std::set<int32_t> reachables;
-      for (Edge * e: edges)
-        if (  e->getAbstractLabels()->match(c)
-           && ( intermediates.find(e->getSrc()) != intermediates.end() )
-           )
-          reachables.insert(e->getDst());
+    std::vector<int32_t> & current = scratch.current;
+    std::vector<int32_t> & next = scratch.next;
+    // the context of a position is known once the byte after it is
+    bool contextual = this->contextMask != 0;
+    auto contextAt = [begin, end](char const * p) {
+      return contextOf(p == begin ? edgeSide : sideOf(p[-1]),
+                       p == end ? edgeSide : sideOf(*p));
+    };
+    uint8_t context = contextual ? contextAt(begin) : 0;
+    current = this->startClosure(context);
+    // the chain states of counters are never in current, only in counts
+    scratch.counts.assign(this->counterWords, 0);
+    bool counting = false;
+    bool sawFinal = false;
+    for (int32_t q : current)
+      sawFinal = sawFinal || this->finals[q];
+    char const * p = begin;
+
+    // the budget is only checked between characters, so a run does at
+    // most one character's worth of work past it
+    uint64_t work = 0;
+    uint64_t maxWork = budget ? budget->maxWork : 0;
+    uint64_t timeout = budget ? budget->timeoutNanos : 0;
+    size_t checkEvery = budget ? std::max<size_t>(budget->checkEvery, 1) : 0;
+    size_t untilCheck = checkEvery;
+    nfa_stats::Stopwatch clock(timeout != 0);
+    bool gaveUp = false;
+
+    // an unanchored run is done at the first final state,
+    // an anchored one only at the end of the input
+    while (p != end && (anchored || !sawFinal))
+    {
+      if (current.empty() && !counting)
+      {
+        if (anchored) break;
+        // with nothing under way, a match anchored to line starts can
+        // only start after the next newline
+        if (this->lineAnchored)
+        {
+          p = (char const *)std::memchr(p, '\n', end - p);
+          if (p == nullptr) break;
+          context = contextAt(++p);
+          current = this->startClosure(context);
+          for (int32_t q : current)
+            sawFinal = sawFinal || this->finals[q];
+          continue;
+        }
+      }
+      if (maxWork != 0 && work > maxWork)
+      {
+        gaveUp = true;
+        break;
+      }
+      if (timeout != 0 && --untilCheck == 0)
+      {
+        untilCheck = checkEvery;
+        if (clock.nanos() > timeout)
+        {
+          gaveUp = true;
+          break;
+        }
+      }
+      NFA_STATS(++steps;
+                activeSum += current.size();
+                if (current.size() > activeMax)
+                  activeMax = current.size();)
+      unsigned char c = *p++;
+      if (contextual) context = contextAt(p);
+
+      // next is the set of states that one can reach eventually,
+      // the union of the closures of the states reached by c
+      next.clear();
+      scratch.nextGeneration(this->size());
+      sawFinal = false;
+      counting = false;
+      for (Counter const & counter : this->counters)
+      {
+        work += counter.words;
+        counting = this->shift(counter, &scratch.counts[counter.word], c)
+          || counting;
+      }
+      for (int32_t q : current)
+      {
+        Transitions leaving = this->transitions(q);
+        work += leaving.size();
+        for (Transition t : leaving)
+          if (t.bytes[c])
+          {
+            if (!this->counters.empty() && this->counterOf[t.dst] >= 0)
+            {
+              // entering a chain sets the bit of its state
+              Counter const & counter = this->counters[this->counterOf[t.dst]];
+              uint32_t i = this->positionOf[t.dst] - 1;
+              scratch.counts[counter.word + i / 64] |= (uint64_t)1 << (i % 64);
+              counting = true;
+              continue;
+            }
+            NFA_STATS(++epsilonIterations;)
+            for (int32_t r : this->closure(t.dst, context))
+              if (scratch.visit(r))
+              {
+                next.push_back(r);
+                sawFinal = sawFinal || this->finals[r];
+              }
+          }
+      }
+      for (Counter const & counter : this->counters)
+        if (this->leaving(counter, &scratch.counts[counter.word]))
+          for (int32_t r : this->closure(counter.exit, context))
+            if (scratch.visit(r))
+            {
+              next.push_back(r);
+              sawFinal = sawFinal || this->finals[r];
+            }
+      if (!anchored && this->restarts(context))
+        for (int32_t q : this->startClosure(context))
+          if (scratch.visit(q))
+          {
+            next.push_back(q);
+            sawFinal = sawFinal || this->finals[q];
+          }
+      work += next.size();
+      current.swap(next);
+    }
+
+    // are any of the states we reached a final state
+    bool accepted = !gaveUp && sawFinal && (!anchored || p == end);
+
+    NFA_STATS(if (record)
+                stats->recordAccept(accepted, p - begin, steps, activeSum,
+                                    activeMax, epsilonIterations,
+                                    stopwatch.nanos());)
+    if (gaveUp) return MatchResult::gaveUp;
+    return accepted ? MatchResult::accepted : MatchResult::rejected;
+  }
 
-      if (reachables.empty()) return false;
-      intermediates = reachables;
+  bool CompiledNFA::shift(Counter const & counter, uint64_t * bits,
+                          unsigned char c) const
+  {
+    if (!counter.bytes[c])
+    {
+      std::fill(bits, bits + counter.words, 0);
+      return false;
+    }
+    size_t last = counter.words - 1;
+    uint32_t top = (counter.length - 1) % 64;
+    // an unbounded chain stays on its last state
+    bool stays = counter.unbounded && (bits[last] >> top & 1);
+    uint64_t any = 0;
+    for (size_t w = last + 1; w-- > 0;)
+    {
+      bits[w] = bits[w] << 1 | (w > 0 ? bits[w - 1] >> 63 : 0);
+      if (w == last)
+      {
+        if (top < 63) bits[w] &= ((uint64_t)1 << (top + 1)) - 1;
+        if (stays) bits[w] |= (uint64_t)1 << top;
+      }
+      any |= bits[w];
     }
+    return any != 0;
+  }
 
-    //are any of the states we reached a final state
-    for (int32_t q : intermediates)
-      if (this->finalStates.find(q) != this->finalStates.end()) return true;
+  bool CompiledNFA::leaving(Counter const & counter,
+                            uint64_t const * bits) const
+  {
+    // bit i stands for i + 1 bytes, leaving needs at least min of them
+    uint32_t from = counter.min == 0 ? 0 : counter.min - 1;
+    size_t w = from / 64;
+    if (bits[w] >> (from % 64) != 0) return true;
+    for (++w; w < counter.words; ++w)
+      if (bits[w] != 0) return true;
     return false;
   }
 
@@ -1,10 +1,14 @@
 #ifndef NFA_API_HPP
 #define NFA_API_HPP
 
+#include <bitset>
+#include <memory>
 #include <set>
 #include <vector>
 #include <cstdint>
 #include <string>
+#include "literal.hpp"
+#include "stats.hpp"
 
 namespace nfa_api
 {
@@ -13,6 +17,14 @@ namespace nfa_api
   public:
     static int32_t const epsilon = -1;
     static int32_t const anyChar = -2;
+    /**
+     * zero-width assertions, labels of edges taken without reading a
+     * byte when they hold: at the start of a line, at the end of a line,
+     * and between a word byte and another byte
+     */
+    static int32_t const startOfLine = -3;
+    static int32_t const endOfLine = -4;
+    static int32_t const wordBoundary = -5;
 
     AbstractLabels();
     AbstractLabels(std::string regex);
@@ -97,7 +109,77 @@ namespace nfa_api
   };
 
   /**
-   * Edge class stores source node, destination node and the label set.
+   * The label sets of all automata, interned: every distinct set is kept
+   * once, as a bitmap of the bytes it matches and a mask of the zero-width
+   * labels it holds, and named by a 16-bit id. Edges hold ids, so the
+   * edges and patterns using the same class share it, and a set is
+   * immutable and lives as long as the program.
+   * Interning takes a lock; reading a set by id does not, as entries never
+   * move and an id is only known once its entry is written.
+   */
+  class LabelPool
+  {
+  public:
+    typedef uint16_t Id;
+
+    struct Entry
+    {
+      std::bitset<256> bytes;
+      /**
+       * bit -label - 1 for each of epsilon and the assertions held
+       */
+      uint8_t zeroWidth;
+
+      bool holds(int32_t label) const
+      {
+        return this->zeroWidth & (1u << (-label - 1));
+      }
+
+      /**
+       * says whether the set reads no byte, as epsilon and assertions
+       */
+      bool isZeroWidth() const { return this->bytes.none(); }
+    };
+
+    /**
+     * the id of the set holding epsilon alone
+     */
+    static Id const epsilon = 0;
+
+    static size_t const capacity = 1u << 16;
+
+    /**
+     * the id of the set matching what labels match; co-labels never
+     * hold epsilon or assertions
+     * @param labels
+     * @return
+     * @throws std::invalid_argument when capacity sets are interned
+     */
+    static Id intern(AbstractLabels & labels);
+
+    static Entry const & get(Id id)
+    {
+      return LabelPool::chunks[id >> chunkBits][id & (chunkSize - 1)];
+    }
+
+    /**
+     * the number of distinct sets interned
+     */
+    static size_t size();
+
+  private:
+    static unsigned const chunkBits = 8;
+    static size_t const chunkSize = 1u << chunkBits;
+    /**
+     * the first chunk is static, so epsilon is there from the start
+     */
+    static Entry first[chunkSize];
+    static Entry * chunks[capacity / chunkSize];
+  };
+
+  /**
+   * Edge class stores source node, destination node and the id of the
+   * label set in LabelPool.
    * CAUTION: Though if one needs to attach a label set and a colabel set to
    * the same pair of source node and destination node, one needs to create
    * at least two Edge instances.
@@ -105,18 +187,503 @@ namespace nfa_api
   class Edge
   {
   public:
-    Edge();
-    Edge(int32_t src, int32_t dst, AbstractLabels * abstractLabelsPtr);
-    ~Edge();
-    void setAbstractLabels(AbstractLabels * abstractLabelsPtr);
-    AbstractLabels * getAbstractLabels();
+    Edge(int32_t src, int32_t dst, LabelPool::Id labels);
+    LabelPool::Id getLabels();
     int32_t getSrc();
     int32_t getDst();
 
   private:
     int32_t src;
     int32_t dst;
-    AbstractLabels * abstractLabelsPtr;
+    LabelPool::Id labels;
+  };
+
+  /**
+   * The outcome of a match with a budget: gaveUp means the budget ran out
+   * before the input was either accepted or rejected
+   */
+  enum class MatchResult { rejected, accepted, gaveUp };
+
+  /**
+   * Limits on the work of one match, zero meaning no limit
+   */
+  struct Budget
+  {
+    /**
+     * transitions taken plus states added to the active set
+     */
+    uint64_t maxWork = 0;
+    /**
+     * wall-clock time allowed, checked every checkEvery bytes
+     */
+    uint64_t timeoutNanos = 0;
+    size_t checkEvery = 4096;
+  };
+
+  /**
+   * A counted repetition of one byte class laid out as a chain of states:
+   * states[i] is reached after i bytes of the class, the states from min
+   * on also lead to exit by an epsilon edge, and the last state loops on
+   * the class when the repetition is unbounded.
+   * The chain is an ordinary part of the automaton; knowing its shape
+   * only lets CompiledNFA simulate it as a bit vector.
+   */
+  struct Repeat
+  {
+    std::vector<int32_t> states;
+    uint32_t min;
+    bool unbounded;
+    int32_t exit;
+  };
+
+  /**
+   * Reusable buffers of a match; keeping one per thread avoids
+   * allocating on every call.
+   */
+  class MatchScratch
+  {
+  public:
+    MatchScratch();
+    /**
+     * starts a new generation of visited marks for n states;
+     * a state is visited iff its stamp equals the generation
+     * @param n
+     */
+    void nextGeneration(size_t n);
+    /**
+     * marks a state visited in the current generation
+     * @param q
+     * @return true iff it was not visited yet
+     */
+    bool visit(int32_t q)
+    {
+      if (this->stamps[q] == this->generation) return false;
+      this->stamps[q] = this->generation;
+      return true;
+    }
+    std::vector<int32_t> current;
+    std::vector<int32_t> next;
+    /**
+     * the bit vectors of the counted repetitions
+     */
+    std::vector<uint64_t> counts;
+
+  private:
+    std::vector<uint32_t> stamps;
+    uint32_t generation;
+  };
+
+  /**
+   * An array of ints from 0 to 2^31 - 1, kept with 16 bits each when they
+   * all fit and with 32 bits otherwise: the tables of an automaton of up
+   * to 65536 states take half the memory. Reading an element tests the
+   * width, which is the same for the whole array.
+   */
+  class PackedArray
+  {
+  public:
+    class Iterator
+    {
+    public:
+      Iterator(void const * p, bool narrow)
+        : p((char const *)p), narrow(narrow)
+      {}
+
+      int32_t operator*() const
+      {
+        return this->narrow ? *(uint16_t const *)this->p
+          : *(int32_t const *)this->p;
+      }
+
+      Iterator & operator++()
+      {
+        this->p += this->narrow ? sizeof(uint16_t) : sizeof(int32_t);
+        return *this;
+      }
+
+      bool operator!=(Iterator const & other) const
+      {
+        return this->p != other.p;
+      }
+
+    private:
+      char const * p;
+      bool narrow;
+    };
+
+    /**
+     * the elements [first, last) of an array, for range-based loops
+     */
+    struct Range
+    {
+      Iterator first;
+      Iterator last;
+
+      Iterator begin() const { return this->first; }
+      Iterator end() const { return this->last; }
+    };
+
+    PackedArray() {}
+    explicit PackedArray(std::vector<int32_t> const & values);
+
+    int32_t operator[](size_t i) const
+    {
+      return this->isNarrow() ? this->narrow[i] : this->wide[i];
+    }
+
+    Range range(size_t begin, size_t end) const
+    {
+      if (this->isNarrow())
+        return Range{Iterator(this->narrow.data() + begin, true),
+                     Iterator(this->narrow.data() + end, true)};
+      return Range{Iterator(this->wide.data() + begin, false),
+                   Iterator(this->wide.data() + end, false)};
+    }
+
+    size_t size() const { return this->narrow.size() + this->wide.size(); }
+    bool isNarrow() const { return this->wide.empty(); }
+
+    /**
+     * the bytes the elements take on the heap
+     */
+    size_t memoryUsage() const;
+
+  private:
+    std::vector<uint16_t> narrow;
+    std::vector<int32_t> wide;
+  };
+
+  /**
+   * Dense, read-only form of an NFA used for matching.
+   * States are renumbered from 0 and the epsilon closure of every state is
+   * computed once and stored as a contiguous list, so matching a character
+   * is a union of precomputed lists instead of a fixed-point loop over
+   * all edges. It is never modified after construction and can be shared
+   * between threads, each using its own MatchScratch.
+   * The tables are packed: states, and offsets into the lists, take 16
+   * bits each when they fit, and transitions are kept as two arrays, of
+   * targets and of the indices of their byte sets among the distinct
+   * sets of the automaton, rather than a 256-bit set apiece.
+   * The chain of a long counted repetition is simulated as a bit vector,
+   * bit i standing for the chain state reached after i + 1 bytes: a byte
+   * shifts the vector or clears it, so the repetition costs a few word
+   * operations per byte however many of its states are active.
+   * Assertions are edges followed by a closure only in the contexts
+   * where they hold, a context being what holds at a position; the
+   * closures are computed once per context, so an automaton with
+   * assertions keeps eight sets of them and one without keeps one. The
+   * context of a position only depends on the bytes on either side of
+   * it, so no engine ever backtracks to decide an assertion.
+   */
+  class CompiledNFA
+  {
+  public:
+    /**
+     * the bits of a context: the position is at the start of a line, at
+     * the end of one, or between a word byte and another byte
+     */
+    static uint8_t const atLineStart = 1;
+    static uint8_t const atLineEnd = 2;
+    static uint8_t const atWordBoundary = 4;
+
+    /**
+     * what is on one side of a position: the edge of the input or a
+     * newline, a word byte (one \w matches) or another byte
+     */
+    static uint8_t const edgeSide = 0;
+    static uint8_t const wordSide = 1;
+    static uint8_t const otherSide = 2;
+
+    static uint8_t sideOf(unsigned char c)
+    {
+      return c == '\n' ? edgeSide
+        : (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z')
+          || (c >= 'A' && c <= 'Z') ? wordSide
+        : otherSide;
+    }
+
+    /**
+     * the context of a position between the sides before and after
+     */
+    static uint8_t contextOf(uint8_t before, uint8_t after)
+    {
+      return (before == edgeSide ? atLineStart : 0)
+        | (after == edgeSide ? atLineEnd : 0)
+        | ((before == wordSide) != (after == wordSide) ? atWordBoundary : 0);
+    }
+
+    /**
+     * A byte-consuming transition
+     */
+    struct Transition
+    {
+      std::bitset<256> const & bytes;
+      int32_t dst;
+    };
+
+    /**
+     * the transitions [first, last) of an automaton, for range-based
+     * loops
+     */
+    class Transitions
+    {
+    public:
+      class Iterator
+      {
+      public:
+        Iterator(CompiledNFA const & nfa, size_t i) : nfa(nfa), i(i) {}
+
+        Transition operator*() const
+        {
+          return Transition{
+            this->nfa.labelSets[this->nfa.transitionLabels[this->i]],
+            this->nfa.transitionTargets[this->i]};
+        }
+
+        Iterator & operator++()
+        {
+          ++this->i;
+          return *this;
+        }
+
+        bool operator!=(Iterator const & other) const
+        {
+          return this->i != other.i;
+        }
+
+      private:
+        CompiledNFA const & nfa;
+        size_t i;
+      };
+
+      Transitions(CompiledNFA const & nfa, size_t first, size_t last)
+        : nfa(nfa), first(first), last(last)
+      {}
+
+      Iterator begin() const { return Iterator(this->nfa, this->first); }
+      Iterator end() const { return Iterator(this->nfa, this->last); }
+      size_t size() const { return this->last - this->first; }
+
+    private:
+      CompiledNFA const & nfa;
+      size_t first;
+      size_t last;
+    };
+
+    /**
+     * @param startStates
+     * @param finalStates
+     * @param edges
+     * @param reversed whether to build the reverse automaton instead,
+     *        which accepts the mirror image of every accepted input:
+     *        edges point backwards, start and final states swap and so
+     *        do the assertions of line starts and line ends
+     * @param repeats chains to simulate as bit vectors, ignored when
+     *        reversed
+     */
+    CompiledNFA(std::set<int32_t> const & startStates,
+                std::set<int32_t> const & finalStates,
+                std::set<Edge *> const & edges,
+                bool reversed = false,
+                std::vector<Repeat> const & repeats = {});
+
+    size_t size() const { return this->finals.size(); }
+    bool isFinal(int32_t q) const { return this->finals[q]; }
+
+    /**
+     * the bytes the automaton takes, its tables included
+     */
+    size_t memoryUsage() const;
+
+    /**
+     * says whether the automaton has assertions; without, every context
+     * has the same closures and engines may ignore contexts
+     */
+    bool hasAssertions() const { return this->contextMask != 0; }
+
+    /**
+     * says whether the start states, closed in a context, lead anywhere:
+     * to a byte or to a final state. Unanchored runs only start matches
+     * at positions where they do.
+     */
+    bool restarts(uint8_t context) const
+    {
+      return this->live[context & this->contextMask];
+    }
+
+    /**
+     * the equivalence class of a byte: two bytes are in the same class
+     * iff every transition takes both or neither, so tables indexed by
+     * class lose nothing over tables indexed by byte
+     */
+    uint8_t byteClass(unsigned char c) const { return this->classes[c]; }
+    size_t classCount() const { return this->classTotal; }
+
+    /**
+     * the epsilon closure of the start states in a context
+     */
+    std::vector<int32_t> const & startClosure(uint8_t context = 0) const
+    {
+      return this->starts[context & this->contextMask];
+    }
+
+    /**
+     * the epsilon closure of q in a context, the assertions holding in it
+     * taken too
+     */
+    PackedArray::Range closure(int32_t q, uint8_t context = 0) const
+    {
+      size_t table = (context & this->contextMask) * (this->size() + 1);
+      return this->closures.range(this->closureOffsets[table + q],
+                                  this->closureOffsets[table + q + 1]);
+    }
+
+    /**
+     * the byte-consuming transitions leaving q
+     */
+    Transitions transitions(int32_t q) const
+    {
+      return Transitions(*this, this->transitionOffsets[q],
+                         this->transitionOffsets[q + 1]);
+    }
+
+    /**
+     * given an input [begin, end)
+     * says whether or not it is accepted
+     * @param begin
+     * @param end
+     * @param scratch
+     * @param stats counters to report to, may be null
+     * @return
+     */
+    bool accept(char const * begin, char const * end, MatchScratch & scratch,
+                nfa_stats::PatternStats * stats) const
+    {
+      return this->run(begin, end, scratch, stats, true, nullptr)
+        == MatchResult::accepted;
+    }
+
+    /**
+     * like accept, giving up once the budget is spent
+     * @param begin
+     * @param end
+     * @param scratch
+     * @param stats counters to report to, may be null
+     * @param budget
+     * @return
+     */
+    MatchResult accept(char const * begin, char const * end,
+                       MatchScratch & scratch,
+                       nfa_stats::PatternStats * stats,
+                       Budget const & budget) const
+    {
+      return this->run(begin, end, scratch, stats, true, &budget);
+    }
+
+    /**
+     * given an input [begin, end)
+     * says whether or not some substring of it is accepted;
+     * it stops at the first accepting position
+     * @param begin
+     * @param end
+     * @param scratch
+     * @param stats counters to report to, may be null
+     * @return
+     */
+    bool search(char const * begin, char const * end, MatchScratch & scratch,
+                nfa_stats::PatternStats * stats) const
+    {
+      return this->run(begin, end, scratch, stats, false, nullptr)
+        == MatchResult::accepted;
+    }
+
+    /**
+     * like search, giving up once the budget is spent
+     * @param begin
+     * @param end
+     * @param scratch
+     * @param stats counters to report to, may be null
+     * @param budget
+     * @return
+     */
+    MatchResult search(char const * begin, char const * end,
+                       MatchScratch & scratch,
+                       nfa_stats::PatternStats * stats,
+                       Budget const & budget) const
+    {
+      return this->run(begin, end, scratch, stats, false, &budget);
+    }
+
+  private:
+    /**
+     * simulates the automaton on [begin, end); unanchored runs restart
+     * from the start states at every position
+     * @param budget limits on the work done, may be null
+     */
+    MatchResult run(char const * begin, char const * end,
+                    MatchScratch & scratch, nfa_stats::PatternStats * stats,
+                    bool anchored, Budget const * budget) const;
+
+    /**
+     * A Repeat in dense form, its bits at words [word, word + words) of
+     * MatchScratch::counts
+     */
+    struct Counter
+    {
+      std::bitset<256> bytes;
+      uint32_t length;
+      uint32_t min;
+      bool unbounded;
+      int32_t exit;
+      size_t word;
+      size_t words;
+    };
+
+    /**
+     * moves the bits of a counter on by the byte c
+     * @return whether some bit is left
+     */
+    bool shift(Counter const & counter, uint64_t * bits,
+               unsigned char c) const;
+
+    /**
+     * says whether a counter has reached min, and so may leave
+     */
+    bool leaving(Counter const & counter, uint64_t const * bits) const;
+
+    std::vector<bool> finals;
+    /**
+     * the context bits of the assertions present; contexts are masked
+     * with it, so an automaton without assertions has one context
+     */
+    uint8_t contextMask = 0;
+    std::vector<std::vector<int32_t>> starts;
+    std::vector<bool> live;
+    /**
+     * whether matches only start at line starts, the start states leading
+     * nowhere in any other context, so that run, with nothing under way,
+     * goes to the next line
+     */
+    bool lineAnchored = false;
+    uint8_t classes[256];
+    size_t classTotal;
+    PackedArray closureOffsets;
+    PackedArray closures;
+    PackedArray transitionOffsets;
+    PackedArray transitionTargets;
+    /**
+     * the byte set of each transition, an index in labelSets
+     */
+    PackedArray transitionLabels;
+    std::vector<std::bitset<256>> labelSets;
+    std::vector<Counter> counters;
+    /**
+     * for every state, the counter it is a chain state of and the
+     * number of bytes it stands for, or -1 and 0
+     */
+    std::vector<int32_t> counterOf;
+    std::vector<uint32_t> positionOf;
+    size_t counterWords = 0;
   };
 
   /**
@@ -124,6 +691,8 @@ namespace nfa_api
    * State set can be implied by edges; start states and final states
    * are stored as S, and F respectively; transition function is specified by
    * edges; the alphabet is the same set of the type char.
+   * An NFA owns its edges and deletes them with itself; the constructions
+   * below take their operands over, moving the edges into the result.
    */
   class AbstractNFA
   {
@@ -138,10 +707,72 @@ namespace nfa_api
     virtual ~AbstractNFA();
     void setStartStates(std::set<int32_t> startStates);
     void setFinalStates(std::set<int32_t> finalStates);
+    /**
+     * takes the edges over, deleting those held which are not among them
+     * @param edges
+     */
     void setEdges(std::set<Edge *> edges);
     std::set<int32_t> getStartStates();
     std::set<int32_t> getFinalStates();
     std::set<Edge *> getEdges();
+    /**
+     * gives the edges up to the caller, which then owns them, as when
+     * the automaton is built into a larger one
+     * @return
+     */
+    std::set<Edge *> releaseEdges();
+    /**
+     * attaches the counters that accept reports to when
+     * instrumentation is compiled in and enabled
+     * @param stats
+     */
+    void setStats(nfa_stats::PatternStats * stats);
+    /**
+     * sets a literal every accepted input contains; inputs lacking it
+     * are rejected without running the automaton
+     * @param literal
+     * @param ignoreCase whether the literal is looked for regardless of case
+     */
+    void setPrefilter(std::string literal, bool ignoreCase);
+    /**
+     * builds the dense form used by accept and searches; it is rebuilt
+     * on demand after the states or edges change. Call it before sharing
+     * the automaton between threads.
+     */
+    void compile();
+    /**
+     * the dense form of the automaton, compiling it if need be
+     */
+    CompiledNFA const & getCompiled();
+    /**
+     * the dense form of the reverse automaton, which only span finding
+     * reads, so it is built on the first call rather than by compile;
+     * make that call before sharing the automaton between threads
+     */
+    CompiledNFA const & getReversed();
+    /**
+     * gives the dense form up to the caller, compiling it if need be, for
+     * users which keep it and drop the rest of the automaton
+     * @return
+     */
+    std::unique_ptr<CompiledNFA> releaseCompiled();
+    /**
+     * gives the prefilter up to the caller, null if there is none
+     * @return
+     */
+    std::unique_ptr<nfa_literal::Finder> releasePrefilter();
+    /**
+     * the bytes the automaton takes: its states and edges, the dense
+     * forms compiled and the prefilter, with the bookkeeping of the heap
+     */
+    virtual size_t memoryUsage() const;
+    /**
+     * the literal every accepted input contains, null if there is none
+     */
+    nfa_literal::Finder const * getPrefilter() const
+    {
+      return this->prefilter.get();
+    }
     /**
      * given a string input
      * says whether or not it is accepted
@@ -149,6 +780,34 @@ namespace nfa_api
      * @return
      */
     bool accept(std::string input);
+    /**
+     * given an input [begin, end)
+     * says whether or not some substring of it is accepted,
+     * which is how grep matches a line.
+     * Once compiled, it only reads the automaton and can be called
+     * from several threads at once.
+     * @param begin
+     * @param end
+     * @return
+     */
+    bool search(char const * begin, char const * end);
+    /**
+     * like accept, giving up once the budget is spent,
+     * so that hostile patterns and inputs cannot run for long
+     * @param input
+     * @param budget
+     * @return
+     */
+    MatchResult accept(std::string input, Budget const & budget);
+    /**
+     * like search, giving up once the budget is spent
+     * @param begin
+     * @param end
+     * @param budget
+     * @return
+     */
+    MatchResult search(char const * begin, char const * end,
+                       Budget const & budget);
 
   protected:
     virtual AbstractNFA * mkNFAFromRegEx(std::string regex) = 0;
@@ -193,6 +852,13 @@ namespace nfa_api
      * @return
      */
     virtual AbstractNFA * mkNFAOfChar(char c) = 0;
+    /**
+     * makes an NFA accepting the empty string where an assertion holds
+     * @param assertion AbstractLabels::startOfLine, endOfLine or
+     *        wordBoundary
+     * @return
+     */
+    virtual AbstractNFA * mkNFAOfAssertion(int32_t assertion) = 0;
     /**
      * makes an NFA union construction of the given two
      * @param nfa1
@@ -229,9 +895,31 @@ namespace nfa_api
      * @return
      */
     virtual AbstractNFA * maxOnceOf(AbstractNFA * nfa) = 0;
+
+    /**
+     * makes an NFA accepting from min to max repetitions of what the
+     * given one accepts, or min and more when max is unbounded
+     * @param nfa
+     * @param min
+     * @param max
+     * @return
+     */
+    virtual AbstractNFA * repeatOf(AbstractNFA * nfa, uint32_t min,
+                                   uint32_t max) = 0;
+
+    static uint32_t const unbounded = UINT32_MAX;
+
     std::set<int32_t> startStates;
     std::set<int32_t> finalStates;
     std::set<Edge *> edges;
+    /**
+     * the chains of counted repetitions among the edges
+     */
+    std::vector<Repeat> repeats;
+    nfa_stats::PatternStats * stats = nullptr;
+    std::unique_ptr<CompiledNFA> compiled;
+    std::unique_ptr<CompiledNFA> reversed;
+    std::unique_ptr<nfa_literal::Finder> prefilter;
   };
 
   /**
@@ -0,0 +1,174 @@
+#include "output.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <utility>
+#include <sys/uio.h>
+
+namespace grep
+{
+  /**
+   * the most iovecs passed to one writev
+   */
+  static size_t const maxIovecs = IOV_MAX < 1024 ? IOV_MAX : 1024;
+
+  void OutputBuffer::append(char const * begin, char const * end)
+  {
+    if (begin == end) return;
+    size_t length = end - begin;
+    // the text only grows at its end, so a copied piece which ends it
+    // is extended in place
+    if (  !this->pieces.empty() && !this->pieces.back().data
+       && this->pieces.back().offset + this->pieces.back().length
+          == this->text.size()
+       )
+      this->pieces.back().length += length;
+    else
+      this->pieces.push_back(Piece{nullptr, this->text.size(), length});
+    this->text.append(begin, length);
+    this->bytes += length;
+  }
+
+  void OutputBuffer::borrow(char const * begin, char const * end)
+  {
+    size_t length = end - begin;
+    if (length < copyBelow)
+    {
+      this->append(begin, end);
+      return;
+    }
+    if (  !this->pieces.empty() && this->pieces.back().data
+       && this->pieces.back().data + this->pieces.back().length == begin
+       )
+      this->pieces.back().length += length;
+    else
+      this->pieces.push_back(Piece{begin, 0, length});
+    this->bytes += length;
+    this->borrowedBytes += length;
+  }
+
+  std::string & OutputBuffer::hold(std::string memory)
+  {
+    memory.clear();
+    this->buffers.emplace_back(new std::string(std::move(memory)));
+    return *this->buffers.back();
+  }
+
+  void OutputBuffer::adopt(std::string memory)
+  {
+    if (!this->pieces.empty() || memory.capacity() <= this->text.capacity())
+      return;
+    memory.clear();
+    this->text.swap(memory);
+  }
+
+  void OutputBuffer::own(std::vector<std::string> * spare)
+  {
+    for (Piece & piece : this->pieces)
+      if (piece.data)
+      {
+        piece.offset = this->text.size();
+        this->text.append(piece.data, piece.length);
+        piece.data = nullptr;
+      }
+    this->borrowedBytes = 0;
+    if (spare)
+      for (std::unique_ptr<std::string> & buffer : this->buffers)
+        spare->push_back(std::move(*buffer));
+    this->buffers.clear();
+  }
+
+  size_t OutputBuffer::held() const
+  {
+    size_t res = 0;
+    for (std::unique_ptr<std::string> const & buffer : this->buffers)
+      res += buffer->capacity();
+    return res;
+  }
+
+  void OutputBuffer::splice(OutputBuffer & other)
+  {
+    if (this->pieces.empty() && this->buffers.empty())
+    {
+      std::swap(this->text, other.text);
+      std::swap(this->pieces, other.pieces);
+      std::swap(this->buffers, other.buffers);
+      std::swap(this->bytes, other.bytes);
+      std::swap(this->borrowedBytes, other.borrowedBytes);
+      other.clear();
+      return;
+    }
+    // the text of other is held as it is and its pieces borrow from it;
+    // the strings held move as pointers, what is borrowed from them stays
+    std::unique_ptr<std::string> text(new std::string());
+    text->swap(other.text);
+    for (Piece piece : other.pieces)
+    {
+      if (!piece.data)
+        piece.data = text->data() + piece.offset;
+      this->pieces.push_back(piece);
+      this->borrowedBytes += piece.length;
+    }
+    this->buffers.push_back(std::move(text));
+    for (std::unique_ptr<std::string> & buffer : other.buffers)
+      this->buffers.push_back(std::move(buffer));
+    this->bytes += other.bytes;
+    other.clear();
+  }
+
+  bool OutputBuffer::writeTo(int fd) const
+  {
+    std::vector<struct iovec> iovecs;
+    size_t next = 0;
+    while (next < this->pieces.size())
+    {
+      iovecs.clear();
+      for (; next < this->pieces.size() && iovecs.size() < maxIovecs; ++next)
+      {
+        Piece const & piece = this->pieces[next];
+        iovecs.push_back(iovec{(void *)this->begin(piece), piece.length});
+      }
+      // a partial write leaves the iovecs from the one it stopped in
+      struct iovec * first = iovecs.data();
+      struct iovec * last = first + iovecs.size();
+      while (first < last)
+      {
+        ssize_t n = writev(fd, first, last - first);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return false;
+        for (; first < last && (size_t)n >= first->iov_len; ++first)
+          n -= first->iov_len;
+        if (first < last)
+        {
+          first->iov_base = (char *)first->iov_base + n;
+          first->iov_len -= n;
+        }
+      }
+    }
+    return true;
+  }
+
+  void OutputBuffer::writeTo(std::ostream & out) const
+  {
+    for (Piece const & piece : this->pieces)
+      out.write(this->begin(piece), piece.length);
+  }
+
+  void OutputBuffer::clear()
+  {
+    // clear would keep the memory, a swap frees it
+    std::string().swap(this->text);
+    std::vector<Piece>().swap(this->pieces);
+    this->buffers.clear();
+    this->bytes = 0;
+    this->borrowedBytes = 0;
+  }
+
+  void OutputBuffer::recycle(std::vector<std::string> & spare)
+  {
+    spare.push_back(std::move(this->text));
+    for (std::unique_ptr<std::string> & buffer : this->buffers)
+      spare.push_back(std::move(*buffer));
+    this->clear();
+  }
+}
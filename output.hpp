@@ -0,0 +1,150 @@
+#ifndef OUTPUT_HPP
+#define OUTPUT_HPP
+
+#include <cstddef>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace grep
+{
+  /**
+   * Output gathered as a list of pieces and written with writev, so that
+   * long lines printed are not copied: they are borrowed, as pointers
+   * into the buffer they were read into, while prefixes, separators and
+   * short lines are copied into a text of the output's own, an iovec
+   * costing the kernel about as much as copying a short line. Adjacent
+   * pieces are merged, so runs of short lines make a single iovec.
+   * Borrowed memory must stay until the output is written; buffers
+   * obtained from hold live as long as the output, and own copies the
+   * borrowed pieces when the memory they point into is about to be
+   * reused. Splicing outputs together copies nothing either.
+   */
+  class OutputBuffer
+  {
+  public:
+    /**
+     * borrowed pieces shorter than this are copied instead
+     */
+    static size_t const copyBelow = 256;
+
+    /**
+     * appends bytes, copied
+     * @param begin
+     * @param end
+     */
+    void append(char const * begin, char const * end);
+    void append(std::string const & s)
+    {
+      this->append(s.data(), s.data() + s.size());
+    }
+    void append(char c) { this->append(&c, &c + 1); }
+
+    /**
+     * appends bytes which are not copied, unless shorter than copyBelow;
+     * they must stay until the output is written or own is called
+     * @param begin
+     * @param end
+     */
+    void borrow(char const * begin, char const * end);
+
+    /**
+     * a buffer to read into, which lives as long as the output, so that
+     * what is borrowed from it needs no copy
+     * @param memory a string whose memory the buffer takes over
+     * @return the buffer, empty
+     */
+    std::string & hold(std::string memory = std::string());
+
+    /**
+     * takes over the memory of a string for the bytes copied, if the
+     * output is empty and has less
+     * @param memory
+     */
+    void adopt(std::string memory);
+
+    /**
+     * copies the borrowed pieces and frees the buffers held, to be called
+     * before the memory the pieces point into is reused
+     * @param spare if given, where the buffers go instead of being freed
+     */
+    void own(std::vector<std::string> * spare = nullptr);
+
+    /**
+     * moves the pieces of other, and the buffers it holds, to the end of
+     * this output, leaving other empty
+     * @param other
+     */
+    void splice(OutputBuffer & other);
+
+    bool empty() const { return this->pieces.empty(); }
+
+    /**
+     * the number of bytes to write
+     */
+    size_t size() const { return this->bytes; }
+
+    /**
+     * the number of bytes borrowed rather than copied
+     */
+    size_t borrowed() const { return this->borrowedBytes; }
+
+    /**
+     * the number of bytes of the buffers held
+     */
+    size_t held() const;
+
+    /**
+     * writes the output with writev, as many pieces at once as the
+     * system takes, retrying partial writes
+     * @param fd
+     * @return false on a write error, with errno set
+     */
+    bool writeTo(int fd) const;
+
+    /**
+     * writes the output to a stream, one piece at a time
+     * @param out
+     */
+    void writeTo(std::ostream & out) const;
+
+    /**
+     * empties the output and frees its memory, the buffers held too
+     */
+    void clear();
+
+    /**
+     * empties the output, handing its memory to spare instead
+     * @param spare
+     */
+    void recycle(std::vector<std::string> & spare);
+
+  private:
+    /**
+     * bytes at data, or at offset in text when data is null
+     */
+    struct Piece
+    {
+      char const * data;
+      size_t offset;
+      size_t length;
+    };
+
+    char const * begin(Piece const & piece) const
+    {
+      return piece.data ? piece.data : this->text.data() + piece.offset;
+    }
+
+    std::string text;
+    std::vector<Piece> pieces;
+    /**
+     * the buffers held, and the texts of the outputs spliced in
+     */
+    std::vector<std::unique_ptr<std::string>> buffers;
+    size_t bytes = 0;
+    size_t borrowedBytes = 0;
+  };
+}
+
+#endif /* OUTPUT_HPP */
@@ -0,0 +1,765 @@
+#include "search.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace grep
+{
+  /**
+   * size of the blocks files are streamed by
+   */
+  static size_t const streamBlockBytes = 256 << 10;
+
+  LineSelector::LineSelector(nfa_api::AbstractNFA & nfa,
+                             SearchOptions const & options)
+    : nfa(nfa), invert(options.invert)
+  {
+    if (options.also)
+      this->both.reset(new nfa_dfa::Intersection(nfa, *options.also));
+    else if (options.invert)
+      this->complement.reset(new nfa_dfa::DFA(nfa.getCompiled(), false, 4096,
+                                              true));
+    else
+      this->dfa.reset(new nfa_dfa::DFA(nfa.getCompiled(), false));
+  }
+
+  bool LineSelector::selects(char const * begin, char const * end)
+  {
+    // a line lacking the required literal is selected unseen
+    nfa_literal::Finder const * prefilter = this->nfa.getPrefilter();
+    if (this->both)
+      return this->both->search(begin, end) != this->invert;
+    bool lacks = prefilter && prefilter->find(begin, end) == end;
+    return !this->invert
+      ? !lacks && this->dfa->matches(begin, end)
+      : lacks || this->complement->matches(begin, end);
+  }
+
+  ContextWriter::ContextWriter(std::string prefix, size_t before,
+                               size_t after, OutputBuffer & out,
+                               uint64_t & matches)
+    : prefix(prefix), before(before), after(after), out(out),
+      matches(matches), ring(before), owned(before)
+  {}
+
+  void ContextWriter::line(char const * begin, char const * end,
+                           bool matched)
+  {
+    uint64_t number = this->number++;
+    this->matches += matched;
+    if (matched)
+    {
+      // the lines before which are not printed yet, oldest first
+      for (size_t k = 0; k < this->ringSize; ++k)
+      {
+        Line const & l = this->ring[(this->ringStart + k) % this->before];
+        this->print(l.begin, l.end, l.number, '-');
+      }
+      this->ringSize = 0;
+      this->print(begin, end, number, ':');
+      this->afterLeft = this->after;
+    }
+    else if (this->afterLeft > 0)
+    {
+      this->print(begin, end, number, '-');
+      this->afterLeft -= 1;
+    }
+    else if (this->before > 0)
+    {
+      // keep the line for later, it replaces the oldest one when full
+      size_t slot = (this->ringStart + this->ringSize) % this->before;
+      if (this->ringSize == this->before)
+        this->ringStart = (this->ringStart + 1) % this->before;
+      else
+        this->ringSize += 1;
+      this->ring[slot] = Line{begin, end, number, false};
+    }
+  }
+
+  void ContextWriter::detach()
+  {
+    for (size_t k = 0; k < this->ringSize; ++k)
+    {
+      size_t slot = (this->ringStart + k) % this->before;
+      Line & l = this->ring[slot];
+      if (l.owned) continue;
+      this->owned[slot].assign(l.begin, l.end);
+      l.begin = this->owned[slot].data();
+      l.end = l.begin + this->owned[slot].size();
+      l.owned = true;
+    }
+    this->out.own();
+  }
+
+  void ContextWriter::print(char const * begin, char const * end,
+                            uint64_t number, char separator)
+  {
+    // windows which do not touch are told apart like grep does
+    bool context = this->before != 0 || this->after != 0;
+    if (context && this->printed && number > this->nextUnprinted)
+      this->out.append("--\n");
+    this->out.append(this->prefix);
+    this->out.append(separator);
+    this->out.borrow(begin, end);
+    this->out.append('\n');
+    this->printed = true;
+    this->nextUnprinted = number + 1;
+  }
+
+  /**
+   * the index of the worker of this thread
+   */
+  static thread_local unsigned workerIndex = 0;
+
+  unsigned WorkStealingPool::currentWorker()
+  {
+    return workerIndex;
+  }
+
+  WorkStealingPool::WorkStealingPool(unsigned threads)
+  {
+    if (threads == 0)
+      threads = std::max(1u, std::thread::hardware_concurrency());
+    for (unsigned i = 0; i < threads; ++i)
+      this->queues.emplace_back(new Queue());
+    for (unsigned i = 0; i < threads; ++i)
+      this->workers.emplace_back(&WorkStealingPool::work, this, i);
+  }
+
+  WorkStealingPool::~WorkStealingPool()
+  {
+    this->wait();
+    {
+      std::lock_guard<std::mutex> lock(this->mutex);
+      this->stopping = true;
+    }
+    this->wake.notify_all();
+    for (std::thread & worker : this->workers)
+      worker.join();
+  }
+
+  void WorkStealingPool::submit(Task task)
+  {
+    unsigned target;
+    {
+      std::lock_guard<std::mutex> lock(this->mutex);
+      this->pending += 1;
+      target = this->nextQueue;
+      this->nextQueue = (this->nextQueue + 1) % this->queues.size();
+    }
+    {
+      Queue & queue = *this->queues[target];
+      std::lock_guard<std::mutex> lock(queue.mutex);
+      queue.tasks.push_back(std::move(task));
+    }
+    {
+      std::lock_guard<std::mutex> lock(this->mutex);
+      this->queued += 1;
+    }
+    this->wake.notify_one();
+  }
+
+  void WorkStealingPool::wait()
+  {
+    std::unique_lock<std::mutex> lock(this->mutex);
+    this->idle.wait(lock, [this] { return this->pending == 0; });
+  }
+
+  bool WorkStealingPool::take(unsigned self, Task & task)
+  {
+    // newest of our own tasks first, it is the most likely to be cached
+    {
+      Queue & queue = *this->queues[self];
+      std::lock_guard<std::mutex> lock(queue.mutex);
+      if (!queue.tasks.empty())
+      {
+        task = std::move(queue.tasks.back());
+        queue.tasks.pop_back();
+        return true;
+      }
+    }
+    // then the oldest task of another worker
+    for (size_t i = 1; i < this->queues.size(); ++i)
+    {
+      Queue & queue = *this->queues[(self + i) % this->queues.size()];
+      std::lock_guard<std::mutex> lock(queue.mutex);
+      if (!queue.tasks.empty())
+      {
+        task = std::move(queue.tasks.front());
+        queue.tasks.pop_front();
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void WorkStealingPool::work(unsigned self)
+  {
+    workerIndex = self;
+    while (true)
+    {
+      Task task;
+      if (this->take(self, task))
+      {
+        {
+          std::lock_guard<std::mutex> lock(this->mutex);
+          this->queued -= 1;
+        }
+        task();
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->pending -= 1;
+        if (this->pending == 0)
+          this->idle.notify_all();
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(this->mutex);
+      this->wake.wait(lock, [this] {
+        return this->queued > 0 || this->stopping;
+      });
+      if (this->stopping && this->queued <= 0)
+        return;
+    }
+  }
+
+  /**
+   * A file being searched, possibly as several chunks.
+   * The output of each chunk is kept until the last one is done.
+   */
+  struct Searcher::File
+  {
+    std::string path;
+    size_t size;
+    size_t chunks;
+    std::vector<std::pair<uint64_t, uint64_t>> ranges;
+    std::vector<OutputBuffer> outputs;
+    std::vector<uint64_t> counts;
+    std::atomic<size_t> remaining;
+    /**
+     * the chunks done, and the number written, under outMutex
+     */
+    std::vector<bool> done;
+    size_t written = 0;
+  };
+
+  /**
+   * walkFiles, knowing whether path was given by the caller
+   */
+  static void walk(std::string path, bool explicitPath,
+                   std::function<void(std::string, size_t)> & onFile,
+                   std::function<void(std::string, std::string)> & onError)
+  {
+    // symbolic links are followed only when named on the command line
+    struct stat st;
+    int res = explicitPath ? stat(path.c_str(), &st)
+                           : lstat(path.c_str(), &st);
+    if (res != 0)
+    {
+      onError(path, std::strerror(errno));
+      return;
+    }
+
+    if (S_ISREG(st.st_mode))
+    {
+      onFile(path, st.st_size);
+      return;
+    }
+    if (!S_ISDIR(st.st_mode))
+      return;
+
+    DIR * dir = opendir(path.c_str());
+    if (dir == nullptr)
+    {
+      onError(path, std::strerror(errno));
+      return;
+    }
+    std::vector<std::string> names;
+    while (struct dirent * entry = readdir(dir))
+    {
+      std::string name(entry->d_name);
+      if (name != "." && name != "..")
+        names.push_back(name);
+    }
+    closedir(dir);
+
+    std::sort(names.begin(), names.end());
+    std::string prefix = path;
+    if (prefix.empty() || prefix.back() != '/')
+      prefix += '/';
+    for (std::string const & name : names)
+      walk(prefix + name, false, onFile, onError);
+  }
+
+  void walkFiles(std::string path,
+                 std::function<void(std::string, size_t)> onFile,
+                 std::function<void(std::string, std::string)> onError)
+  {
+    walk(path, true, onFile, onError);
+  }
+
+  Searcher::Searcher(nfa_api::AbstractNFA & nfa, SearchOptions options,
+                     std::ostream & out)
+    : nfa(nfa), options(options), out(&out), matched(false), errors(false)
+  {}
+
+  Searcher::Searcher(nfa_api::AbstractNFA & nfa, SearchOptions options,
+                     int fd)
+    : nfa(nfa), options(options), fd(fd), eager(isatty(fd)),
+      matched(false), errors(false)
+  {}
+
+  bool Searcher::run(std::vector<std::string> paths)
+  {
+    this->start();
+    for (std::string const & path : paths)
+      walkFiles(path, [this](std::string file, size_t size) {
+        this->schedule(file, size);
+      }, [this](std::string file, std::string message) {
+        this->error(file, message);
+      });
+    return this->stop();
+  }
+
+  bool Searcher::run(std::vector<Target> const & targets)
+  {
+    this->start();
+    for (Target const & target : targets)
+    {
+      // a file without ranges has no match, whatever the context
+      if (target.whole || (this->context() && !target.ranges.empty()))
+        walkFiles(target.path, [this](std::string file, size_t size) {
+          this->schedule(file, size);
+        }, [this](std::string file, std::string message) {
+          this->error(file, message);
+        });
+      else if (!target.ranges.empty())
+        this->schedule(target.path, target.ranges.back().second,
+                       target.ranges);
+      else if (this->options.count)
+        // an empty range, to print its count of zero
+        this->schedule(target.path, 0);
+    }
+    return this->stop();
+  }
+
+  void Searcher::start()
+  {
+    this->pool.reset(new WorkStealingPool(this->options.threads));
+    this->locals.clear();
+    this->locals.resize(this->pool->size());
+  }
+
+  bool Searcher::stop()
+  {
+    this->flushBatch();
+    this->pool->wait();
+    this->pool.reset();
+    for (Local & local : this->locals)
+      this->write(local.output);
+    return this->matched.load();
+  }
+
+  void Searcher::schedule(std::string path, size_t size,
+                          std::vector<std::pair<uint64_t, uint64_t>> ranges)
+  {
+    auto file = std::make_shared<File>();
+    file->path = path;
+    file->size = size;
+    file->chunks = size <= this->options.chunkBytes || this->context()
+                 ? 1
+                 : (size + this->options.chunkBytes - 1)
+                   / this->options.chunkBytes;
+    if (!ranges.empty())
+    {
+      // each range is a chunk of its own
+      file->ranges.swap(ranges);
+      file->chunks = file->ranges.size();
+    }
+    file->outputs.resize(file->chunks);
+    file->counts.resize(file->chunks);
+    file->remaining = file->chunks;
+    file->done.resize(file->chunks);
+
+    if (file->chunks == 1 && size <= this->options.smallFileBytes)
+    {
+      this->batch.push_back(file);
+      this->batchSize += size;
+      if (  this->batchSize >= this->options.batchBytes
+         || this->batch.size() >= 256
+         )
+        this->flushBatch();
+      return;
+    }
+    // workers take their newest task first, so the last chunk goes in
+    // first and the chunks are done, and streamed, mostly in order
+    for (size_t chunk = file->chunks; chunk-- > 0;)
+      this->pool->submit([this, file, chunk] { this->scan(file, chunk); });
+  }
+
+  void Searcher::flushBatch()
+  {
+    if (this->batch.empty()) return;
+    std::vector<std::shared_ptr<File>> files;
+    files.swap(this->batch);
+    this->batchSize = 0;
+    this->pool->submit([this, files] {
+      for (std::shared_ptr<File> const & file : files)
+        this->scan(file, 0);
+    });
+  }
+
+  /**
+   * reads up to n bytes at offset, appending them to buffer
+   * @return false on a read error
+   */
+  static bool readAt(int fd, size_t offset, size_t n, std::string & buffer)
+  {
+    size_t done = buffer.size();
+    buffer.resize(done + n);
+    size_t total = 0;
+    while (total < n)
+    {
+      ssize_t got = pread(fd, &buffer[done + total], n - total,
+                          offset + total);
+      if (got < 0)
+      {
+        if (errno == EINTR) continue;
+        buffer.resize(done + total);
+        return false;
+      }
+      if (got == 0) break;
+      total += got;
+    }
+    buffer.resize(done + total);
+    return true;
+  }
+
+  bool Searcher::context() const
+  {
+    return !this->options.count
+      && (this->options.before != 0 || this->options.after != 0);
+  }
+
+  void Searcher::scan(std::shared_ptr<File> file, size_t chunk)
+  {
+    ContextWriter writer(file->path, this->options.before,
+                         this->options.after, file->outputs[chunk],
+                         file->counts[chunk]);
+    int fd = open(file->path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+      this->error(file->path, std::strerror(errno));
+      this->finish(file, chunk);
+      return;
+    }
+
+    unsigned char head[4];
+    ssize_t got = pread(fd, head, sizeof(head), 0);
+    Compression compression = detectCompression(head, got > 0 ? got : 0);
+    if (compression != Compression::none)
+    {
+      // a compressed file cannot be split, its first chunk streams it all
+      if (chunk == 0)
+      {
+        DecompressingReader reader(fd, compression);
+        this->scanStream([&reader](std::string & block) {
+          return reader.next(block);
+        }, writer);
+        if (!reader.getError().empty())
+          this->error(file->path, reader.getError());
+      }
+      close(fd);
+      this->finish(file, chunk);
+      return;
+    }
+
+    if (this->context())
+    {
+      // context needs the lines in order, the file is read block by block
+      bool ok = true;
+      this->scanStream([fd, &ok](std::string & block) {
+        block.resize(streamBlockBytes);
+        ssize_t got;
+        do got = read(fd, &block[0], block.size());
+        while (got < 0 && errno == EINTR);
+        ok = got >= 0;
+        block.resize(got > 0 ? got : 0);
+        return got > 0;
+      }, writer);
+      if (!ok)
+        this->error(file->path, std::strerror(errno));
+      close(fd);
+      this->finish(file, chunk);
+      return;
+    }
+
+    // a chunk owns the lines starting in [from, to); it reads one byte
+    // before from to know whether a line starts there
+    size_t size = this->options.chunkBytes;
+    size_t from = file->ranges.empty() ? chunk * size
+                : file->ranges[chunk].first;
+    size_t to = file->ranges.empty() ? std::min(file->size, from + size)
+              : file->ranges[chunk].second;
+    size_t readFrom = from > 0 ? from - 1 : 0;
+    OutputBuffer & output = file->outputs[chunk];
+    bool recycled = file->chunks > 1;
+    if (recycled)
+      output.adopt(this->spare());
+    std::string & buffer = output.hold(recycled ? this->spare()
+                                                : std::string());
+    bool ok = readAt(fd, readFrom, to - readFrom, buffer);
+
+    size_t lineStart = 0;
+    if (ok && from > 0)
+    {
+      void const * nl = std::memchr(buffer.data(), '\n', buffer.size());
+      lineStart = nl == nullptr
+                ? buffer.size()
+                : (char const *)nl - buffer.data() + 1;
+    }
+
+    if (ok && lineStart < to - readFrom)
+    {
+      // the last line may run into the next chunk,
+      // read on until the end of that line
+      size_t offset = readFrom + buffer.size();
+      while (  ok && chunk + 1 < file->chunks
+            && (buffer.empty() || buffer.back() != '\n')
+            )
+      {
+        size_t before = buffer.size();
+        ok = readAt(fd, offset, 4096, buffer);
+        if (buffer.size() == before) break;
+        void const * nl = std::memchr(&buffer[before], '\n',
+                                      buffer.size() - before);
+        if (nl != nullptr)
+          buffer.resize((char const *)nl - buffer.data() + 1);
+        offset += buffer.size() - before;
+      }
+      if (ok)
+        this->scanLines(buffer.data() + lineStart,
+                        buffer.data() + buffer.size(), writer);
+    }
+    if (!ok)
+      this->error(file->path, std::strerror(errno));
+    // the lines are written from the buffer unless they are a small part
+    // of it, then they are copied and the buffer is freed at once, or
+    // kept for the next chunk
+    if (output.borrowed() * 4 < buffer.size() && recycled)
+    {
+      std::vector<std::string> freed;
+      output.own(&freed);
+      std::lock_guard<std::mutex> lock(this->outMutex);
+      this->keep(freed);
+    }
+    else if (output.borrowed() * 4 < buffer.size())
+      output.own();
+
+    close(fd);
+    this->finish(file, chunk);
+  }
+
+  void Searcher::scanStream(std::function<bool(std::string &)> next,
+                            ContextWriter & writer)
+  {
+    // partial is the start of a line whose end is in a later block;
+    // the writer keeps its own copies of lines in a buffer we drop
+    std::string block;
+    std::string partial;
+    while (next(block))
+    {
+      char const * begin = block.data();
+      char const * end = begin + block.size();
+      if (!partial.empty())
+      {
+        char const * nl = (char const *)std::memchr(begin, '\n', end - begin);
+        if (nl == nullptr)
+        {
+          partial.append(begin, end);
+          continue;
+        }
+        partial.append(begin, nl + 1);
+        this->scanLines(partial.data(), partial.data() + partial.size(),
+                        writer);
+        writer.detach();
+        partial.clear();
+        begin = nl + 1;
+      }
+      char const * last = (char const *)memrchr(begin, '\n', end - begin);
+      char const * complete = last == nullptr ? begin : last + 1;
+      this->scanLines(begin, complete, writer);
+      writer.detach();
+      partial.assign(complete, end);
+    }
+    this->scanLines(partial.data(), partial.data() + partial.size(), writer);
+    writer.detach();
+  }
+
+  void Searcher::scanLines(char const * begin, char const * end,
+                           ContextWriter & writer)
+  {
+    Local & local = this->locals[WorkStealingPool::currentWorker()];
+    if (this->options.count && !this->options.also)
+    {
+      if (!local.counter)
+        local.counter.reset(new nfa_dfa::LineCounter(this->nfa,
+                                                     this->options.invert));
+      writer.count(local.counter->count(begin, end));
+      return;
+    }
+
+    if (!local.selector)
+      local.selector.reset(new LineSelector(this->nfa, this->options));
+    char const * line = begin;
+    while (line < end)
+    {
+      char const * nl = (char const *)std::memchr(line, '\n', end - line);
+      char const * lineEnd = nl == nullptr ? end : nl;
+      bool selected = local.selector->selects(line, lineEnd);
+      if (this->options.count)
+        writer.count(selected);
+      else
+        writer.line(line, lineEnd, selected);
+      line = lineEnd + 1;
+    }
+  }
+
+  void Searcher::finish(std::shared_ptr<File> const & file, size_t chunk)
+  {
+    if (file->chunks > 1 && !this->options.count)
+    {
+      std::lock_guard<std::mutex> lock(this->outMutex);
+      file->done[chunk] = true;
+      if (  this->streaming != file
+         && std::find(this->waiting.begin(), this->waiting.end(), file)
+            == this->waiting.end()
+         )
+        this->waiting.push_back(file);
+      this->drain();
+      return;
+    }
+    if (file->remaining.fetch_sub(1) != 1) return;
+
+    // the file goes to the output of the worker finishing it
+    OutputBuffer & output =
+      this->locals[WorkStealingPool::currentWorker()].output;
+    if (this->options.count)
+    {
+      uint64_t total = 0;
+      for (uint64_t n : file->counts)
+        total += n;
+      if (total > 0)
+        this->matched.store(true);
+      output.append(file->path + ":" + std::to_string(total) + "\n");
+    }
+    else
+      for (OutputBuffer & chunk : file->outputs)
+        if (!chunk.empty())
+        {
+          this->matched.store(true);
+          output.splice(chunk);
+        }
+
+    // the buffers held are bounded too, lest sparse matches of large
+    // files keep them all
+    if (  this->eager || output.size() >= flushBytes
+       || output.held() >= 16 * flushBytes
+       )
+      this->write(output);
+  }
+
+  void Searcher::drain()
+  {
+    while (true)
+    {
+      if (!this->streaming)
+      {
+        // the next file to stream is one whose next chunk is done
+        auto next = std::find_if(this->waiting.begin(), this->waiting.end(),
+          [](std::shared_ptr<File> const & file) {
+            return file->done[file->written];
+          });
+        if (next == this->waiting.end()) return;
+        this->streaming = *next;
+        this->waiting.erase(next);
+      }
+      File & file = *this->streaming;
+      for (; file.written < file.chunks && file.done[file.written];
+           ++file.written)
+      {
+        OutputBuffer & output = file.outputs[file.written];
+        if (output.empty()) continue;
+        this->matched.store(true);
+        this->emit(output);
+        std::vector<std::string> freed;
+        output.recycle(freed);
+        this->keep(freed);
+      }
+      if (file.written < file.chunks) return;
+      this->streaming.reset();
+    }
+  }
+
+  std::string Searcher::spare()
+  {
+    std::lock_guard<std::mutex> lock(this->outMutex);
+    if (this->spares.empty()) return std::string();
+    std::string memory = std::move(this->spares.back());
+    this->spares.pop_back();
+    return memory;
+  }
+
+  void Searcher::keep(std::vector<std::string> & memory)
+  {
+    // two strings for each chunk under way, a read buffer and a text
+    for (std::string & m : memory)
+      if (m.capacity() > 0 && this->spares.size() < 4 * this->locals.size())
+        this->spares.push_back(std::move(m));
+  }
+
+  void Searcher::write(OutputBuffer & output)
+  {
+    if (output.empty()) return;
+    {
+      std::lock_guard<std::mutex> lock(this->outMutex);
+      // lines of a file being streamed are not to be cut in, the output
+      // waits for the next write
+      if (this->streaming) return;
+      this->emit(output);
+    }
+    output.clear();
+  }
+
+  void Searcher::emit(OutputBuffer const & output)
+  {
+    // like grep, the search stops writing at the first write error
+    if (this->writeFailed) return;
+    bool ok;
+    if (this->out)
+    {
+      output.writeTo(*this->out);
+      ok = this->out->good();
+    }
+    else
+      ok = output.writeTo(this->fd);
+    if (ok) return;
+    std::string reason = this->out ? std::string("write error")
+      : std::string("write error: ") + std::strerror(errno);
+    this->writeFailed = true;
+    this->errors.store(true);
+    // outMutex is held already, error would take it again
+    std::cerr << "grep: " << reason << '\n';
+  }
+
+  void Searcher::error(std::string path, std::string message)
+  {
+    std::string line = "grep: " + path + ": " + message + "\n";
+    this->errors.store(true);
+    std::lock_guard<std::mutex> lock(this->outMutex);
+    std::cerr << line;
+  }
+}
@@ -0,0 +1,371 @@
+#ifndef SEARCH_HPP
+#define SEARCH_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "decompress.hpp"
+#include "dfa.hpp"
+#include "nfa_api.hpp"
+#include "output.hpp"
+
+namespace grep
+{
+  /**
+   * A fixed set of threads, each with its own task queue. A thread takes
+   * its newest task first and, once its queue is empty, steals the oldest
+   * task of another queue.
+   */
+  class WorkStealingPool
+  {
+  public:
+    typedef std::function<void()> Task;
+
+    /**
+     * @param threads number of workers, 0 for one per hardware thread
+     */
+    WorkStealingPool(unsigned threads);
+    ~WorkStealingPool();
+
+    unsigned size() const { return this->workers.size(); }
+
+    /**
+     * the index of the worker running the caller, for state kept per
+     * worker; only meaningful inside a task
+     */
+    static unsigned currentWorker();
+
+    /**
+     * queues a task, spreading tasks over the workers in turn
+     * @param task
+     */
+    void submit(Task task);
+
+    /**
+     * blocks until every submitted task has run
+     */
+    void wait();
+
+  private:
+    struct Queue
+    {
+      std::mutex mutex;
+      std::deque<Task> tasks;
+    };
+
+    void work(unsigned self);
+    bool take(unsigned self, Task & task);
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable idle;
+    int64_t queued = 0;
+    int64_t pending = 0;
+    bool stopping = false;
+    unsigned nextQueue = 0;
+  };
+
+  /**
+   * calls onFile with the path and size of every regular file under path,
+   * recursing into directories in name order; symbolic links are followed
+   * only when path itself is one
+   * @param path
+   * @param onFile
+   * @param onError called with a path and what went wrong with it
+   */
+  void walkFiles(std::string path,
+                 std::function<void(std::string, size_t)> onFile,
+                 std::function<void(std::string, std::string)> onError);
+
+  /**
+   * A file to search, whole or only some of its lines: byte ranges
+   * [first, second), in order, starting and ending at line boundaries
+   */
+  struct Target
+  {
+    std::string path;
+    bool whole = true;
+    std::vector<std::pair<uint64_t, uint64_t>> ranges;
+  };
+
+  struct SearchOptions
+  {
+    /**
+     * number of threads, 0 for one per hardware thread
+     */
+    unsigned threads = 0;
+    /**
+     * files up to this size are batched together into one task
+     */
+    size_t smallFileBytes = 64 << 10;
+    /**
+     * a batch of small files holds about this many bytes
+     */
+    size_t batchBytes = 1 << 20;
+    /**
+     * files are split into chunks of this size, cut at line ends
+     */
+    size_t chunkBytes = 8 << 20;
+    /**
+     * lines of context printed before and after each matching line;
+     * with context files are streamed whole instead of split
+     */
+    size_t before = 0;
+    size_t after = 0;
+    /**
+     * print only the number of matching lines of each file, as
+     * "path:count"; context is then ignored
+     */
+    bool count = false;
+    /**
+     * select the lines without a match instead, like grep -v
+     */
+    bool invert = false;
+    /**
+     * a second compiled automaton the selected lines must match too,
+     * not necessarily at the same place; both are decided in one pass
+     */
+    nfa_api::AbstractNFA * also = nullptr;
+  };
+
+  /**
+   * Decides whether a line is selected under the options: whether it has
+   * a match, or none when inverted, and a match of options.also too.
+   * Lines holding the required literal are decided by an unanchored DFA.
+   * Inverted, a complemented DFA stops at the first match of a line and
+   * lines lacking the required literal are selected unseen; with also,
+   * an Intersection decides both patterns at once.
+   * Like DFA, it caches states and each thread needs its own.
+   */
+  class LineSelector
+  {
+  public:
+    /**
+     * @param nfa a compiled automaton, see AbstractNFA::compile
+     * @param options
+     */
+    LineSelector(nfa_api::AbstractNFA & nfa, SearchOptions const & options);
+
+    /**
+     * @param begin
+     * @param end the end of the line, without its newline
+     * @return
+     */
+    bool selects(char const * begin, char const * end);
+
+  private:
+    nfa_api::AbstractNFA & nfa;
+    bool invert;
+    std::unique_ptr<nfa_dfa::DFA> dfa;
+    std::unique_ptr<nfa_dfa::DFA> complement;
+    std::unique_ptr<nfa_dfa::Intersection> both;
+  };
+
+  /**
+   * Formats the lines of one file, given in order, the way grep does:
+   * "path:line" for matching lines and, around them, up to before and
+   * after lines of context as "path-line", with "--" between windows
+   * that do not touch. Overlapping windows are merged.
+   * The last before lines are kept in a fixed-size ring as pointers into
+   * the caller's buffer, so nothing is re-read and memory does not grow
+   * with the file. Lines printed are borrowed from that buffer too.
+   */
+  class ContextWriter
+  {
+  public:
+    /**
+     * @param prefix
+     * @param before
+     * @param after
+     * @param out where the lines go
+     * @param matches where the number of matching lines goes
+     */
+    ContextWriter(std::string prefix, size_t before, size_t after,
+                  OutputBuffer & out, uint64_t & matches);
+
+    /**
+     * counts matching lines instead of printing them
+     * @param n
+     */
+    void count(uint64_t n) { this->matches += n; }
+
+    /**
+     * takes the next line of the file, without its newline
+     * @param begin
+     * @param end
+     * @param matched
+     */
+    void line(char const * begin, char const * end, bool matched);
+
+    /**
+     * copies the lines kept for before-context and those printed, to be
+     * called before the buffer they point into is reused
+     */
+    void detach();
+
+  private:
+    struct Line
+    {
+      char const * begin;
+      char const * end;
+      uint64_t number;
+      bool owned;
+    };
+
+    void print(char const * begin, char const * end, uint64_t number,
+               char separator);
+
+    std::string prefix;
+    size_t before;
+    size_t after;
+    OutputBuffer & out;
+    uint64_t & matches;
+    std::vector<Line> ring;
+    std::vector<std::string> owned;
+    size_t ringStart = 0;
+    size_t ringSize = 0;
+    size_t afterLeft = 0;
+    uint64_t number = 0;
+    uint64_t nextUnprinted = 0;
+    bool printed = false;
+  };
+
+  /**
+   * Searches files and directory trees line by line in parallel.
+   * Files compressed with gzip or zstd, recognized by their magic bytes,
+   * are decompressed on the fly.
+   * Every worker shares the same automaton, which is only read.
+   * The output of a file is handed at once to the worker which finishes
+   * it, so lines of different files never interleave. Each worker
+   * gathers the outputs of its files, the lines borrowed from the
+   * buffers they were read into, and writes them with writev once they
+   * reach flushBytes, or after every file when writing to a terminal.
+   * A file split into chunks is streamed instead: each chunk is written
+   * as soon as those before it are, and its buffer freed, while the
+   * outputs of other files wait.
+   * Counting lines does not look at them one by one: a LineCounter per
+   * worker runs over whole buffers. Other lines are decided by a
+   * LineSelector per worker.
+   */
+  class Searcher
+  {
+  public:
+    /**
+     * @param nfa a compiled automaton, see AbstractNFA::compile
+     * @param options
+     * @param out where the matching lines go
+     */
+    Searcher(nfa_api::AbstractNFA & nfa, SearchOptions options,
+             std::ostream & out);
+
+    /**
+     * @param nfa a compiled automaton, see AbstractNFA::compile
+     * @param options
+     * @param fd the file the matching lines are written to, with writev
+     */
+    Searcher(nfa_api::AbstractNFA & nfa, SearchOptions options, int fd);
+
+    /**
+     * the outputs of a worker are written once they hold this many bytes
+     */
+    static size_t const flushBytes = 1 << 20;
+
+    /**
+     * searches the given files, recursing into directories
+     * @param paths
+     * @return true iff some line matched
+     */
+    bool run(std::vector<std::string> paths);
+
+    /**
+     * searches the given files, or the given ranges of them; with context
+     * a file with ranges is searched whole, as its lines are needed in
+     * order, and with counts a file without ranges counts zero
+     * @param targets
+     * @return true iff some line matched
+     */
+    bool run(std::vector<Target> const & targets);
+
+    /**
+     * says whether some file could not be read or the output could not
+     * be written
+     */
+    bool hadErrors() const { return this->errors.load(); }
+
+  private:
+    struct File;
+
+    /**
+     * the automata of one worker, built on first use
+     */
+    struct Local
+    {
+      std::unique_ptr<nfa_dfa::LineCounter> counter;
+      std::unique_ptr<LineSelector> selector;
+      OutputBuffer output;
+    };
+
+    void start();
+    bool stop();
+    void schedule(std::string path, size_t size,
+                  std::vector<std::pair<uint64_t, uint64_t>> ranges = {});
+    void flushBatch();
+    void scan(std::shared_ptr<File> file, size_t chunk);
+    void scanStream(std::function<bool(std::string &)> next,
+                    ContextWriter & writer);
+    void scanLines(char const * begin, char const * end,
+                   ContextWriter & writer);
+    void finish(std::shared_ptr<File> const & file, size_t chunk);
+    void drain();
+    void write(OutputBuffer & output);
+    void emit(OutputBuffer const & output);
+    std::string spare();
+    void keep(std::vector<std::string> & memory);
+    void error(std::string path, std::string message);
+    bool context() const;
+
+    nfa_api::AbstractNFA & nfa;
+    SearchOptions options;
+    std::ostream * out = nullptr;
+    int fd = -1;
+    /**
+     * whether outputs are written after every file
+     */
+    bool eager = false;
+    std::mutex outMutex;
+    /**
+     * the file split into chunks whose output is being written, and
+     * those with chunks done waiting for it, under outMutex
+     */
+    std::shared_ptr<File> streaming;
+    std::vector<std::shared_ptr<File>> waiting;
+    /**
+     * the memory of chunks written, reused to read and copy the next
+     * ones rather than mapped afresh, under outMutex
+     */
+    std::vector<std::string> spares;
+    /**
+     * whether a write failed, after which nothing more is written, under
+     * outMutex
+     */
+    bool writeFailed = false;
+    std::unique_ptr<WorkStealingPool> pool;
+    std::vector<Local> locals;
+    std::vector<std::shared_ptr<File>> batch;
+    size_t batchSize = 0;
+    std::atomic<bool> matched;
+    std::atomic<bool> errors;
+  };
+}
+
+#endif /* SEARCH_HPP */
@@ -0,0 +1,427 @@
+#include "server.hpp"
+#include "binary.hpp"
+#include "memory.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <stdexcept>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace grep
+{
+  /**
+   * size of the reads from a connection
+   */
+  static size_t const readBytes = 64 << 10;
+
+  /**
+   * how long sending a reply may block before the connection is closed
+   */
+  static int const sendTimeoutSeconds = 10;
+
+  bool RuleSets::load(std::istream & in, uint32_t flags)
+  {
+    this->sets.clear();
+    this->error.clear();
+    std::vector<std::string> names;
+    std::map<std::string, std::string> unions;
+    std::string line;
+    for (size_t number = 1; std::getline(in, line); ++number)
+    {
+      if (line.empty() || line[0] == '#') continue;
+      size_t tab = line.find('\t');
+      if (tab == std::string::npos || tab == 0)
+      {
+        this->error = "line " + std::to_string(number)
+                    + ": expected a name, a tab and a pattern";
+        return false;
+      }
+      std::string name = line.substr(0, tab);
+      std::string pattern = line.substr(tab + 1);
+      // each pattern is parsed alone, so that one malformed is reported
+      // with its line, and compiled only as part of its set's union
+      try
+      {
+        nfa::NFA::check(pattern, flags);
+      }
+      catch (std::invalid_argument const & e)
+      {
+        this->error = "line " + std::to_string(number) + ": " + e.what();
+        return false;
+      }
+      // postfix patterns are joined by appending the second and a |
+      auto found = unions.find(name);
+      if (found == unions.end())
+      {
+        names.push_back(name);
+        unions[name] = pattern;
+      }
+      else
+        found->second += pattern + "|";
+    }
+    if (names.size() > UINT16_MAX + 1u)
+    {
+      this->error = "more than 65536 sets";
+      return false;
+    }
+
+    for (std::string const & name : names)
+    {
+      Set set;
+      set.name = name;
+      nfa::NFA nfa(unions[name], flags);
+      set.compiled = nfa.releaseCompiled();
+      set.prefilter = nfa.releasePrefilter();
+      this->sets.push_back(std::move(set));
+    }
+    return true;
+  }
+
+  bool RuleSets::load(std::string const & path, uint32_t flags)
+  {
+    std::ifstream in(path);
+    if (!in)
+    {
+      this->sets.clear();
+      this->error = path + ": " + std::strerror(errno);
+      return false;
+    }
+    if (this->load(in, flags)) return true;
+    this->error = path + ": " + this->error;
+    return false;
+  }
+
+  size_t RuleSets::memoryUsage(size_t set) const
+  {
+    Set const & s = this->sets[set];
+    return sizeof(Set) + nfa_memory::stringBytes(s.name)
+      + nfa_memory::blockBytes(sizeof(nfa_api::CompiledNFA))
+      + s.compiled->memoryUsage() - sizeof(nfa_api::CompiledNFA)
+      + (s.prefilter ? s.prefilter->memoryUsage() : 0);
+  }
+
+  size_t RuleSets::memoryUsage() const
+  {
+    size_t res = sizeof(RuleSets) + nfa_memory::vectorBytes(this->sets)
+               - this->sets.size() * sizeof(Set)
+               + nfa_memory::stringBytes(this->error);
+    for (size_t set = 0; set < this->sets.size(); ++set)
+      res += this->memoryUsage(set);
+    return res;
+  }
+
+  Server::Server(RuleSets const & rules, unsigned threads)
+    : rules(rules), threads(threads), stopping(false)
+  {
+    if (this->threads == 0)
+      this->threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  Server::~Server()
+  {
+    if (this->listener >= 0)
+    {
+      ::close(this->listener);
+      unlink(this->path.c_str());
+    }
+    if (this->poller >= 0)
+      ::close(this->poller);
+    if (this->wakeup >= 0)
+      ::close(this->wakeup);
+  }
+
+  bool Server::listen(std::string path)
+  {
+    struct sockaddr_un address;
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(address.sun_path))
+    {
+      this->error = path + ": socket path too long";
+      return false;
+    }
+    std::memcpy(address.sun_path, path.data(), path.size());
+
+    // a socket left by an earlier server is replaced, other files are not
+    struct stat st;
+    if (lstat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+      unlink(path.c_str());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (  fd < 0
+       || bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0
+       || ::listen(fd, SOMAXCONN) != 0
+       )
+    {
+      this->error = path + ": " + std::strerror(errno);
+      if (fd >= 0)
+        ::close(fd);
+      return false;
+    }
+    this->listener = fd;
+    this->path = path;
+
+    // the eventfd stays readable once written, waking every worker
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = &this->wakeup;
+    this->poller = epoll_create1(EPOLL_CLOEXEC);
+    this->wakeup = eventfd(0, EFD_CLOEXEC);
+    if (  this->poller < 0 || this->wakeup < 0
+       || epoll_ctl(this->poller, EPOLL_CTL_ADD, this->wakeup, &event) != 0
+       || !this->arm(this->listener, &this->listener, EPOLL_CTL_ADD)
+       )
+    {
+      this->error = path + ": " + std::strerror(errno);
+      return false;
+    }
+    return true;
+  }
+
+  void Server::run()
+  {
+    std::vector<std::thread> workers;
+    for (unsigned i = 0; i < this->threads; ++i)
+      workers.emplace_back(&Server::work, this);
+    for (std::thread & worker : workers)
+      worker.join();
+    std::lock_guard<std::mutex> lock(this->mutex);
+    for (auto const & connection : this->connections)
+      ::close(connection.first);
+    this->connections.clear();
+  }
+
+  void Server::stop()
+  {
+    // the eventfd wakes the workers waiting for events, and shutting a
+    // connection down wakes one blocked sending to it
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->stopping = true;
+    uint64_t one = 1;
+    ssize_t n = 0;
+    if (this->wakeup >= 0)
+      do
+        n = write(this->wakeup, &one, sizeof(one));
+      while (n < 0 && errno == EINTR);
+    for (auto const & connection : this->connections)
+      shutdown(connection.first, SHUT_RDWR);
+  }
+
+  bool Server::arm(int fd, void * tag, int op)
+  {
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLONESHOT;
+    event.data.ptr = tag;
+    return epoll_ctl(this->poller, op, fd, &event) == 0;
+  }
+
+  void Server::work()
+  {
+    Worker worker;
+    worker.searchers.resize(this->rules.size());
+    worker.acceptors.resize(this->rules.size());
+    while (!this->stopping)
+    {
+      struct epoll_event event;
+      int n = epoll_wait(this->poller, &event, 1, -1);
+      if (n < 0 && errno == EINTR) continue;
+      if (n < 0) break;
+      if (n == 0) continue;
+      if (event.data.ptr == &this->wakeup) break;
+      if (event.data.ptr == &this->listener)
+      {
+        this->admit();
+        continue;
+      }
+      // the connection is disarmed until given back, so no other worker
+      // reads it meanwhile
+      Connection & connection = *(Connection *)event.data.ptr;
+      std::unique_lock<std::mutex> serving(connection.mutex);
+      if (  this->serve(connection, worker)
+         && this->arm(connection.fd, &connection, EPOLL_CTL_MOD)
+         )
+        continue;
+      serving.unlock();
+      this->drop(connection);
+    }
+  }
+
+  void Server::admit()
+  {
+    // a client not reading its replies must not hold a worker for ever
+    struct timeval timeout = { sendTimeoutSeconds, 0 };
+    while (!this->stopping)
+    {
+      int fd = accept4(this->listener, nullptr, nullptr, SOCK_CLOEXEC);
+      if (fd < 0 && (errno == EINTR || errno == ECONNABORTED)) continue;
+      if (fd < 0) break;
+      setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+      std::lock_guard<std::mutex> lock(this->mutex);
+      std::unique_ptr<Connection> & connection = this->connections[fd];
+      connection.reset(new Connection());
+      connection->fd = fd;
+      if (!this->arm(fd, connection.get(), EPOLL_CTL_ADD))
+      {
+        this->connections.erase(fd);
+        ::close(fd);
+      }
+    }
+    this->arm(this->listener, &this->listener, EPOLL_CTL_MOD);
+  }
+
+  void Server::drop(Connection & connection)
+  {
+    int fd = connection.fd;
+    std::lock_guard<std::mutex> lock(this->mutex);
+    epoll_ctl(this->poller, EPOLL_CTL_DEL, fd, nullptr);
+    this->connections.erase(fd);
+    ::close(fd);
+  }
+
+  bool Server::serve(Connection & connection, Worker & worker)
+  {
+    // the connection keeps only the start of a frame between reads, so
+    // that idle connections take no buffer
+    std::string & in = worker.in;
+    std::string & out = worker.out;
+    in.assign(connection.in);
+    std::string().swap(connection.in);
+    size_t had = in.size();
+    in.resize(had + readBytes);
+    ssize_t got;
+    do
+      got = recv(connection.fd, &in[had], readBytes, MSG_DONTWAIT);
+    while (got < 0 && errno == EINTR);
+    if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      got = 0;
+    else if (got <= 0)
+      return false;
+    in.resize(had + got);
+
+    // every whole frame read is answered before the replies are sent at
+    // once, so a client may pipeline requests
+    out.clear();
+    size_t used = 0;
+    bool ok = true;
+    while (ok && in.size() - used >= 4)
+    {
+      Cursor header{in.data() + used, in.data() + used + 4, true};
+      uint64_t length = header.get(4);
+      if (length > maxFrameBytes)
+        ok = false;
+      else if (in.size() - used - 4 < length)
+        break;
+      else
+      {
+        char const * frame = in.data() + used + 4;
+        ok = this->answer(frame, frame + length, worker);
+        used += 4 + length;
+      }
+    }
+    if (used < in.size())
+      connection.in.assign(in, used, std::string::npos);
+
+    for (size_t sent = 0; sent < out.size();)
+    {
+      ssize_t n = send(connection.fd, out.data() + sent, out.size() - sent,
+                       MSG_NOSIGNAL);
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) return false;
+      sent += n;
+    }
+    return ok;
+  }
+
+  bool Server::answer(char const * begin, char const * end, Worker & worker)
+  {
+    Cursor in{begin, end, true};
+    uint32_t id = in.get(4);
+    uint32_t count = in.get(2);
+    std::string & out = worker.out;
+    size_t start = out.size();
+    put(out, 0, 4);
+    put(out, id, 4);
+    put(out, count, 2);
+    for (uint32_t i = 0; i < count && in.ok; ++i)
+    {
+      uint16_t set = in.get(2);
+      uint8_t mode = in.get(1);
+      uint64_t length = in.get(4);
+      if (!in.ok || (uint64_t)(in.end - in.p) < length)
+        in.ok = false;
+      else
+      {
+        out += (char)this->check(set, mode, in.p, in.p + length, worker);
+        in.p += length;
+      }
+    }
+    if (!in.ok || in.p != in.end)
+    {
+      out.resize(start);
+      return false;
+    }
+    uint32_t length = out.size() - start - 4;
+    for (int i = 0; i < 4; ++i)
+      out[start + i] = (char)(length >> (8 * i));
+    return true;
+  }
+
+  Server::Verdict Server::check(uint16_t set, uint8_t mode,
+                                char const * begin, char const * end,
+                                Worker & worker)
+  {
+    if (set >= this->rules.size() || mode > (uint8_t)Mode::accept)
+      return Verdict::invalid;
+    // an input lacking the required literal is rejected unseen
+    nfa_literal::Finder const * prefilter = this->rules.prefilter(set);
+    if (prefilter && prefilter->find(begin, end) == end)
+      return Verdict::miss;
+
+    bool anchored = mode == (uint8_t)Mode::accept;
+    std::unique_ptr<nfa_dfa::DFA> & dfa =
+      anchored ? worker.acceptors[set] : worker.searchers[set];
+    if (!dfa)
+      dfa.reset(new nfa_dfa::DFA(this->rules.compiled(set), anchored));
+    return dfa->matches(begin, end) ? Verdict::hit : Verdict::miss;
+  }
+
+  std::string Server::encodeRequest(uint32_t id,
+                                    std::vector<Check> const & checks)
+  {
+    std::string frame;
+    put(frame, 0, 4);
+    put(frame, id, 4);
+    put(frame, checks.size(), 2);
+    for (Check const & check : checks)
+    {
+      put(frame, check.set, 2);
+      put(frame, (uint8_t)check.mode, 1);
+      put(frame, check.input.size(), 4);
+      frame += check.input;
+    }
+    uint32_t length = frame.size() - 4;
+    for (int i = 0; i < 4; ++i)
+      frame[i] = (char)(length >> (8 * i));
+    return frame;
+  }
+
+  bool Server::decodeReply(char const * begin, char const * end,
+                           uint32_t & id, std::vector<Verdict> & verdicts)
+  {
+    Cursor in{begin, end, true};
+    id = in.get(4);
+    uint64_t count = in.get(2);
+    verdicts.clear();
+    for (uint64_t i = 0; i < count && in.ok; ++i)
+      verdicts.push_back((Verdict)in.get(1));
+    return in.ok && in.p == in.end;
+  }
+}
@@ -0,0 +1,262 @@
+#ifndef SERVER_HPP
+#define SERVER_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <istream>
+#include <memory>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "dfa.hpp"
+#include "nfa.hpp"
+
+namespace grep
+{
+  /**
+   * Named sets of patterns, compiled once. A rules file holds one pattern
+   * per line, as a name, a tab and the pattern; the patterns of a name
+   * form one set, matched as their union by a single automaton. Sets are
+   * numbered from 0 in the order their names first appear. Empty lines and
+   * lines starting with # are skipped.
+   */
+  class RuleSets
+  {
+  public:
+    /**
+     * reads rules, replacing the sets held
+     * @param in
+     * @param flags construction flags of the patterns, see nfa::NFA
+     * @return false if a line is malformed, see getError
+     */
+    bool load(std::istream & in, uint32_t flags = 0);
+
+    /**
+     * reads a rules file, replacing the sets held
+     * @param path
+     * @param flags construction flags of the patterns, see nfa::NFA
+     * @return false if it could not be read or a line is malformed, see
+     *         getError
+     */
+    bool load(std::string const & path, uint32_t flags = 0);
+
+    /**
+     * what went wrong, as "line N: message"
+     */
+    std::string const & getError() const { return this->error; }
+
+    size_t size() const { return this->sets.size(); }
+
+    std::string const & name(size_t set) const
+    {
+      return this->sets[set].name;
+    }
+
+    /**
+     * the automaton of a set, compiled; it is only read
+     */
+    nfa_api::CompiledNFA const & compiled(size_t set) const
+    {
+      return *this->sets[set].compiled;
+    }
+
+    /**
+     * the literal every input accepted by a set contains, null if none
+     */
+    nfa_literal::Finder const * prefilter(size_t set) const
+    {
+      return this->sets[set].prefilter.get();
+    }
+
+    /**
+     * the bytes a set takes, its automata and its name
+     */
+    size_t memoryUsage(size_t set) const;
+
+    /**
+     * the bytes all sets take
+     */
+    size_t memoryUsage() const;
+
+  private:
+    /**
+     * a set keeps what checks read, its automaton in dense form and its
+     * prefilter; the graph it was compiled from is dropped
+     */
+    struct Set
+    {
+      std::string name;
+      std::unique_ptr<nfa_api::CompiledNFA> compiled;
+      std::unique_ptr<nfa_literal::Finder> prefilter;
+    };
+
+    std::vector<Set> sets;
+    std::string error;
+  };
+
+  /**
+   * Answers whether inputs match rule sets, over a Unix domain socket, so
+   * that the sets are compiled once rather than by every client.
+   * Requests and replies are frames: a 4-byte length, then that many
+   * bytes. Integers are little endian.
+   *
+   *   request  id:4 count:2 { set:2 mode:1 length:4 input:length }*count
+   *   reply    id:4 count:2 { verdict:1 }*count
+   *
+   * The reply echoes the id and has a verdict per check, in order, see
+   * Mode and Verdict. A connection may send several requests without
+   * waiting; their replies come in order. A malformed frame, or one
+   * larger than maxFrameBytes, closes the connection.
+   * The listening socket and the connections are watched by one epoll
+   * set, which the worker threads wait on together: a worker takes a
+   * connection with bytes to read, answers the whole frames read and
+   * gives the connection back, so an idle connection holds no worker and
+   * any number of them may stay open. A connection is armed for one
+   * event at a time, so a single worker reads it at once and replies
+   * keep their order. Each worker has lazy DFAs of its own for the sets
+   * it has seen, so a check takes no lock and, once the DFA states it
+   * needs are cached, costs a table lookup per byte.
+   */
+  class Server
+  {
+  public:
+    enum class Mode : uint8_t
+    {
+      /** some substring of the input matches, as grep matches a line */
+      search = 0,
+      /** the whole input matches */
+      accept = 1
+    };
+
+    enum class Verdict : uint8_t
+    {
+      miss = 0,
+      hit = 1,
+      /** the set or the mode is unknown */
+      invalid = 2
+    };
+
+    struct Check
+    {
+      uint16_t set;
+      Mode mode;
+      std::string input;
+    };
+
+    static uint32_t const maxFrameBytes = 64 << 20;
+
+    /**
+     * @param rules the sets answered from, which must outlive the server
+     * @param threads number of workers, 0 for one per hardware thread
+     */
+    Server(RuleSets const & rules, unsigned threads);
+    ~Server();
+
+    /**
+     * binds the socket, replacing a socket file left at path
+     * @param path
+     * @return false if it could not, see getError
+     */
+    bool listen(std::string path);
+
+    /**
+     * answers connections until stop is called, then closes them
+     */
+    void run();
+
+    /**
+     * makes run return, closing the connections; it can be called from
+     * any thread
+     */
+    void stop();
+
+    std::string const & getError() const { return this->error; }
+
+    /**
+     * encodes a request frame, length included, for clients
+     * @param id
+     * @param checks
+     * @return
+     */
+    static std::string encodeRequest(uint32_t id,
+                                     std::vector<Check> const & checks);
+
+    /**
+     * decodes a reply frame, without its length
+     * @param begin
+     * @param end
+     * @param id
+     * @param verdicts
+     * @return false if it is malformed
+     */
+    static bool decodeReply(char const * begin, char const * end,
+                            uint32_t & id, std::vector<Verdict> & verdicts);
+
+  private:
+    /**
+     * what a worker keeps between checks
+     */
+    struct Worker
+    {
+      std::vector<std::unique_ptr<nfa_dfa::DFA>> searchers;
+      std::vector<std::unique_ptr<nfa_dfa::DFA>> acceptors;
+      std::string in;
+      std::string out;
+    };
+
+    /**
+     * an open connection; in holds the start of a frame not yet whole,
+     * and is empty, without memory, between whole frames. The worker
+     * serving it holds its mutex until it is armed again, as another
+     * worker may be handed it before arm returns
+     */
+    struct Connection
+    {
+      int fd;
+      std::string in;
+      std::mutex mutex;
+    };
+
+    void work();
+    /**
+     * accepts the connections waiting and adds them to the epoll set
+     */
+    void admit();
+    /**
+     * reads from a connection once and answers the whole frames it has
+     * @param connection
+     * @param worker
+     * @return false if the connection is to be closed
+     */
+    bool serve(Connection & connection, Worker & worker);
+    /**
+     * arms a socket of the epoll set for its next event
+     * @param fd
+     * @param tag what the event carries
+     * @param op EPOLL_CTL_ADD or EPOLL_CTL_MOD
+     */
+    bool arm(int fd, void * tag, int op);
+    void drop(Connection & connection);
+    bool answer(char const * begin, char const * end, Worker & worker);
+    Verdict check(uint16_t set, uint8_t mode, char const * begin,
+                  char const * end, Worker & worker);
+
+    RuleSets const & rules;
+    unsigned threads;
+    int listener = -1;
+    /**
+     * the epoll set, and an eventfd in it made readable by stop
+     */
+    int poller = -1;
+    int wakeup = -1;
+    std::string path;
+    std::string error;
+    std::atomic<bool> stopping;
+    std::mutex mutex;
+    std::map<int, std::unique_ptr<Connection>> connections;
+  };
+}
+
+#endif /* SERVER_HPP */
@@ -0,0 +1,345 @@
+#ifndef STATIC_NFA_HPP
+#define STATIC_NFA_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/**
+ * Patterns known when the program is built, turned into tables by the
+ * compiler instead of into an NFA at startup.
+ * A pattern, in the postfix syntax of nfa::NFA, is given as a type:
+ *
+ *   struct Errors { static constexpr char const * pattern = "ER&R&O&R&"; };
+ *   bool hit = nfa_static::Matcher<Errors>::search(begin, end);
+ *
+ * The automaton is the Glushkov (position) automaton of the pattern: one
+ * state per character token, no epsilon edges. A set of states fits in
+ * a 64-bit word, indexed by the position of the token in the pattern,
+ * so matching a byte is a few ORs of precomputed follow sets and one
+ * AND with the set of tokens accepting the byte.
+ * Everything is computed by C++11 constexpr functions over the pattern;
+ * malformed patterns and patterns longer than 64 characters are
+ * rejected at compile time. Only the byte mode of nfa::NFA is supported,
+ * without ignoreCase or utf8, without counted repetitions and without
+ * the assertions ^, $ and \b, which are no character tokens.
+ */
+namespace nfa_static
+{
+  /**
+   * the length of a pattern
+   */
+  constexpr int length(char const * s, int n = 0)
+  {
+    return s[n] == '\0' ? n : length(s, n + 1);
+  }
+
+  /**
+   * says whether s[i] follows an escaping backslash, that is whether an
+   * odd number of backslashes comes right before it
+   */
+  constexpr bool escaped(char const * s, int i)
+  {
+    return i > 0 && s[i - 1] == '\\' && !escaped(s, i - 1);
+  }
+
+  constexpr bool isBinary(char const * s, int i)
+  {
+    return !escaped(s, i) && (s[i] == '&' || s[i] == '|');
+  }
+
+  constexpr bool isUnary(char const * s, int i)
+  {
+    return !escaped(s, i) && (s[i] == '*' || s[i] == '+' || s[i] == '?');
+  }
+
+  /**
+   * says whether s[i] is an escape sequence nfa::NFA knows
+   */
+  constexpr bool knownEscape(char c)
+  {
+    return c == 'd' || c == 'D' || c == 'w' || c == 'W' || c == 's'
+      || c == 'S' || c == 't' || c == '\\' || c == '.' || c == '&'
+      || c == '|' || c == '*' || c == '+' || c == '?' || c == '{'
+      || c == '^' || c == '$';
+  }
+
+  /**
+   * says whether s[0, n) has a counted repetition, which would need one
+   * token per repetition
+   */
+  constexpr bool counted(char const * s, int n)
+  {
+    return n > 0
+      && ((s[n - 1] == '{' && !escaped(s, n - 1)) || counted(s, n - 1));
+  }
+
+  /**
+   * says whether s[0, n) has an assertion, ^, $ or \b, which reads no byte
+   */
+  constexpr bool asserting(char const * s, int n)
+  {
+    return n > 0
+      && ((!escaped(s, n - 1) && (s[n - 1] == '^' || s[n - 1] == '$'))
+          || (escaped(s, n - 1) && s[n - 1] == 'b')
+          || asserting(s, n - 1));
+  }
+
+  /**
+   * finds where the sub-expression ending at s[i] begins
+   * @return its first index, negative if it is malformed
+   */
+  constexpr int begin(char const * s, int i)
+  {
+    return i < 0 ? -1
+      : isBinary(s, i) ? begin(s, begin(s, i - 1) - 1)
+      : isUnary(s, i) ? begin(s, i - 1)
+      : escaped(s, i) ? (knownEscape(s[i]) ? i - 1 : -1)
+      : s[i] == '\\' ? -1
+      : i;
+  }
+
+  /**
+   * where the left operand of the binary operator at s[i] ends
+   */
+  constexpr int left(char const * s, int i)
+  {
+    return begin(s, i - 1) - 1;
+  }
+
+  constexpr bool isToken(char const * s, int i)
+  {
+    return !isBinary(s, i) && !isUnary(s, i);
+  }
+
+  constexpr uint64_t bit(int i)
+  {
+    return (uint64_t)1 << i;
+  }
+
+  /**
+   * says whether the sub-expression ending at s[i] accepts the empty
+   * string
+   */
+  constexpr bool nullable(char const * s, int i)
+  {
+    return isToken(s, i) ? false
+      : s[i] == '&' ? nullable(s, left(s, i)) && nullable(s, i - 1)
+      : s[i] == '|' ? nullable(s, left(s, i)) || nullable(s, i - 1)
+      : s[i] == '+' ? nullable(s, i - 1)
+      : true;
+  }
+
+  /**
+   * the tokens a match of the sub-expression ending at s[i] can begin
+   * with
+   */
+  constexpr uint64_t first(char const * s, int i)
+  {
+    return isToken(s, i) ? bit(i)
+      : s[i] == '&' ? first(s, left(s, i))
+                      | (nullable(s, left(s, i)) ? first(s, i - 1) : 0)
+      : s[i] == '|' ? first(s, left(s, i)) | first(s, i - 1)
+      : first(s, i - 1);
+  }
+
+  /**
+   * the tokens a match of the sub-expression ending at s[i] can end with
+   */
+  constexpr uint64_t last(char const * s, int i)
+  {
+    return isToken(s, i) ? bit(i)
+      : s[i] == '&' ? last(s, i - 1)
+                      | (nullable(s, i - 1) ? last(s, left(s, i)) : 0)
+      : s[i] == '|' ? last(s, left(s, i)) | last(s, i - 1)
+      : last(s, i - 1);
+  }
+
+  /**
+   * the tokens which can come right after token p within the
+   * sub-expression ending at s[i]
+   */
+  constexpr uint64_t follow(char const * s, int i, int p)
+  {
+    return isToken(s, i) ? 0
+      : s[i] == '&' ? follow(s, left(s, i), p) | follow(s, i - 1, p)
+                      | (last(s, left(s, i)) & bit(p) ? first(s, i - 1) : 0)
+      : s[i] == '|' ? follow(s, left(s, i), p) | follow(s, i - 1, p)
+      : s[i] == '?' ? follow(s, i - 1, p)
+      : follow(s, i - 1, p)
+        | (last(s, i - 1) & bit(p) ? first(s, i - 1) : 0);
+  }
+
+  constexpr bool isDigit(unsigned char c)
+  {
+    return c >= '0' && c <= '9';
+  }
+
+  constexpr bool isAlphaNum(unsigned char c)
+  {
+    return isDigit(c) || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+  }
+
+  constexpr bool isWhite(unsigned char c)
+  {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\f';
+  }
+
+  /**
+   * says whether the token ending at s[i] accepts the byte c,
+   * with the classes of nfa::NFA
+   */
+  constexpr bool matches(char const * s, int i, unsigned char c)
+  {
+    return !escaped(s, i) ? s[i] == '.' || (unsigned char)s[i] == c
+      : s[i] == 'd' ? isDigit(c)
+      : s[i] == 'D' ? !isDigit(c)
+      : s[i] == 'w' ? isAlphaNum(c)
+      : s[i] == 'W' ? !isAlphaNum(c)
+      : s[i] == 's' ? isWhite(c)
+      : s[i] == 'S' ? !isWhite(c)
+      : s[i] == 't' ? c == '\t'
+      : (unsigned char)s[i] == c;
+  }
+
+  /**
+   * the tokens among s[0, n) which accept the byte c
+   */
+  constexpr uint64_t accepting(char const * s, int n, unsigned char c)
+  {
+    return n == 0 ? 0
+      : accepting(s, n - 1, c)
+        | (  isToken(s, n - 1) && !(s[n - 1] == '\\' && !escaped(s, n - 1))
+          && matches(s, n - 1, c) ? bit(n - 1) : 0);
+  }
+
+  /**
+   * a pack of the indices 0, ..., N - 1
+   */
+  template <size_t... I>
+  struct Indices {};
+
+  template <size_t N, size_t... I>
+  struct MakeIndices : MakeIndices<N - 1, N - 1, I...> {};
+
+  template <size_t... I>
+  struct MakeIndices<0, I...>
+  {
+    typedef Indices<I...> type;
+  };
+
+  template <typename Pattern, typename I>
+  struct FollowTable;
+
+  /**
+   * follows[p], the tokens which can come right after token p
+   */
+  template <typename Pattern, size_t... I>
+  struct FollowTable<Pattern, Indices<I...>>
+  {
+    static constexpr uint64_t values[sizeof...(I)] = {
+      follow(Pattern::pattern, length(Pattern::pattern) - 1, I)...
+    };
+  };
+
+  template <typename Pattern, size_t... I>
+  constexpr uint64_t FollowTable<Pattern, Indices<I...>>::values[];
+
+  template <typename Pattern, typename I>
+  struct ByteTable;
+
+  /**
+   * bytes[c], the tokens which accept the byte c
+   */
+  template <typename Pattern, size_t... I>
+  struct ByteTable<Pattern, Indices<I...>>
+  {
+    static constexpr uint64_t values[sizeof...(I)] = {
+      accepting(Pattern::pattern, length(Pattern::pattern), I)...
+    };
+  };
+
+  template <typename Pattern, size_t... I>
+  constexpr uint64_t ByteTable<Pattern, Indices<I...>>::values[];
+
+  /**
+   * The matcher of a pattern fixed at compile time; see the top of the
+   * file. It has no state, so it is free to build and to share.
+   */
+  template <typename Pattern>
+  class Matcher
+  {
+  public:
+    static constexpr int n = length(Pattern::pattern);
+    static_assert(n > 0, "empty pattern");
+    static_assert(n <= 64, "patterns are limited to 64 characters");
+    static_assert(!counted(Pattern::pattern, n),
+                  "counted repetitions are not supported");
+    static_assert(!asserting(Pattern::pattern, n),
+                  "anchors and word boundaries are not supported");
+    static_assert(begin(Pattern::pattern, n - 1) == 0,
+                  "malformed pattern");
+
+    /**
+     * given an input [begin, end)
+     * says whether or not it is accepted
+     * @param begin
+     * @param end
+     * @return
+     */
+    static bool accept(char const * begin, char const * end)
+    {
+      if (begin == end) return empty;
+      uint64_t state = firsts & bytes[(unsigned char)*begin++];
+      while (state != 0 && begin != end)
+        state = step(state) & bytes[(unsigned char)*begin++];
+      return (state & lasts) != 0;
+    }
+
+    static bool accept(std::string const & input)
+    {
+      return accept(input.data(), input.data() + input.size());
+    }
+
+    /**
+     * given an input [begin, end)
+     * says whether or not some substring of it is accepted
+     * @param begin
+     * @param end
+     * @return
+     */
+    static bool search(char const * begin, char const * end)
+    {
+      if (empty) return true;
+      uint64_t state = 0;
+      while (begin != end)
+      {
+        state = (step(state) | firsts) & bytes[(unsigned char)*begin++];
+        if ((state & lasts) != 0) return true;
+      }
+      return false;
+    }
+
+  private:
+    static constexpr uint64_t firsts = first(Pattern::pattern, n - 1);
+    static constexpr uint64_t lasts = last(Pattern::pattern, n - 1);
+    static constexpr bool empty = nullable(Pattern::pattern, n - 1);
+    typedef FollowTable<Pattern, typename MakeIndices<n>::type> Follows;
+    typedef ByteTable<Pattern, typename MakeIndices<256>::type> Bytes;
+    static constexpr uint64_t const * follows = Follows::values;
+    static constexpr uint64_t const * bytes = Bytes::values;
+
+    /**
+     * the tokens which can come right after those in state
+     */
+    static uint64_t step(uint64_t state)
+    {
+      uint64_t next = 0;
+      for (; state != 0; state &= state - 1)
+        next |= follows[__builtin_ctzll(state)];
+      return next;
+    }
+  };
+}
+
+#endif /* STATIC_NFA_HPP */
@@ -0,0 +1,225 @@
+#include "stats.hpp"
+
+namespace nfa_stats
+{
+  static std::string escape(std::string s, bool json)
+  {
+    // JSON needs every control character escaped while Prometheus
+    // label values only know about \\, \" and \n
+    std::string res;
+    for (char c : s)
+    {
+      if (c == '\\' || c == '"')
+      {
+        res += '\\';
+        res += c;
+      }
+      else if (c == '\n')
+        res += "\\n";
+      else if (json && (unsigned char)c < 0x20)
+      {
+        static char const hex[] = "0123456789abcdef";
+        res += "\\u00";
+        res += hex[(c >> 4) & 0xf];
+        res += hex[c & 0xf];
+      }
+      else
+        res += c;
+    }
+    return res;
+  }
+
+  static void add(std::atomic<uint64_t> & counter, uint64_t n)
+  {
+    counter.fetch_add(n, std::memory_order_relaxed);
+  }
+
+  static uint64_t get(std::atomic<uint64_t> const & counter)
+  {
+    return counter.load(std::memory_order_relaxed);
+  }
+
+  PatternStats::PatternStats(std::string pattern)
+    : pattern(pattern), builds(0), statesBuilt(0), edgesBuilt(0),
+      buildNanos(0), calls(0), matches(0), charsScanned(0), steps(0),
+      activeSum(0), activeMax(0), epsilonIterations(0), acceptNanos(0)
+  {
+    for (int i = 0; i < latencyBuckets; ++i)
+      this->latency[i].store(0, std::memory_order_relaxed);
+  }
+
+  void PatternStats::recordBuild(uint64_t states, uint64_t edges,
+                                 uint64_t nanos)
+  {
+    add(this->builds, 1);
+    add(this->statesBuilt, states);
+    add(this->edgesBuilt, edges);
+    add(this->buildNanos, nanos);
+  }
+
+  void PatternStats::recordAccept(bool matched, uint64_t chars,
+                                  uint64_t steps, uint64_t activeSum,
+                                  uint64_t activeMax,
+                                  uint64_t epsilonIterations,
+                                  uint64_t nanos)
+  {
+    add(this->calls, 1);
+    add(this->matches, matched ? 1 : 0);
+    add(this->charsScanned, chars);
+    add(this->steps, steps);
+    add(this->activeSum, activeSum);
+    add(this->epsilonIterations, epsilonIterations);
+    add(this->acceptNanos, nanos);
+
+    uint64_t max = get(this->activeMax);
+    while (  max < activeMax
+          && !this->activeMax.compare_exchange_weak(
+                max, activeMax, std::memory_order_relaxed)
+          );
+
+    int bucket = 0;
+    while (bucket < latencyBuckets - 1 && (nanos >> (bucket + 1)) != 0)
+      ++bucket;
+    add(this->latency[bucket], 1);
+  }
+
+  Snapshot PatternStats::snapshot() const
+  {
+    Snapshot res;
+    res.pattern = this->pattern;
+    res.builds = get(this->builds);
+    res.statesBuilt = get(this->statesBuilt);
+    res.edgesBuilt = get(this->edgesBuilt);
+    res.buildNanos = get(this->buildNanos);
+    res.calls = get(this->calls);
+    res.matches = get(this->matches);
+    res.charsScanned = get(this->charsScanned);
+    res.steps = get(this->steps);
+    res.activeSum = get(this->activeSum);
+    res.activeMax = get(this->activeMax);
+    res.epsilonIterations = get(this->epsilonIterations);
+    res.acceptNanos = get(this->acceptNanos);
+    for (int i = 0; i < latencyBuckets; ++i)
+      res.latency[i] = get(this->latency[i]);
+    return res;
+  }
+
+  std::atomic<bool> Registry::enabled(false);
+  std::mutex Registry::mutex;
+  std::map<std::string, std::unique_ptr<PatternStats>> Registry::patterns;
+
+  PatternStats * Registry::get(std::string pattern)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::unique_ptr<PatternStats> & stats = patterns[pattern];
+    if (!stats)
+      stats.reset(new PatternStats(pattern));
+    return stats.get();
+  }
+
+  void Registry::setEnabled(bool on)
+  {
+    enabled.store(on, std::memory_order_relaxed);
+  }
+
+  void Registry::reset()
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    patterns.clear();
+  }
+
+  std::vector<Snapshot> Registry::snapshots()
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::vector<Snapshot> res;
+    for (auto & p : patterns)
+      res.push_back(p.second->snapshot());
+    return res;
+  }
+
+  void Registry::dumpJSON(std::ostream & os)
+  {
+    os << "{\"patterns\":[";
+    bool first = true;
+    for (Snapshot const & s : snapshots())
+    {
+      os << (first ? "" : ",")
+         << "{\"pattern\":\"" << escape(s.pattern, true) << "\""
+         << ",\"builds\":" << s.builds
+         << ",\"states_built\":" << s.statesBuilt
+         << ",\"edges_built\":" << s.edgesBuilt
+         << ",\"build_ns\":" << s.buildNanos
+         << ",\"calls\":" << s.calls
+         << ",\"matches\":" << s.matches
+         << ",\"chars_scanned\":" << s.charsScanned
+         << ",\"steps\":" << s.steps
+         << ",\"active_max\":" << s.activeMax
+         << ",\"active_mean\":" << s.activeMean()
+         << ",\"epsilon_iterations\":" << s.epsilonIterations
+         << ",\"accept_ns\":" << s.acceptNanos
+         << ",\"latency_ns_log2\":[";
+      for (int i = 0; i < latencyBuckets; ++i)
+        os << (i == 0 ? "" : ",") << s.latency[i];
+      os << "]}";
+      first = false;
+    }
+    os << "]}\n";
+  }
+
+  /**
+   * writes one metric family, one sample per pattern
+   */
+  template <typename Value>
+  static void family(std::ostream & os, std::vector<Snapshot> const & all,
+                     std::string name, std::string type, Value value)
+  {
+    os << "# TYPE " << name << ' ' << type << '\n';
+    for (Snapshot const & s : all)
+      os << name << "{pattern=\"" << escape(s.pattern, false) << "\"} "
+         << value(s) << '\n';
+  }
+
+  void Registry::dumpPrometheus(std::ostream & os)
+  {
+    std::vector<Snapshot> all = snapshots();
+    family(os, all, "grep11_builds_total", "counter",
+           [](Snapshot const & s) { return s.builds; });
+    family(os, all, "grep11_states_built_total", "counter",
+           [](Snapshot const & s) { return s.statesBuilt; });
+    family(os, all, "grep11_edges_built_total", "counter",
+           [](Snapshot const & s) { return s.edgesBuilt; });
+    family(os, all, "grep11_build_seconds_total", "counter",
+           [](Snapshot const & s) { return s.buildNanos / 1e9; });
+    family(os, all, "grep11_accept_calls_total", "counter",
+           [](Snapshot const & s) { return s.calls; });
+    family(os, all, "grep11_matches_total", "counter",
+           [](Snapshot const & s) { return s.matches; });
+    family(os, all, "grep11_chars_scanned_total", "counter",
+           [](Snapshot const & s) { return s.charsScanned; });
+    family(os, all, "grep11_epsilon_iterations_total", "counter",
+           [](Snapshot const & s) { return s.epsilonIterations; });
+    family(os, all, "grep11_active_set_max", "gauge",
+           [](Snapshot const & s) { return s.activeMax; });
+    family(os, all, "grep11_active_set_mean", "gauge",
+           [](Snapshot const & s) { return s.activeMean(); });
+
+    std::string name = "grep11_accept_latency_seconds";
+    os << "# TYPE " << name << " histogram\n";
+    for (Snapshot const & s : all)
+    {
+      std::string pattern = "pattern=\"" + escape(s.pattern, false) + "\"";
+      uint64_t cumulative = 0;
+      for (int i = 0; i < latencyBuckets; ++i)
+      {
+        cumulative += s.latency[i];
+        os << name << "_bucket{" << pattern << ",le=\""
+           << (double)((uint64_t)1 << (i + 1)) / 1e9 << "\"} "
+           << cumulative << '\n';
+      }
+      os << name << "_bucket{" << pattern << ",le=\"+Inf\"} "
+         << cumulative << '\n'
+         << name << "_sum{" << pattern << "} " << s.acceptNanos / 1e9 << '\n'
+         << name << "_count{" << pattern << "} " << s.calls << '\n';
+    }
+  }
+}
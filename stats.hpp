@@ -0,0 +1,193 @@
+#ifndef STATS_HPP
+#define STATS_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+/**
+ * Instrumentation is compiled in only when GREP11_STATS is defined
+ * (make STATS=1). Otherwise NFA_STATS(...) expands to nothing, so the
+ * counters on the matching loop cost nothing at all.
+ */
+#ifdef GREP11_STATS
+#define NFA_STATS(...) __VA_ARGS__
+#else
+#define NFA_STATS(...)
+#endif
+
+namespace nfa_stats
+{
+  /**
+   * Number of buckets of the latency histogram. Bucket i counts the calls
+   * which took less than 2^(i+1) nanoseconds (and at least 2^i, except
+   * for bucket 0).
+   */
+  static int const latencyBuckets = 40;
+
+  /**
+   * Plain copy of the counters of one pattern
+   */
+  struct Snapshot
+  {
+    std::string pattern;
+    uint64_t builds;
+    uint64_t statesBuilt;
+    uint64_t edgesBuilt;
+    uint64_t buildNanos;
+    uint64_t calls;
+    uint64_t matches;
+    uint64_t charsScanned;
+    uint64_t steps;
+    uint64_t activeSum;
+    uint64_t activeMax;
+    uint64_t epsilonIterations;
+    uint64_t acceptNanos;
+    uint64_t latency[latencyBuckets];
+
+    double activeMean() const
+    {
+      return this->steps == 0 ? 0.0 : (double)this->activeSum / this->steps;
+    }
+  };
+
+  /**
+   * Counters gathered for one pattern. Every field is updated with relaxed
+   * atomics once per call, so one instance can be shared by all threads
+   * matching with the same pattern.
+   */
+  class PatternStats
+  {
+  public:
+    PatternStats(std::string pattern);
+    std::string getPattern() const { return this->pattern; }
+
+    /**
+     * records one construction of the automaton
+     * @param states number of states built
+     * @param edges number of edges built
+     * @param nanos time spent in construction
+     */
+    void recordBuild(uint64_t states, uint64_t edges, uint64_t nanos);
+
+    /**
+     * records one call to accept
+     * @param matched the result of the call
+     * @param chars characters scanned
+     * @param steps characters for which an active set was computed
+     * @param activeSum sum of the active set sizes over all steps
+     * @param activeMax largest active set size
+     * @param epsilonIterations passes made to close epsilon transitions
+     * @param nanos time spent in the call
+     */
+    void recordAccept(bool matched, uint64_t chars, uint64_t steps,
+                      uint64_t activeSum, uint64_t activeMax,
+                      uint64_t epsilonIterations, uint64_t nanos);
+
+    Snapshot snapshot() const;
+
+  private:
+    std::string pattern;
+    std::atomic<uint64_t> builds;
+    std::atomic<uint64_t> statesBuilt;
+    std::atomic<uint64_t> edgesBuilt;
+    std::atomic<uint64_t> buildNanos;
+    std::atomic<uint64_t> calls;
+    std::atomic<uint64_t> matches;
+    std::atomic<uint64_t> charsScanned;
+    std::atomic<uint64_t> steps;
+    std::atomic<uint64_t> activeSum;
+    std::atomic<uint64_t> activeMax;
+    std::atomic<uint64_t> epsilonIterations;
+    std::atomic<uint64_t> acceptNanos;
+    std::atomic<uint64_t> latency[latencyBuckets];
+  };
+
+  /**
+   * Process-wide table of per-pattern counters.
+   */
+  class Registry
+  {
+  public:
+    /**
+     * gives the counters of a pattern, creating them on first use;
+     * the returned pointer stays valid until reset is called
+     * @param pattern
+     * @return
+     */
+    static PatternStats * get(std::string pattern);
+
+    /**
+     * turns recording on or off at runtime
+     * @param on
+     */
+    static void setEnabled(bool on);
+    static bool isEnabled()
+    {
+      return enabled.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * drops every counter gathered so far
+     */
+    static void reset();
+
+    /**
+     * copies the counters of every pattern, ordered by pattern
+     * @return
+     */
+    static std::vector<Snapshot> snapshots();
+
+    /**
+     * writes every pattern's counters as one JSON document
+     * @param os
+     */
+    static void dumpJSON(std::ostream & os);
+
+    /**
+     * writes every pattern's counters in the Prometheus text format,
+     * suitable for the node exporter textfile collector
+     * @param os
+     */
+    static void dumpPrometheus(std::ostream & os);
+
+  private:
+    static std::atomic<bool> enabled;
+    static std::mutex mutex;
+    static std::map<std::string, std::unique_ptr<PatternStats>> patterns;
+  };
+
+  /**
+   * Measures the elapsed time since its creation.
+   * A stopwatch which is not running never reads the clock.
+   */
+  class Stopwatch
+  {
+  public:
+    Stopwatch(bool running = true) : running(running)
+    {
+      if (running)
+        this->start = std::chrono::steady_clock::now();
+    }
+
+    uint64_t nanos() const
+    {
+      if (!this->running)
+        return 0;
+      return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now() - this->start).count();
+    }
+
+  private:
+    bool running;
+    std::chrono::steady_clock::time_point start;
+  };
+}
+
+#endif /* STATS_HPP */
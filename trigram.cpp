@@ -0,0 +1,345 @@
+#include "trigram.hpp"
+#include "literal.hpp"
+#include "memory.hpp"
+#include <algorithm>
+
+namespace nfa_trigram
+{
+  /**
+   * exact sets larger than this are turned into prefixes and suffixes
+   */
+  static size_t const maxExact = 7;
+  /**
+   * prefix and suffix sets larger than this are cut shorter
+   */
+  static size_t const maxSet = 20;
+  /**
+   * classes larger than this tell nothing
+   */
+  static size_t const maxClass = 100;
+
+  uint32_t keyOf(char a, char b, char c)
+  {
+    return  (uint32_t)(unsigned char)nfa_literal::foldCase(a) << 16
+          | (uint32_t)(unsigned char)nfa_literal::foldCase(b) << 8
+          | (uint32_t)(unsigned char)nfa_literal::foldCase(c);
+  }
+
+  Query Query::all()
+  {
+    return Query(Op::all);
+  }
+
+  Query Query::none()
+  {
+    return Query(Op::none);
+  }
+
+  Query Query::trigram(uint32_t key)
+  {
+    Query q(Op::conjunction);
+    q.trigrams.insert(key);
+    return q;
+  }
+
+  Query Query::andOf(Query q1, Query q2)
+  {
+    if (q1.op == Op::none || q2.op == Op::all) return q1;
+    if (q2.op == Op::none || q1.op == Op::all) return q2;
+    return combine(Op::conjunction, q1, q2);
+  }
+
+  Query Query::orOf(Query q1, Query q2)
+  {
+    if (q1.op == Op::all || q2.op == Op::none) return q1;
+    if (q2.op == Op::all || q1.op == Op::none) return q2;
+    return combine(Op::disjunction, q1, q2);
+  }
+
+  Query Query::combine(Op op, Query q1, Query q2)
+  {
+    Query q(op);
+    for (Query * operand : {&q1, &q2})
+    {
+      if (operand->op != op && !operand->isTrigram())
+      {
+        q.subs.push_back(*operand);
+        continue;
+      }
+      q.trigrams.insert(operand->trigrams.begin(), operand->trigrams.end());
+      q.subs.insert(q.subs.end(), operand->subs.begin(), operand->subs.end());
+    }
+
+    // a sub-query holding one of the trigrams is absorbed, as a b (a | c)
+    // is a b; equal sub-queries are kept once
+    std::vector<Query> subs;
+    for (Query & sub : q.subs)
+    {
+      bool absorbed = std::find(subs.begin(), subs.end(), sub) != subs.end();
+      for (uint32_t key : sub.trigrams)
+        absorbed = absorbed || q.trigrams.count(key) != 0;
+      if (!absorbed)
+        subs.push_back(std::move(sub));
+    }
+    q.subs.swap(subs);
+
+    if (q.trigrams.empty() && q.subs.size() == 1)
+      return q.subs[0];
+    if (q.trigrams.size() == 1 && q.subs.empty())
+      q.op = Op::conjunction;
+    return q;
+  }
+
+  Query Query::andTrigrams(std::set<std::string> const & strings) const
+  {
+    if (strings.empty()) return *this;
+    for (std::string const & s : strings)
+      if (s.size() < 3) return *this;
+
+    Query any = none();
+    for (std::string const & s : strings)
+    {
+      Query each = all();
+      for (size_t i = 0; i + 3 <= s.size(); ++i)
+        each = andOf(each, trigram(keyOf(s[i], s[i + 1], s[i + 2])));
+      any = orOf(any, each);
+    }
+    return andOf(*this, any);
+  }
+
+  bool Query::operator==(Query const & other) const
+  {
+    return this->op == other.op && this->trigrams == other.trigrams
+      && this->subs == other.subs;
+  }
+
+  size_t Query::memoryUsage() const
+  {
+    size_t res = nfa_memory::setBytes(this->trigrams)
+               + nfa_memory::vectorBytes(this->subs);
+    for (Query const & sub : this->subs)
+      res += sub.memoryUsage();
+    return res;
+  }
+
+  std::string Query::toString() const
+  {
+    if (this->op == Op::all) return "+";
+    if (this->op == Op::none) return "-";
+    std::string separator = this->op == Op::conjunction ? " " : " | ";
+    std::string s;
+    for (uint32_t key : this->trigrams)
+    {
+      if (!s.empty()) s += separator;
+      s += (char)(key >> 16);
+      s += (char)(key >> 8);
+      s += (char)key;
+    }
+    for (Query const & sub : this->subs)
+    {
+      if (!s.empty()) s += separator;
+      s += "(" + sub.toString() + ")";
+    }
+    return s;
+  }
+
+  static size_t minLength(std::set<std::string> const & set)
+  {
+    size_t n = set.empty() ? 0 : SIZE_MAX;
+    for (std::string const & s : set)
+      n = std::min(n, s.size());
+    return n;
+  }
+
+  static std::set<std::string> crossOf(std::set<std::string> const & set1,
+                                       std::set<std::string> const & set2)
+  {
+    std::set<std::string> set;
+    for (std::string const & s1 : set1)
+      for (std::string const & s2 : set2)
+        set.insert(s1 + s2);
+    return set;
+  }
+
+  static std::set<std::string> joinOf(std::set<std::string> set1,
+                                      std::set<std::string> const & set2)
+  {
+    set1.insert(set2.begin(), set2.end());
+    return set1;
+  }
+
+  Analysis Analysis::ofChar(char c)
+  {
+    Analysis a;
+    a.hasExact = true;
+    a.exact.insert(std::string(1, nfa_literal::foldCase(c)));
+    return a;
+  }
+
+  Analysis Analysis::ofClass(std::string const & bytes)
+  {
+    if (bytes.size() > maxClass) return ofAny(false);
+    Analysis a;
+    a.hasExact = true;
+    for (char c : bytes)
+      a.exact.insert(std::string(1, nfa_literal::foldCase(c)));
+    a.simplify();
+    return a;
+  }
+
+  Analysis Analysis::ofEmpty()
+  {
+    Analysis a;
+    a.emptyable = true;
+    a.hasExact = true;
+    a.exact.insert("");
+    return a;
+  }
+
+  Analysis Analysis::ofAny(bool emptyable)
+  {
+    Analysis a;
+    a.emptyable = emptyable;
+    a.prefix.insert("");
+    a.suffix.insert("");
+    return a;
+  }
+
+  Analysis Analysis::concatOf(Analysis a1, Analysis a2)
+  {
+    Analysis a;
+    a.emptyable = a1.emptyable && a2.emptyable;
+    a.match = Query::andOf(a1.match, a2.match);
+    if (a1.hasExact && a2.hasExact)
+    {
+      a.hasExact = true;
+      a.exact = crossOf(a1.exact, a2.exact);
+    }
+    else
+    {
+      if (a1.hasExact)
+        a.prefix = crossOf(a1.exact, a2.prefix);
+      else if (a1.emptyable)
+        a.prefix = joinOf(a1.prefix, a2.hasExact ? a2.exact : a2.prefix);
+      else
+        a.prefix = a1.prefix;
+      if (a2.hasExact)
+        a.suffix = crossOf(a1.suffix, a2.exact);
+      else if (a2.emptyable)
+        a.suffix = joinOf(a2.suffix, a1.hasExact ? a1.exact : a1.suffix);
+      else
+        a.suffix = a2.suffix;
+    }
+    // a match holds one of the strings where the two meet
+    if (  !a1.hasExact && !a2.hasExact
+       && a1.suffix.size() <= maxSet && a2.prefix.size() <= maxSet
+       && minLength(a1.suffix) + minLength(a2.prefix) >= 3
+       )
+      a.match = a.match.andTrigrams(crossOf(a1.suffix, a2.prefix));
+    a.simplify();
+    return a;
+  }
+
+  Analysis Analysis::unionOf(Analysis a1, Analysis a2)
+  {
+    Analysis a;
+    a.emptyable = a1.emptyable || a2.emptyable;
+    if (a1.hasExact && a2.hasExact)
+    {
+      a.hasExact = true;
+      a.exact = joinOf(a1.exact, a2.exact);
+    }
+    else
+    {
+      a1.addExact();
+      a2.addExact();
+      a.prefix = joinOf(a1.hasExact ? a1.exact : a1.prefix,
+                        a2.hasExact ? a2.exact : a2.prefix);
+      a.suffix = joinOf(a1.hasExact ? a1.exact : a1.suffix,
+                        a2.hasExact ? a2.exact : a2.suffix);
+    }
+    a.match = Query::orOf(a1.match, a2.match);
+    a.simplify();
+    return a;
+  }
+
+  Analysis Analysis::plusOf(Analysis a)
+  {
+    // there is at least one match of a, so its ends stay the same
+    if (a.hasExact)
+    {
+      a.prefix = a.exact;
+      a.suffix = a.exact;
+      a.exact.clear();
+      a.hasExact = false;
+    }
+    a.simplify();
+    return a;
+  }
+
+  Analysis Analysis::maxOnceOf(Analysis a)
+  {
+    return unionOf(a, ofEmpty());
+  }
+
+  Analysis Analysis::repeatOf(Analysis a, uint32_t min, uint32_t max)
+  {
+    if (min == 1 && max == 1) return a;
+    if (max == 0) return ofEmpty();
+    return min == 0 ? maxOnceOf(plusOf(a)) : plusOf(a);
+  }
+
+  Query Analysis::query() const
+  {
+    Analysis a = *this;
+    a.simplify();
+    a.addExact();
+    return a.match;
+  }
+
+  void Analysis::addExact()
+  {
+    if (this->hasExact)
+      this->match = this->match.andTrigrams(this->exact);
+  }
+
+  void Analysis::simplify()
+  {
+    // exact strings long enough for trigrams, or too many of them, are
+    // only remembered by their trigrams and their ends
+    if (  this->hasExact
+       && (this->exact.size() > maxExact || minLength(this->exact) >= 3)
+       )
+    {
+      this->addExact();
+      for (std::string const & s : this->exact)
+      {
+        this->prefix.insert(s.substr(0, 2));
+        this->suffix.insert(s.size() < 2 ? s : s.substr(s.size() - 2));
+      }
+      this->exact.clear();
+      this->hasExact = false;
+    }
+    if (!this->hasExact)
+    {
+      this->simplifySet(this->prefix, false);
+      this->simplifySet(this->suffix, true);
+    }
+  }
+
+  void Analysis::simplifySet(std::set<std::string> & set, bool isSuffix)
+  {
+    // what the long strings tell goes into the query, then the set is
+    // cut to strings of two bytes, and shorter while it is too large
+    this->match = this->match.andTrigrams(set);
+    for (size_t n = 2; ; --n)
+    {
+      std::set<std::string> cut;
+      for (std::string const & s : set)
+        cut.insert(s.size() <= n ? s
+                   : isSuffix ? s.substr(s.size() - n) : s.substr(0, n));
+      set.swap(cut);
+      if (n == 0 || set.size() <= maxSet) break;
+    }
+  }
+}
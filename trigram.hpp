@@ -0,0 +1,146 @@
+#ifndef TRIGRAM_HPP
+#define TRIGRAM_HPP
+
+#include <cstdint>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace nfa_trigram
+{
+  /**
+   * the trigram of three bytes as a 24-bit key, ASCII case folded
+   * @param a
+   * @param b
+   * @param c
+   * @return
+   */
+  uint32_t keyOf(char a, char b, char c);
+
+  /**
+   * A boolean query over trigrams, which a text containing a match of a
+   * pattern satisfies: the text must hold all the trigrams of an and,
+   * some of those of an or, and the sub-queries likewise. Trigrams are
+   * ASCII case folded, as an index holds them.
+   */
+  class Query
+  {
+  public:
+    enum class Op { all, none, conjunction, disjunction };
+
+    /**
+     * the query every text satisfies
+     */
+    static Query all();
+
+    /**
+     * the query no text satisfies
+     */
+    static Query none();
+
+    /**
+     * the query a text holding the trigram satisfies
+     * @param key see keyOf
+     */
+    static Query trigram(uint32_t key);
+
+    static Query andOf(Query q1, Query q2);
+    static Query orOf(Query q1, Query q2);
+
+    /**
+     * says that the text holds one of the strings of a set, when they are
+     * all long enough to have trigrams
+     * @param strings
+     * @return this and the or of the trigrams of each string
+     */
+    Query andTrigrams(std::set<std::string> const & strings) const;
+
+    Op getOp() const { return this->op; }
+    std::set<uint32_t> const & getTrigrams() const { return this->trigrams; }
+    std::vector<Query> const & getSubs() const { return this->subs; }
+
+    bool operator==(Query const & other) const;
+
+    /**
+     * the query in a readable form, for instance
+     * abc bcd (xyz | uvw), with + for all and - for none
+     */
+    std::string toString() const;
+
+    /**
+     * the bytes the query takes on the heap, its sub-queries included
+     */
+    size_t memoryUsage() const;
+
+  private:
+    Query(Op op) : op(op) {}
+
+    /**
+     * whether this is one trigram, which is the same and-ed or or-ed
+     */
+    bool isTrigram() const
+    {
+      return this->op == Op::conjunction && this->trigrams.size() == 1
+        && this->subs.empty();
+    }
+
+    static Query combine(Op op, Query q1, Query q2);
+
+    Op op;
+    std::set<uint32_t> trigrams;
+    std::vector<Query> subs;
+  };
+
+  /**
+   * What is known of the strings a sub-expression matches, after the
+   * regular expression analysis of Code Search: whether it matches the
+   * empty string, the exact strings it matches when they are few, else
+   * prefixes and suffixes all of its matches have, and a query any text
+   * containing one of its matches satisfies. Strings are ASCII case
+   * folded. The sets are kept small by moving what they tell into the
+   * query as trigrams.
+   */
+  struct Analysis
+  {
+    bool emptyable = false;
+    bool hasExact = false;
+    std::set<std::string> exact;
+    std::set<std::string> prefix;
+    std::set<std::string> suffix;
+    Query match = Query::all();
+
+    static Analysis ofChar(char c);
+    static Analysis ofEmpty();
+
+    /**
+     * a byte class; large ones tell nothing
+     * @param bytes its members
+     * @return
+     */
+    static Analysis ofClass(std::string const & bytes);
+
+    /**
+     * a sub-expression nothing is known of, as a repetition which may be
+     * empty
+     */
+    static Analysis ofAny(bool emptyable);
+
+    static Analysis concatOf(Analysis a1, Analysis a2);
+    static Analysis unionOf(Analysis a1, Analysis a2);
+    static Analysis plusOf(Analysis a);
+    static Analysis maxOnceOf(Analysis a);
+    static Analysis repeatOf(Analysis a, uint32_t min, uint32_t max);
+
+    /**
+     * the query of a whole pattern
+     */
+    Query query() const;
+
+  private:
+    void addExact();
+    void simplify();
+    void simplifySet(std::set<std::string> & set, bool isSuffix);
+  };
+}
+
+#endif /* TRIGRAM_HPP */